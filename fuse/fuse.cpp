@@ -225,25 +225,26 @@ extern "C" {
         
         return unwrap([&](){
             INodeID id = fs->path2iid(path);
-            INode inode = fs->im->read_inode(id);
-            inode.ctime = time(nullptr);
+            // update the cached inode in place
+            INodeHandle inode = fs->im->get_inode(id);
+            inode->ctime = time(nullptr);
             if(ts == nullptr) {
-                inode.atime = inode.ctime;
-                inode.mtime = inode.ctime;
+                inode->atime = inode->ctime;
+                inode->mtime = inode->ctime;
             } else {
                 if(ts[0].tv_nsec == UTIME_NOW) {
-                    inode.atime = inode.ctime;
+                    inode->atime = inode->ctime;
                 } else if (ts[0].tv_nsec != UTIME_OMIT) {
-                    inode.atime = ts[0].tv_sec;
+                    inode->atime = ts[0].tv_sec;
                 }
 
                 if(ts[1].tv_nsec == UTIME_NOW) {
-                    inode.mtime = inode.ctime;
+                    inode->mtime = inode->ctime;
                 } else if (ts[1].tv_nsec != UTIME_OMIT) {
-                    inode.mtime = ts[1].tv_sec;
+                    inode->mtime = ts[1].tv_sec;
                 }
             }
-            fs->im->write_inode(id,inode);
+            inode.mark_dirty();
             return 0;
         });
     }
@@ -370,11 +371,47 @@ extern "C" {
 
         // maybe we can evict all the cached things?
         if(fi != nullptr) {
+            if(fi->fh != config::null_file_handler) {
+                try {
+                    fs->release(config::rest_file_handler(fi->fh));
+                } catch (const std::exception& e) {
+                    LOG(ERROR) << "#release: fail to release the preallocated blocks " << e.what();
+                }
+            }
             fi->fh = config::null_file_handler;
         }
         return 0;
     }
 
+    int s_flush(const char* path, struct fuse_file_info* fi) {
+        LOG(INFO) << "#flush " << path;
+        // close() doesn't ask for durability, leave the dirty blocks to the group commit
+        return 0;
+    }
+
+    int s_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+        LOG(INFO) << "#fsync " << path << " " << datasync;
+
+        // the metadata shares the storage with the data, so datasync can't do less
+        try {
+            fs->sync();
+        } catch (const fs_exception& e) {
+            LOG(ERROR) << "#fsync " << e.what();
+            return -e.code().value();
+        } catch (const fs_error& e) {
+            LOG(ERROR) << "#fsync " << e.what();
+            return -EIO;
+        }
+        return 0;
+    }
+
+    void s_destroy(void* private_data) {
+        LOG(INFO) << "#destroy";
+        // sync and release the storage before unmounting
+        delete fs;
+        fs = nullptr;
+    }
+
     int s_link(const char* src_path, const char* dst_path) {
         LOG(INFO) << "#link " << src_path << " <- " << dst_path;
 
@@ -406,24 +443,13 @@ extern "C" {
 
 
 
-    // TODO: add a statfs function to filesystem ?
     int s_statfs(const char *path, struct statvfs *stbuf) {
         LOG(INFO) << "#statfs " << path;
 
         return unwrap([&](){
-            Block bl;
-            fs->storage->read_block(0,bl.data);
-            super_block* fs_sb = (super_block*)&bl;
-
-            stbuf->f_bsize = config::block_size;   // file system block size
-            stbuf->f_frsize = config::block_size;  // fragment size
-            stbuf->f_blocks = fs_sb->nr_dblock;    // size of fs in f_frsize units
-            stbuf->f_files = fs_sb->nr_iblock;     // # inodes
-            stbuf->f_fsid = fs_sb->magic_number;   // file system ID
-            stbuf->f_flag = 0;                     // mount flags
-            stbuf->f_namemax = 1024;               // maximum filename length
-            
-            return 0; 
+            // no I/O, the counters are kept in memory
+            fs->statfs(stbuf);
+            return 0;
        });
     }
        
@@ -507,7 +533,21 @@ int main(int argc, char *argv[]) {
         ("i,inode", "number of inode", cxxopts::value<uint64_t>()->default_value("2000"))
         ("s,storage", "storage in GB", cxxopts::value<uint64_t>())
         ("e,entry", "number of files", cxxopts::value<uint64_t>())
-        ("f,file", "storage file", cxxopts::value<std::string>()->default_value("/dev/vdb"))
+        ("f,file", "storage file, empty for the in-memory storage", cxxopts::value<std::string>()->default_value("/dev/vdb"))
+        ("t,backend", "storage backend (fstream, pread, direct, uring, mmap)", cxxopts::value<std::string>()->default_value("pread"))
+        ("H,hugepage", "huge pages for the in-memory storage (none, thp, explicit)", cxxopts::value<std::string>()->default_value("none"))
+        ("a,allocator", "data block allocator of a new file system (freelist, bitmap)", cxxopts::value<std::string>()->default_value("freelist"))
+        ("alloc-batch", "number of free blocks each thread takes from the free list at a time, 0 to disable", cxxopts::value<uint64_t>()->default_value("0"))
+        ("delalloc", "number of blocks of regular files buffered before they get data blocks, 0 to allocate at write time", cxxopts::value<uint64_t>()->default_value("0"))
+        ("prealloc", "largest number of blocks reserved ahead of a streaming append, 0 to disable", cxxopts::value<uint64_t>()->default_value("1024"))
+        ("discard", "punch holes in the storage file (or trim the device) for the freed blocks in the background")
+        ("discard-rate", "number of blocks discarded per second at most, 0 for no limit", cxxopts::value<uint64_t>()->default_value("25600"))
+        ("extents", "map the blocks of new files by extents instead of the direct/indirect tree")
+        ("lazy-init", "format a new file system without initializing the free list and the inode table, they are initialized on first use")
+        ("c,cache", "number of blocks in the block cache, 0 to disable", cxxopts::value<uint64_t>()->default_value("4096"))
+        ("w,writeback", "buffer the writes and commit them in groups, durable on fsync")
+        ("commit-interval", "write-back commit interval in ms", cxxopts::value<uint64_t>()->default_value("5000"))
+        ("dirty-threshold", "number of dirty blocks which triggers a write-back commit", cxxopts::value<uint64_t>()->default_value("1024"))
         ("m,mount", "mount point", cxxopts::value<std::string>())
         ("h,help", "Print usage");
 
@@ -532,6 +572,9 @@ int main(int argc, char *argv[]) {
         nr_iblock = nr_entry / (config::block_size / config::inode_size);
         if(nr_iblock > nr_entry * (config::block_size / config::inode_size))
             nr_iblock++;
+        // room for the free-inode bitmap
+        nr_iblock += (nr_iblock * INodeManager::nr_inode_per_block + INodeManager::nr_inode_per_bitmap_block - 1)
+                     / INodeManager::nr_inode_per_bitmap_block;
     }
 
     if (result.count("storage")) {
@@ -540,7 +583,23 @@ int main(int argc, char *argv[]) {
     }
     std::string path = result["file"].as<std::string>();
 
-    fs = new FileSystem(nr_block, nr_iblock,path);
+    mount_options opts;
+    opts.backend = result["backend"].as<std::string>();
+    opts.huge_page = result["hugepage"].as<std::string>();
+    opts.allocator = result["allocator"].as<std::string>();
+    opts.alloc_batch = result["alloc-batch"].as<uint64_t>();
+    opts.delalloc_blocks = result["delalloc"].as<uint64_t>();
+    opts.prealloc_blocks = result["prealloc"].as<uint64_t>();
+    opts.discard = result.count("discard") > 0;
+    opts.discard_rate = result["discard-rate"].as<uint64_t>();
+    opts.lazy_init = result.count("lazy-init") > 0;
+    opts.extents = result.count("extents") > 0;
+    opts.cache_blocks = result["cache"].as<uint64_t>();
+    opts.writeback = result.count("writeback") > 0;
+    opts.commit_interval_ms = result["commit-interval"].as<uint64_t>();
+    opts.dirty_threshold = result["dirty-threshold"].as<uint64_t>();
+
+    fs = new FileSystem(nr_block, nr_iblock,path,opts);
 
     if(!fs->init) {
         Block block;
@@ -572,6 +631,9 @@ int main(int argc, char *argv[]) {
     s_oper.readlink = s_readlink;
     s_oper.release = s_release;
     s_oper.link = s_link;
+    s_oper.flush = s_flush;
+    s_oper.fsync = s_fsync;
+    s_oper.destroy = s_destroy;
  
     // call s_init here?
     int argcount = 0;
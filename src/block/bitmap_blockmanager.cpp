@@ -0,0 +1,616 @@
+#include <algorithm>
+#include <iterator>
+#include "block/bitmap_blockmanager.h"
+#include "block/super_block.h"
+#include "block/block.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+
+namespace solid {
+    namespace {
+        const uint64_t nr_words_per_block = config::block_size / sizeof(uint64_t);
+        const uint64_t full = ~0ULL;
+    };
+
+    BitmapBlockManager::BitmapBlockManager(Storage* p_storage,super_block* p_sb,bool writeback)
+        : BlockManager(p_storage), sblock(p_sb == nullptr ? own_sblock : *p_sb), writeback(writeback) {
+        if(p_sb == nullptr) {
+            p_storage->read_block(0,sblock.data);
+        }
+        layout();
+        std::vector<BlockID> ids;
+        std::vector<uint8_t*> dsts;
+        for(BlockID i=0;i<nr_bitmap && !is_lazy(i);i++) {
+            ids.push_back(sblock.s_dblock + i);
+            dsts.push_back((uint8_t*)(levels[0].data() + i * nr_words_per_block));
+        }
+        p_storage->read_blocks(ids,dsts);
+        // the bits past the last block are never free, nor the bitmap blocks (some may be lazy)
+        for(auto i=nr_bits;i<levels[0].size()*64;i++) {
+            levels[0][i/64] |= 1ULL << (i%64);
+        }
+        for(BlockID i=0;i<nr_bitmap;i++) {
+            levels[0][i/64] |= 1ULL << (i%64);
+        }
+        uint64_t nr_used = 0;
+        for(auto w : levels[0]) {
+            nr_used += __builtin_popcountll(w);
+        }
+        nr_free = levels[0].size() * 64 - nr_used;
+        build_summary();
+        build_extents();
+    }
+
+    BitmapBlockManager::~BitmapBlockManager() {
+        try {
+            sync();
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "@~BitmapBlockManager: fail to write back the bitmap " << e.what();
+        }
+    }
+
+    /**
+     * @brief size the bitmap after the super block, all the bits cleared
+    */
+    void BitmapBlockManager::layout() {
+        nr_bits = sblock.nr_block > sblock.s_dblock ? sblock.nr_block - sblock.s_dblock : 0;
+        nr_bitmap = (nr_bits + nr_blocks_per_bitmap_block - 1) / nr_blocks_per_bitmap_block;
+        levels.assign(1,std::vector<uint64_t>(nr_bitmap * nr_words_per_block,0));
+        dirty.clear();
+    }
+
+    void BitmapBlockManager::build_summary() {
+        levels.resize(1);
+        while(levels.back().size() > 1) {
+            const std::vector<uint64_t>& prev = levels.back();
+            std::vector<uint64_t> next((prev.size() + 63) / 64,0);
+            for(uint64_t i=0;i<next.size()*64;i++) {
+                // the missing words count as full
+                if(i >= prev.size() || prev[i] == full)
+                    next[i/64] |= 1ULL << (i%64);
+            }
+            levels.push_back(std::move(next));
+        }
+    }
+
+    /**
+     * @brief word of the bitmap has changed, fix the summary bits above it
+    */
+    void BitmapBlockManager::update_summary(uint64_t word) {
+        for(auto k=1;k<levels.size();k++) {
+            uint64_t& parent = levels[k][word/64];
+            uint64_t old = parent;
+            if(levels[k-1][word] == full) {
+                parent |= 1ULL << (word%64);
+            } else {
+                parent &= ~(1ULL << (word%64));
+            }
+            if(parent == old) {
+                break;
+            }
+            word /= 64;
+        }
+    }
+
+    /**
+     * @brief mark the bits [bit, bit+n) used or free
+    */
+    void BitmapBlockManager::set_range(uint64_t bit, uint64_t n, bool used) {
+        mark_unclean();
+        if(used) {
+            take_extent(bit, n);
+        } else {
+            give_extent(bit, n);
+        }
+        while(n > 0) {
+            uint64_t word = bit / 64;
+            uint64_t offset = bit % 64;
+            uint64_t len = std::min<uint64_t>(n, 64 - offset);
+            uint64_t mask = (len == 64 ? full : ((1ULL << len) - 1)) << offset;
+            uint64_t& w = levels[0][word];
+            uint64_t changed = used ? (~w & mask) : (w & mask);
+            w = used ? (w | mask) : (w & ~mask);
+            if(used) {
+                nr_free -= __builtin_popcountll(changed);
+            } else {
+                nr_free += __builtin_popcountll(changed);
+            }
+            update_summary(word);
+            dirty.insert(word / nr_words_per_block);
+            bit += len;
+            n -= len;
+        }
+    }
+
+    /**
+     * @brief index all the runs of free bits
+    */
+    void BitmapBlockManager::build_extents() {
+        free_by_start.clear();
+        free_by_len.clear();
+        const std::vector<uint64_t>& bitmap = levels[0];
+        uint64_t start = 0;
+        uint64_t len = 0;
+        for(uint64_t i=0;i<bitmap.size();i++) {
+            uint64_t free = ~bitmap[i];
+            if(free == full) {
+                if(len == 0)
+                    start = i * 64;
+                len += 64;
+                continue;
+            }
+            uint64_t pos = 0;
+            while(pos < 64) {
+                uint64_t f = free >> pos;
+                if(f == 0) {
+                    break;
+                }
+                if((f & 1) == 0) {
+                    if(len > 0) {
+                        insert_extent(start, len);
+                        len = 0;
+                    }
+                    pos += __builtin_ctzll(f);
+                    continue;
+                }
+                uint64_t ones = __builtin_ctzll(~f);
+                if(len == 0)
+                    start = i * 64 + pos;
+                len += ones;
+                pos += ones;
+            }
+            // the run is broken unless it reaches the top bit
+            if((bitmap[i] >> 63) != 0 && len > 0) {
+                insert_extent(start, len);
+                len = 0;
+            }
+        }
+        if(len > 0) {
+            insert_extent(start, len);
+        }
+    }
+
+    void BitmapBlockManager::insert_extent(uint64_t start, uint64_t len) {
+        free_by_start[start] = len;
+        free_by_len.insert(std::make_pair(len, start));
+    }
+
+    void BitmapBlockManager::erase_extent(std::map<uint64_t, uint64_t>::iterator p) {
+        free_by_len.erase(std::make_pair(p->second, p->first));
+        free_by_start.erase(p);
+    }
+
+    /**
+     * @brief [bit, bit+n) is no longer free, split the extent holding it
+    */
+    void BitmapBlockManager::take_extent(uint64_t bit, uint64_t n) {
+        auto p = free_by_start.upper_bound(bit);
+        if(p == free_by_start.begin()) {
+            throw fs_error("@take_extent: ", bit, " is not free");
+        }
+        --p;
+        uint64_t start = p->first;
+        uint64_t len = p->second;
+        if(start + len < bit + n) {
+            throw fs_error("@take_extent: ", bit, " is not free");
+        }
+        erase_extent(p);
+        if(bit > start) {
+            insert_extent(start, bit - start);
+        }
+        if(bit + n < start + len) {
+            insert_extent(bit + n, start + len - bit - n);
+        }
+    }
+
+    /**
+     * @brief [bit, bit+n) becomes free, merge it with the neighbours
+    */
+    void BitmapBlockManager::give_extent(uint64_t bit, uint64_t n) {
+        uint64_t start = bit;
+        uint64_t len = n;
+        auto r = free_by_start.find(bit + n);
+        if(r != free_by_start.end()) {
+            len += r->second;
+            erase_extent(r);
+        }
+        auto l = free_by_start.lower_bound(bit);
+        if(l != free_by_start.begin()) {
+            --l;
+            if(l->first + l->second == bit) {
+                start = l->first;
+                len += l->second;
+                erase_extent(l);
+            }
+        }
+        insert_extent(start, len);
+    }
+
+    /**
+     * @brief the first word from word on which is not full, levels[0].size() if none
+    */
+    uint64_t BitmapBlockManager::next_nonfull(uint64_t word) {
+        const std::vector<uint64_t>& bitmap = levels[0];
+        if(levels.size() < 2) {
+            while(word < bitmap.size() && bitmap[word] == full) {
+                word++;
+            }
+            return word;
+        }
+        const std::vector<uint64_t>& summary = levels[1];
+        uint64_t j = word / 64;
+        if(j >= summary.size()) {
+            return bitmap.size();
+        }
+        uint64_t m = ~summary[j] & (full << (word % 64));
+        while(m == 0) {
+            if(++j >= summary.size()) {
+                return bitmap.size();
+            }
+            m = ~summary[j];
+        }
+        return std::min<uint64_t>(j * 64 + __builtin_ctzll(m), bitmap.size());
+    }
+
+    void BitmapBlockManager::write_back() {
+        if(dirty.empty()) {
+            return;
+        }
+        BlockID last = *dirty.rbegin();
+        if(is_lazy(last)) {
+            // the blocks below a written one are initialized as well, so that one boundary is enough
+            for(BlockID i=sblock.s_lazy_dblock-sblock.s_dblock;i<last;i++) {
+                dirty.insert(i);
+            }
+            sblock.s_lazy_dblock = last + 1 < nr_bitmap ? sblock.s_dblock + last + 1 : 0;
+        }
+        std::vector<BlockID> ids;
+        std::vector<const uint8_t*> srcs;
+        for(auto i : dirty) {
+            ids.push_back(sblock.s_dblock + i);
+            srcs.push_back((const uint8_t*)(levels[0].data() + i * nr_words_per_block));
+        }
+        p_storage->write_blocks(ids,srcs);
+        dirty.clear();
+    }
+
+    /**
+     * @brief the first change after a checkpoint marks the super block on the storage unclean
+    */
+    void BitmapBlockManager::mark_unclean() {
+        if(sblock.clean) {
+            sblock.clean = 0;
+            p_storage->write_block(0,sblock.data);
+        }
+    }
+
+    /**
+     * @brief checkpoint: write the bitmap and the counter, then mark the super block clean
+     * the bitmap is made durable before the clean super block is written, so that a crash in
+     * between leaves the super block unclean
+    */
+    void BitmapBlockManager::sync() {
+        write_back();
+        if(!sblock.clean || sblock.nr_free_dblock != nr_free) {
+            p_storage->sync();
+            sblock.nr_free_dblock = nr_free;
+            sblock.clean = 1;
+            p_storage->write_block(0,sblock.data);
+            p_storage->sync();
+        }
+    }
+
+    /**
+     * @brief clear the bitmap, except the bits of the bitmap blocks themselves
+     * @param lazy: write the first bitmap block only, it holds the bits of the bitmap blocks
+    */
+    void BitmapBlockManager::mkfs(bool lazy) {
+        if(&sblock == &own_sblock) {
+            p_storage->read_block(0, sblock.data);
+        }
+        reset(std::vector<BlockID>());
+        pool.forget(sblock.s_dblock, sblock.nr_block - sblock.s_dblock);
+        if(lazy && nr_bitmap > 1) {
+            dirty.erase(dirty.upper_bound(0), dirty.end());
+            sblock.s_lazy_dblock = sblock.s_dblock + 1;
+        }
+        sync();
+    }
+
+    /**
+     * @brief rewrite the whole bitmap with only the blocks in use (and the bitmap blocks) set
+    */
+    void BitmapBlockManager::rebuild(const std::vector<BlockID>& in_use) {
+        reset(in_use);
+        sync();
+    }
+
+    /**
+     * @brief the bitmap in memory with only the blocks in use (and the bitmap blocks) set,
+     * all the bitmap blocks are dirty
+    */
+    void BitmapBlockManager::reset(const std::vector<BlockID>& in_use) {
+        layout();
+        std::vector<uint64_t>& bitmap = levels[0];
+        for(auto i=nr_bits;i<bitmap.size()*64;i++) {
+            bitmap[i/64] |= 1ULL << (i%64);
+        }
+        for(BlockID i=0;i<nr_bitmap;i++) {
+            bitmap[i/64] |= 1ULL << (i%64);
+            dirty.insert(i);
+        }
+        nr_free = nr_bits - nr_bitmap;
+        for(auto id : in_use) {
+            check_range("@rebuild: ", id);
+            uint64_t i = id - sblock.s_dblock;
+            if((bitmap[i/64] >> (i%64) & 1) == 0) {
+                bitmap[i/64] |= 1ULL << (i%64);
+                nr_free--;
+            }
+        }
+        build_summary();
+        build_extents();
+        sblock.s_lazy_dblock = 0;
+        sblock.clean = 0;
+    }
+
+    void BitmapBlockManager::check_range(const char* op, BlockID id) {
+        if(id < sblock.s_dblock + nr_bitmap || id >= sblock.nr_block) {
+            throw fs_error(op, id, " out of range ");
+        }
+    }
+
+    /**
+     * @brief read a data block (we can't read a inode, super block or the bitmap)
+     * @return return the data block
+    */
+    Block BitmapBlockManager::read_dblock(BlockID id) {
+        LOG(INFO) << "@read_dblock " << id;
+        check_range("@read_dblock: ", id);
+        Block bl;
+        p_storage->read_block(id, bl.data);
+        return bl;
+    }
+
+    void BitmapBlockManager::write_dblock(BlockID id, Block& bl) {
+        LOG(INFO) << "@write_dblock " << id;
+        check_range("@write_dblock: ", id);
+        p_storage->write_block(id, bl.data);
+    }
+
+    std::future<void> BitmapBlockManager::read_dblock_async(BlockID id, Block& bl) {
+        check_range("@read_dblock_async: ", id);
+        return p_storage->read_block_async(id, bl.data);
+    }
+
+    std::future<void> BitmapBlockManager::write_dblock_async(BlockID id, const Block& bl) {
+        check_range("@write_dblock_async: ", id);
+        return p_storage->write_block_async(id, bl.data);
+    }
+
+    void BitmapBlockManager::read_dblocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        LOG(INFO) << "@read_dblocks " << ids.size();
+        for(auto id : ids) {
+            check_range("@read_dblocks: ", id);
+        }
+        p_storage->read_blocks(ids, dsts);
+    }
+
+    void BitmapBlockManager::write_dblocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        LOG(INFO) << "@write_dblocks " << ids.size();
+        for(auto id : ids) {
+            check_range("@write_dblocks: ", id);
+        }
+        p_storage->write_blocks(ids, srcs);
+    }
+
+    uint64_t BitmapBlockManager::goal_bit(BlockID goal) {
+        if(goal < sblock.s_dblock + nr_bitmap || goal >= sblock.nr_block) {
+            return nr_bits;
+        }
+        return goal - sblock.s_dblock;
+    }
+
+    /**
+     * @brief allocate goal if it's free, otherwise the start of the next free extent after it,
+     * otherwise the lowest free data block (descending the summary levels)
+     * @return the BlockID of the allocated block
+    */
+    BlockID BitmapBlockManager::allocate_dblock(BlockID goal) {
+        LOG(INFO) << "@allocate_dblock";
+        if(nr_free == 0) {
+            throw fs_exception(std::errc::no_space_on_device,
+                "@allocate_dblock: run out of data block");
+        }
+        uint64_t idx = nr_bits;
+        uint64_t g = goal_bit(goal);
+        if(g < nr_bits) {
+            auto p = free_by_start.upper_bound(g);
+            if(p != free_by_start.begin() && std::prev(p)->first + std::prev(p)->second > g) {
+                idx = g;
+            } else if(p != free_by_start.end()) {
+                idx = p->first;
+            }
+        }
+        if(idx == nr_bits) {
+            idx = 0;
+            for(auto k=levels.size();k>0;k--) {
+                idx = idx * 64 + __builtin_ctzll(~levels[k-1][idx]);
+            }
+        }
+        set_range(idx, 1, true);
+        if(!writeback) {
+            write_back();
+        }
+        return sblock.s_dblock + idx;
+    }
+
+    /**
+     * @brief first fit: the lowest run of n free blocks, whole free words are taken at once
+     * @return the first BlockID of the run
+    */
+    BlockID BitmapBlockManager::allocate_run(uint64_t n) {
+        LOG(INFO) << "@allocate_run " << n;
+        if(n == 0) {
+            throw fs_error("@allocate_run: empty run");
+        }
+        if(n > nr_free) {
+            throw fs_exception(std::errc::no_space_on_device,
+                "@allocate_run: run out of data block");
+        }
+        const std::vector<uint64_t>& bitmap = levels[0];
+        uint64_t run_start = 0;
+        uint64_t run_len = 0;
+        bool found = false;
+        for(uint64_t i=next_nonfull(0);i<bitmap.size() && !found;i++) {
+            uint64_t free = ~bitmap[i];
+            if(free == 0) {
+                run_len = 0;
+                i = next_nonfull(i) - 1;
+                continue;
+            }
+            if(free == full) {
+                if(run_len == 0)
+                    run_start = i * 64;
+                run_len += 64;
+                found = run_len >= n;
+                continue;
+            }
+            uint64_t pos = 0;
+            while(pos < 64) {
+                uint64_t f = free >> pos;
+                if(f == 0) {
+                    run_len = 0;
+                    break;
+                }
+                if((f & 1) == 0) {
+                    run_len = 0;
+                    pos += __builtin_ctzll(f);
+                    continue;
+                }
+                // f has zeros shifted in on the top, so ~f != 0
+                uint64_t ones = __builtin_ctzll(~f);
+                if(run_len == 0)
+                    run_start = i * 64 + pos;
+                run_len += ones;
+                pos += ones;
+                if(run_len >= n) {
+                    found = true;
+                    break;
+                }
+            }
+        }
+        if(!found) {
+            throw fs_exception(std::errc::no_space_on_device,
+                "@allocate_run: no free run of ",n," blocks");
+        }
+        set_range(run_start, n, true);
+        if(!writeback) {
+            write_back();
+        }
+        return sblock.s_dblock + run_start;
+    }
+
+    /**
+     * @brief free a data block, a double free is ignored
+    */
+    void BitmapBlockManager::free_dblock(BlockID id) {
+        LOG(INFO) << "@free_dblock " << id;
+        check_range("@free_dblock: ", id);
+        uint64_t bit = id - sblock.s_dblock;
+        if((levels[0][bit/64] & (1ULL << (bit%64))) == 0) {
+            LOG(WARNING) << "@free_dblock: double free " << id;
+            return;
+        }
+        pool.forget(id);
+        if(discard) {
+            p_storage->discard(id, 1);
+        }
+        set_range(bit, 1, false);
+        if(!writeback) {
+            write_back();
+        }
+    }
+
+    /**
+     * @brief extend from goal if it's free, else take the first extent after goal which holds all
+     * n blocks if it's close (among the next few extents); otherwise best fit: the smallest free
+     * extent holding all n blocks, or the largest extents until there are enough
+     * @return the runs allocated
+    */
+    std::vector<extent> BitmapBlockManager::allocate_dblocks(uint64_t n, BlockID goal) {
+        LOG(INFO) << "@allocate_dblocks " << n;
+        const static int nr_near_extents = 16;
+        std::vector<extent> ret;
+        if(n > nr_free) {
+            throw fs_exception(std::errc::no_space_on_device,
+                "@allocate_dblocks: run out of data block");
+        }
+        uint64_t g = goal_bit(goal);
+        if(g < nr_bits && n > 0) {
+            auto p = free_by_start.upper_bound(g);
+            if(p != free_by_start.begin() && std::prev(p)->first + std::prev(p)->second > g) {
+                --p;
+                uint64_t len = std::min(p->first + p->second - g, n);
+                set_range(g, len, true);
+                ret.push_back(extent{sblock.s_dblock + g, len});
+                n -= len;
+            } else {
+                for(int i=0;i<nr_near_extents && p != free_by_start.end();i++,p++) {
+                    if(p->second >= n) {
+                        uint64_t start = p->first;
+                        set_range(start, n, true);
+                        ret.push_back(extent{sblock.s_dblock + start, n});
+                        n = 0;
+                        break;
+                    }
+                }
+            }
+        }
+        while(n > 0) {
+            auto p = free_by_len.lower_bound(std::make_pair(n, (uint64_t)0));
+            if(p == free_by_len.end()) {
+                --p;
+            }
+            uint64_t start = p->second;
+            uint64_t len = std::min(p->first, n);
+            set_range(start, len, true);
+            ret.push_back(extent{sblock.s_dblock + start, len});
+            n -= len;
+        }
+        if(!writeback) {
+            write_back();
+        }
+        return ret;
+    }
+
+    /**
+     * @brief free the run e, the blocks which are already free are ignored
+    */
+    void BitmapBlockManager::free_dblocks(const extent& e) {
+        LOG(INFO) << "@free_dblocks " << e.start << " " << e.len;
+        if(e.len == 0) {
+            return;
+        }
+        check_range("@free_dblocks: ", e.start);
+        check_range("@free_dblocks: ", e.start + e.len - 1);
+        uint64_t bit = e.start - sblock.s_dblock;
+        for(uint64_t i=bit;i<bit+e.len;i++) {
+            if((levels[0][i/64] & (1ULL << (i%64))) == 0) {
+                // some of them are free, go one by one
+                for(uint64_t j=0;j<e.len;j++) {
+                    free_dblock(e.start + j);
+                }
+                return;
+            }
+        }
+        pool.forget(e.start, e.len);
+        if(discard) {
+            p_storage->discard(e.start, e.len);
+        }
+        set_range(bit, e.len, false);
+        if(!writeback) {
+            write_back();
+        }
+    }
+};
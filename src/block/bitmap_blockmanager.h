@@ -0,0 +1,85 @@
+#pragma once
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+#include "block/block_manager.h"
+#include "block/super_block.h"
+
+namespace solid {
+    /**
+     * @brief allocate the data blocks from a bitmap (a bit per block, set if it's in use)
+     * the bitmap takes the first blocks of the data region and is kept in memory, with summary
+     * levels on top of it: a bit of level k is set iff the word below it in level k-1 is full,
+     * so the first free block is found with one ctz per level
+     * the free space is also indexed as extents, by start and by length, for best-fit batches
+     * @param p_sb: the super block shared with the other managers, nullptr to read our own copy
+     * @param writeback: write the modified bitmap blocks on sync(), otherwise right away
+     * sync() is a checkpoint which marks the super block clean, the first change after it unclean
+     * a lazy mkfs only writes the first bitmap block, the ones from sblock.s_lazy_dblock on are
+     * all clear until they are first written
+    */
+    class BitmapBlockManager: public BlockManager {
+    public:
+        const static uint64_t nr_blocks_per_bitmap_block = config::block_size * 8;
+
+        BitmapBlockManager(Storage* p_storage,super_block* p_sb=nullptr,bool writeback=false);
+        ~BitmapBlockManager();
+
+        virtual void mkfs(bool lazy=false);
+        virtual Block read_dblock(BlockID id);
+        virtual void write_dblock(BlockID id, Block& src);
+        virtual BlockID allocate_dblock(BlockID goal=0);
+        virtual void free_dblock(BlockID id);
+        virtual void sync();
+        virtual void rebuild(const std::vector<BlockID>& in_use);
+        virtual std::future<void> read_dblock_async(BlockID id, Block& dst);
+        virtual std::future<void> write_dblock_async(BlockID id, const Block& src);
+        virtual void read_dblocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        virtual void write_dblocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+        virtual std::vector<extent> allocate_dblocks(uint64_t n, BlockID goal=0);
+        virtual void free_dblocks(const extent& e);
+
+        // allocate the first run of n adjacent free blocks, return the first one
+        BlockID allocate_run(uint64_t n);
+        virtual uint64_t get_nr_free_blocks() const { return nr_free; };
+
+    private:
+        super_block own_sblock;
+        super_block& sblock;
+        const bool writeback;
+
+        // # of blocks tracked (from s_dblock to nr_block) and # of bitmap blocks
+        uint64_t nr_bits;
+        BlockID nr_bitmap;
+        uint64_t nr_free;
+        // levels[0] is the bitmap, levels[k] summarizes levels[k-1]
+        std::vector<std::vector<uint64_t>> levels;
+        // bitmap blocks (relative to s_dblock) to write back
+        std::set<BlockID> dirty;
+        // the free extents (relative to s_dblock): start -> length, and (length, start)
+        std::map<uint64_t, uint64_t> free_by_start;
+        std::set<std::pair<uint64_t, uint64_t>> free_by_len;
+
+        void layout();
+        void reset(const std::vector<BlockID>& in_use);
+        void build_summary();
+        void update_summary(uint64_t word);
+        void set_range(uint64_t bit, uint64_t n, bool used);
+        void build_extents();
+        void insert_extent(uint64_t start, uint64_t len);
+        void erase_extent(std::map<uint64_t, uint64_t>::iterator p);
+        void take_extent(uint64_t bit, uint64_t n);
+        void give_extent(uint64_t bit, uint64_t n);
+        uint64_t next_nonfull(uint64_t word);
+        // the bitmap block i (relative to s_dblock) has never been written
+        bool is_lazy(BlockID i) const {
+            return sblock.s_lazy_dblock != 0 && sblock.s_dblock + i >= sblock.s_lazy_dblock;
+        }
+        void write_back();
+        void mark_unclean();
+        void check_range(const char* op, BlockID id);
+        // goal as a bit, nr_bits if it's 0 or out of range
+        uint64_t goal_bit(BlockID goal);
+    };
+};
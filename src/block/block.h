@@ -14,6 +14,11 @@ namespace solid {
                 // used for indexing data blocks by inode
                 BlockID bl_entry[config::block_size/sizeof(BlockID)];
             };
+            struct{
+                // used for the extents of an inode which don't fit in it
+                extent_header ex_header;
+                file_extent ex_entry[(config::block_size - sizeof(extent_header))/sizeof(file_extent)];
+            };
             INode inode[config::block_size/sizeof(INode)];
         };
     };
@@ -2,8 +2,20 @@
 #include "common.h"
 #include "storage/storage.h"
 #include "block/block.h"
+#include "block/block_pool.h"
 
 namespace solid {
+    // the allocator recorded in the super block
+    enum BlockAllocator {
+        FREELIST = 0, BITMAP = 1
+    };
+
+    // a run of adjacent blocks [start, start+len)
+    struct extent {
+        BlockID start;
+        uint64_t len;
+    };
+
     /**
      * @brief manage all the data blocks
      * @param ptr_sblock: a pointer to the super_block
@@ -11,14 +23,83 @@ namespace solid {
     class BlockManager {
         protected:
             Storage* p_storage;
+            // pass the freed blocks down to the storage (Storage::discard) before they are reused
+            bool discard;
+            // the metadata blocks handed out by get_dblock(), a block leaves it when it's freed
+            BlockPool pool;
 
         public:
-            BlockManager(Storage* p_storage) { this->p_storage = p_storage;}
+            BlockManager(Storage* p_storage) : pool(p_storage) { this->p_storage = p_storage; this->discard = false;}
+            void set_discard(bool on) { discard = on; }
+            virtual ~BlockManager() {};
 
-            virtual void mkfs() = 0;
+            /**
+             * @brief format the data region
+             * @param lazy: skip the metadata implied by the layout, it's initialized on first use
+            */
+            virtual void mkfs(bool lazy=false) = 0;
             virtual Block read_dblock(BlockID id) = 0;
+            // a pinned data block to be read and patched in place, call mark_dirty() to write it
+            // fresh: the block was just allocated, start from zeros instead of reading it
+            BlockRef get_dblock(BlockID id, bool fresh=false) { return pool.get(id, fresh); }
             virtual void write_dblock(BlockID id, Block& src) = 0;
-            virtual BlockID allocate_dblock() = 0;
+            // goal: a block to allocate at or close to, e.g. the one after the last block of the file,
+            // 0 for no preference
+            virtual BlockID allocate_dblock(BlockID goal=0) = 0;
             virtual void free_dblock(BlockID id) = 0;
+            // kept up to date in memory, checkpointed in the super block by sync()
+            virtual uint64_t get_nr_free_blocks() const = 0;
+            // write the allocation state kept in memory back to the storage, and mark it clean
+            virtual void sync() {};
+            // rebuild the allocation state from the blocks in use, e.g. after a crash
+            virtual void rebuild(const std::vector<BlockID>& in_use) = 0;
+
+            /**
+             * @brief allocate n data blocks in as few runs as possible, starting close to goal
+             * the default one allocates them one by one and merges the adjacent ones
+             * @return the runs, in the order they should be used
+            */
+            virtual std::vector<extent> allocate_dblocks(uint64_t n, BlockID goal=0) {
+                std::vector<extent> ret;
+                try {
+                    for(uint64_t i=0;i<n;i++) {
+                        BlockID b = allocate_dblock(goal);
+                        if(!ret.empty() && ret.back().start + ret.back().len == b) {
+                            ret.back().len++;
+                        } else {
+                            ret.push_back(extent{b,1});
+                        }
+                        goal = b + 1;
+                    }
+                } catch (...) {
+                    for(auto& e : ret) {
+                        free_dblocks(e);
+                    }
+                    throw;
+                }
+                return ret;
+            }
+            virtual void free_dblocks(const extent& e) {
+                for(uint64_t i=0;i<e.len;i++) {
+                    free_dblock(e.start + i);
+                }
+            }
+
+            // asynchronous version of read_dblock/write_dblock, call submit() to start the I/O
+            virtual std::future<void> read_dblock_async(BlockID id, Block& dst) {
+                return p_storage->read_block_async(id, dst.data);
+            }
+            virtual std::future<void> write_dblock_async(BlockID id, const Block& src) {
+                return p_storage->write_block_async(id, src.data);
+            }
+            virtual void submit() { p_storage->submit(); }
+
+            // read/write several data blocks at once, runs of adjacent ids become one I/O
+            virtual void read_dblocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+                p_storage->read_blocks(ids, dsts);
+            }
+            virtual void write_dblocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+                p_storage->write_blocks(ids, srcs);
+            }
     };
 };
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include "block/block_pool.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <cstring>
+
+namespace solid {
+    BlockRef::BlockRef(const BlockRef& r) : pool(r.pool), id(r.id), p(r.p) {
+        if(pool != nullptr) {
+            pool->pin(id);
+        }
+    }
+
+    BlockRef& BlockRef::operator=(const BlockRef& r) {
+        if(this != &r) {
+            if(r.pool != nullptr) {
+                r.pool->pin(r.id);
+            }
+            release();
+            pool = r.pool;
+            id = r.id;
+            p = r.p;
+        }
+        return *this;
+    }
+
+    BlockRef& BlockRef::operator=(BlockRef&& r) {
+        if(this != &r) {
+            release();
+            pool = r.pool;
+            id = r.id;
+            p = r.p;
+            r.pool = nullptr;
+            r.p = nullptr;
+        }
+        return *this;
+    }
+
+    void BlockRef::mark_dirty() {
+        pool->write(id, p);
+    }
+
+    void BlockRef::release() {
+        if(pool != nullptr) {
+            pool->unpin(id);
+            pool = nullptr;
+            p = nullptr;
+        }
+    }
+
+    BlockRef BlockPool::get(BlockID id, bool fresh) {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto p = cache.find(id);
+        if(p != cache.end()) {
+            if(p->second.refs++ == 0) {
+                lru.erase(p->second.lru);
+            } else if(fresh) {
+                LOG(WARNING) << "@get: block " << id << " is allocated while pinned";
+            }
+            // a stale copy of a block that was freed and allocated again
+            if(fresh) {
+                std::memset(p->second.block.data, 0, config::block_size);
+            }
+            return BlockRef(this, id, &p->second.block);
+        }
+        // the entries don't move, so the buffer stays where it is as long as it's pinned
+        Entry& e = cache[id];
+        if(fresh) {
+            std::memset(e.block.data, 0, config::block_size);
+        } else {
+            try {
+                storage->read_block(id, e.block.data);
+            } catch (...) {
+                cache.erase(id);
+                throw;
+            }
+        }
+        e.refs = 1;
+        return BlockRef(this, id, &e.block);
+    }
+
+    void BlockPool::pin(BlockID id) {
+        std::lock_guard<std::mutex> lk(mutex);
+        Entry& e = cache.at(id);
+        if(e.refs++ == 0) {
+            lru.erase(e.lru);
+        }
+    }
+
+    void BlockPool::unpin(BlockID id) {
+        std::lock_guard<std::mutex> lk(mutex);
+        Entry& e = cache.at(id);
+        if(--e.refs > 0) {
+            return;
+        }
+        lru.push_front(id);
+        e.lru = lru.begin();
+        while(lru.size() > nr_blocks) {
+            cache.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+
+    void BlockPool::write(BlockID id, Block* p) {
+        storage->write_block(id, p->data);
+    }
+
+    void BlockPool::forget(BlockID id, uint64_t n) {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto drop = [&](std::unordered_map<BlockID, Entry>::iterator p) {
+            if(p->second.refs > 0) {
+                LOG(WARNING) << "@forget: block " << p->first << " is still pinned";
+                return std::next(p);
+            }
+            lru.erase(p->second.lru);
+            return cache.erase(p);
+        };
+        // a long run is matched against the pool rather than looked up block by block
+        if(n > cache.size()) {
+            for(auto p = cache.begin(); p != cache.end();) {
+                p = (p->first >= id && p->first < id + n) ? drop(p) : std::next(p);
+            }
+            return;
+        }
+        for(uint64_t i=0;i<n;i++) {
+            auto p = cache.find(id + i);
+            if(p != cache.end()) {
+                drop(p);
+            }
+        }
+    }
+
+    uint64_t BlockPool::size() {
+        std::lock_guard<std::mutex> lk(mutex);
+        return cache.size();
+    }
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "common.h"
+#include "block/block.h"
+#include "storage/storage.h"
+
+namespace solid {
+    class BlockPool;
+
+    /**
+     * @brief a reference to a pooled block, which stays in the pool (pinned) until the last one is released
+     * the references to a block share one buffer, so a change is seen through all of them;
+     * call mark_dirty() after modifying it, so that it's written to the storage
+    */
+    class BlockRef {
+    private:
+        BlockPool* pool;
+        BlockID id;
+        Block* p;
+
+    public:
+        BlockRef() : pool(nullptr), id(0), p(nullptr) {};
+        BlockRef(BlockPool* pool, BlockID id, Block* p) : pool(pool), id(id), p(p) {};
+        BlockRef(const BlockRef& r);
+        BlockRef& operator=(const BlockRef& r);
+        BlockRef(BlockRef&& r) : pool(r.pool), id(r.id), p(r.p) { r.pool = nullptr; r.p = nullptr; };
+        BlockRef& operator=(BlockRef&& r);
+        ~BlockRef() { release(); };
+
+        Block& operator*() const { return *p; };
+        Block* operator->() const { return p; };
+        explicit operator bool() const { return p != nullptr; };
+        BlockID get_id() const { return id; };
+
+        void mark_dirty();
+        void release();
+    };
+
+    /**
+     * @brief the buffers of the blocks the file system modifies piecemeal (mapping and extent blocks)
+     * a block is read once and then patched in place through BlockRefs, instead of being copied in
+     * and out of the storage for each entry; a modified block is written through by mark_dirty(),
+     * so the pool never holds data the storage doesn't have
+     * the released blocks are kept in LRU order for the next lookups, pinned ones may exceed nr_blocks
+     * a freed block must be forgotten, it may be written behind the pool once it's reused
+     * @param nr_blocks: # of released blocks kept
+    */
+    class BlockPool {
+    private:
+        struct Entry {
+            Block block;
+            // # of references
+            uint32_t refs;
+            // valid if refs is 0
+            std::list<BlockID>::iterator lru;
+        };
+
+        Storage* storage;
+        const uint64_t nr_blocks;
+        // protect cache and lru
+        std::mutex mutex;
+        std::unordered_map<BlockID, Entry> cache;
+        // the released blocks, most recently used first
+        std::list<BlockID> lru;
+
+        friend class BlockRef;
+        void pin(BlockID id);
+        void unpin(BlockID id);
+        void write(BlockID id, Block* p);
+
+    public:
+        BlockPool(Storage* storage, uint64_t nr_blocks=256) : storage(storage), nr_blocks(nr_blocks) {};
+
+        /**
+         * @brief pin Block id, read from the storage unless it's in the pool
+         * @param fresh: the block was just allocated, start from zeros instead of reading it,
+         *        even if it is in the pool
+        */
+        BlockRef get(BlockID id, bool fresh=false);
+        // drop the released blocks of [id, id+n), e.g. when they are freed
+        void forget(BlockID id, uint64_t n=1);
+        // # of blocks in the pool
+        uint64_t size();
+    };
+};
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include "block/freelist_blockmanager.h"
 #include "block/super_block.h"
@@ -6,45 +8,250 @@
 #include "utils/fs_exception.h"
 
 namespace solid {
+    namespace {
+        inline uint64_t distance(BlockID a, BlockID b) {
+            return a > b ? a - b : b - a;
+        }
+    };
 
-    FreeListBlockManager::FreeListBlockManager(Storage* p_storage,const super_block* p_sb)
-        : BlockManager(p_storage) {
+    FreeListBlockManager::FreeListBlockManager(Storage* p_storage,super_block* p_sb,bool writeback,
+                                               uint64_t batch,uint64_t nr_shards)
+        : BlockManager(p_storage), sblock(p_sb == nullptr ? own_sblock : *p_sb), writeback(writeback),
+          head_loaded(false), head_dirty(false), sb_dirty(false), deferred(false),
+          batch(batch), nr_shards(nr_shards == 0 ? 1 : nr_shards), shards(new Shard[this->nr_shards]), nr_cached(0) {
             if(p_sb == nullptr) {
                 p_storage->read_block(0,sblock.data);
-            } else {
-                std::memcpy(sblock.data,p_sb->data,sizeof(super_block));
             }
+            // only trusted if the super block is clean, otherwise rebuild() sets it
+            nr_free = sblock.nr_free_dblock;
         };
 
+    FreeListBlockManager::~FreeListBlockManager() {
+        try {
+            sync();
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "@~FreeListBlockManager: fail to write back the free list " << e.what();
+        }
+    }
+
     /**
-     * @brief write the first data block (i) with [i+512, i+1, i+2,...], then write the i+512 block
-     *
-    */
-    void FreeListBlockManager:: mkfs() {
-        //TODO(lonhh) maybe this can be omitted
-        p_storage->read_block(0, sblock.data);
-
-        auto i = sblock.s_dblock;
-        struct Block tmp;
-        BlockID* ptr = (BlockID*)tmp.data;
-        for(;i + nr_blocks_per_group < sblock.nr_block;i += nr_blocks_per_group) {
-            *ptr = i + nr_blocks_per_group;
-            for(auto j=1;j<nr_blocks_per_group;j++) {
-                *(ptr+j) = i + j; 
+     * @brief the head group, read at most once per head
+    */
+    Block& FreeListBlockManager::load_head() {
+        if(!head_loaded) {
+            BlockID id = sblock.h_dblock;
+            if(sblock.s_lazy_dblock != 0 && id >= sblock.s_lazy_dblock) {
+                // the first touch of a lazily formatted group initializes it
+                fill_group(id, head);
+                p_storage->write_block(id, head.data);
+                sblock.s_lazy_dblock = id + nr_blocks_per_group < sblock.nr_block ? id + nr_blocks_per_group : 0;
+                sb_modified();
+            } else {
+                p_storage->read_block(id,head.data);
             }
-            p_storage->write_block(i,tmp.data);
+            head_loaded = true;
         }
-        *ptr = 0;
+        return head;
+    }
+
+    /**
+     * @brief [i+512, i+1, i+2,...], without the blocks past the end; the last group links to 0
+    */
+    void FreeListBlockManager::fill_group(BlockID i, Block& bl) {
+        bl.fl_entry[0] = i + nr_blocks_per_group < sblock.nr_block ? i + nr_blocks_per_group : 0;
         for(auto j=1;j<nr_blocks_per_group;j++) {
-            if (i + j < sblock.nr_block)
-                *(ptr+j) = i + j;
-            else
-                *(ptr+j) = 0;
+            bl.fl_entry[j] = i + j < sblock.nr_block ? i + j : 0;
+        }
+    }
+
+    /**
+     * @brief the first change after a checkpoint marks the super block on the storage unclean,
+     * so that a crash before the next checkpoint is detected at mount
+    */
+    void FreeListBlockManager::mark_unclean() {
+        if(sblock.clean) {
+            sblock.clean = 0;
+            p_storage->write_block(0,sblock.data);
+        }
+    }
+
+    void FreeListBlockManager::head_modified() {
+        if(writeback || deferred) {
+            head_dirty = true;
+        } else {
+            p_storage->write_block(sblock.h_dblock,head.data);
+        }
+    }
+
+    void FreeListBlockManager::sb_modified() {
+        if(writeback || deferred) {
+            sb_dirty = true;
+        } else {
+            p_storage->write_block(0,sblock.data);
+        }
+    }
+
+    /**
+     * @brief checkpoint: write the head group and the counters, then mark the super block clean
+     * the head group is made durable before the clean super block is written, otherwise a crash
+     * in between could leave a clean super block pointing at a stale group
+    */
+    void FreeListBlockManager::sync() {
+        // a cached block is allocated as far as the storage knows, give them back to be exact
+        drain_all();
+        std::lock_guard<std::mutex> lk(mutex);
+        if(head_dirty) {
+            p_storage->write_block(sblock.h_dblock,head.data);
+            head_dirty = false;
+        }
+        if(sb_dirty || !sblock.clean || sblock.nr_free_dblock != nr_free) {
+            p_storage->sync();
+            sblock.nr_free_dblock = nr_free;
+            sblock.clean = 1;
+            p_storage->write_block(0,sblock.data);
+            p_storage->sync();
+            sb_dirty = false;
+        }
+    }
+
+    /**
+     * @brief the shard of the calling thread, each thread gets the next one when it first allocates
+    */
+    FreeListBlockManager::Shard& FreeListBlockManager::local_shard() {
+        static std::atomic<uint64_t> next_slot(0);
+        static thread_local uint64_t slot = next_slot++;
+        return shards[slot % nr_shards];
+    }
+
+    /**
+     * @brief move up to batch blocks from the global free list to shard, whose lock is held
+    */
+    void FreeListBlockManager::refill(Shard& shard) {
+        std::lock_guard<std::mutex> lk(mutex);
+        uint64_t n = 0;
+        while(n < batch && sblock.h_dblock != 0) {
+            shard.blocks.push_back(allocate_locked());
+            n++;
+        }
+        // pop_back hands them out in the order of the free list
+        std::reverse(shard.blocks.end() - n, shard.blocks.end());
+        nr_cached += n;
+    }
+
+    /**
+     * @brief give the n oldest blocks of shard, whose lock is held, back to the global free list
+    */
+    void FreeListBlockManager::drain(Shard& shard, uint64_t n) {
+        n = std::min<uint64_t>(n, shard.blocks.size());
+        if(n == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(mutex);
+        for(uint64_t i=0;i<n;i++) {
+            free_locked(shard.blocks[i]);
+        }
+        shard.blocks.erase(shard.blocks.begin(), shard.blocks.begin() + n);
+        nr_cached -= n;
+    }
+
+    void FreeListBlockManager::drain_all() {
+        if(batch == 0) {
+            return;
+        }
+        for(uint64_t i=0;i<nr_shards;i++) {
+            std::lock_guard<std::mutex> lk(shards[i].mutex);
+            drain(shards[i], shards[i].blocks.size());
+        }
+    }
+
+    /**
+     * @brief forget the cached blocks, the global free list is rewritten by the caller
+    */
+    void FreeListBlockManager::clear_shards() {
+        for(uint64_t i=0;i<nr_shards;i++) {
+            std::lock_guard<std::mutex> lk(shards[i].mutex);
+            shards[i].blocks.clear();
+        }
+        nr_cached = 0;
+    }
+
+    /**
+     * @brief write the first data block (i) with [i+512, i+1, i+2,...], then write the i+512 block
+     * @param lazy: write none of them, only record in the super block where they start
+    */
+    void FreeListBlockManager:: mkfs(bool lazy) {
+        clear_shards();
+        std::lock_guard<std::mutex> lk(mutex);
+        pool.forget(sblock.s_dblock, sblock.nr_block - sblock.s_dblock);
+        // a shared super block is up to date, and may hold changes not written yet
+        if(&sblock == &own_sblock) {
+            p_storage->read_block(0, sblock.data);
+        }
+
+        sblock.s_lazy_dblock = 0;
+        if(lazy) {
+            sblock.s_lazy_dblock = sblock.s_dblock;
+        } else {
+            struct Block tmp;
+            for(auto i = sblock.s_dblock;i < sblock.nr_block;i += nr_blocks_per_group) {
+                fill_group(i, tmp);
+                p_storage->write_block(i,tmp.data);
+            }
         }
-        p_storage->write_block(i,tmp.data);
 
         sblock.h_dblock = sblock.s_dblock;
+        nr_free = sblock.nr_block - sblock.s_dblock;
+        sblock.nr_free_dblock = nr_free;
+        sblock.clean = 1;
         p_storage->write_block(0,sblock.data);
+        head_loaded = false;
+        head_dirty = false;
+        sb_dirty = false;
+    }
+
+    /**
+     * @brief chain all the blocks not in use into groups, in ascending order like mkfs
+    */
+    void FreeListBlockManager::rebuild(const std::vector<BlockID>& in_use) {
+        LOG(INFO) << "@rebuild: " << in_use.size() << " blocks in use";
+        clear_shards();
+        std::lock_guard<std::mutex> lk(mutex);
+        // the free blocks are about to hold the groups
+        pool.forget(sblock.s_dblock, sblock.nr_block - sblock.s_dblock);
+        std::vector<bool> used(sblock.nr_block - sblock.s_dblock,false);
+        for(auto id : in_use) {
+            if(id < sblock.s_dblock || id >= sblock.nr_block) {
+                throw fs_error("@rebuild: ", id, " out of range ");
+            }
+            used[id - sblock.s_dblock] = true;
+        }
+        std::vector<BlockID> free;
+        for(BlockID i=0;i<used.size();i++) {
+            if(!used[i])
+                free.push_back(sblock.s_dblock + i);
+        }
+
+        // group k is free[k*n] holding [free[(k+1)*n], free[k*n+1], ..., free[k*n+n-1]]
+        const BlockID n = nr_blocks_per_group;
+        Block tmp;
+        for(uint64_t k=0;k<free.size();k+=n) {
+            std::memset(tmp.data,0,config::block_size);
+            tmp.fl_entry[0] = k + n < free.size() ? free[k + n] : 0;
+            for(uint64_t j=1;j<n && k+j<free.size();j++) {
+                tmp.fl_entry[j] = free[k + j];
+            }
+            p_storage->write_block(free[k],tmp.data);
+        }
+
+        sblock.h_dblock = free.empty() ? 0 : free[0];
+        sblock.s_lazy_dblock = 0;
+        nr_free = free.size();
+        sblock.nr_free_dblock = nr_free;
+        sblock.clean = 1;
+        p_storage->write_block(0,sblock.data);
+        head_loaded = false;
+        head_dirty = false;
+        sb_dirty = false;
     }
 
     /**
@@ -70,73 +277,211 @@ namespace solid {
         p_storage->write_block(id, bl.data);
     }
 
+    std::future<void> FreeListBlockManager::read_dblock_async(BlockID id, Block& bl) {
+        if(id < sblock.s_dblock || id >= sblock.nr_block) {
+            throw fs_error("@read_dblock_async: ", id, " out of range ");
+        }
+        return p_storage->read_block_async(id, bl.data);
+    }
+
+    std::future<void> FreeListBlockManager::write_dblock_async(BlockID id, const Block& bl) {
+        if(id < sblock.s_dblock || id >= sblock.nr_block) {
+            throw fs_error("@write_dblock_async: ", id, " out of range ");
+        }
+        return p_storage->write_block_async(id, bl.data);
+    }
+
+    void FreeListBlockManager::read_dblocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        LOG(INFO) << "@read_dblocks " << ids.size();
+        for(auto id : ids) {
+            if(id < sblock.s_dblock || id >= sblock.nr_block) {
+                throw fs_error("@read_dblocks: ", id, " out of range ");
+            }
+        }
+        p_storage->read_blocks(ids, dsts);
+    }
+
+    void FreeListBlockManager::write_dblocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        LOG(INFO) << "@write_dblocks " << ids.size();
+        for(auto id : ids) {
+            if(id < sblock.s_dblock || id >= sblock.nr_block) {
+                throw fs_error("@write_dblocks: ", id, " out of range ");
+            }
+        }
+        p_storage->write_blocks(ids, srcs);
+    }
+
     /**
-     * @brief allocate a data block
-     * @return the BlockID of the allocated block, 0 for failure
+     * @brief allocate a data block from the shard of the thread, the global free list if there is none
+     * @return the BlockID of the allocated block, throw exception if there is no free block
     */
-    BlockID FreeListBlockManager::allocate_dblock() {
+    BlockID FreeListBlockManager::allocate_dblock(BlockID goal) {
         LOG(INFO) << "@allocate_dblock";
-        //let's assume that the h_dblock will be always the updated
-        BlockID head = sblock.h_dblock;
-        if (head == 0) {
+        if(batch == 0) {
+            std::lock_guard<std::mutex> lk(mutex);
+            return allocate_locked(goal);
+        }
+        {
+            Shard& shard = local_shard();
+            std::lock_guard<std::mutex> lk(shard.mutex);
+            if(shard.blocks.empty()) {
+                refill(shard);
+            }
+            if(!shard.blocks.empty()) {
+                BlockID ret = shard.blocks.back();
+                shard.blocks.pop_back();
+                nr_cached--;
+                return ret;
+            }
+        }
+        // the last free blocks may sit in the other shards
+        drain_all();
+        std::lock_guard<std::mutex> lk(mutex);
+        return allocate_locked(goal);
+    }
+
+    /**
+     * @brief free a data block to the shard of the thread, a full shard drains its oldest batch
+    */
+    void FreeListBlockManager::free_dblock(BlockID id) {
+        LOG(INFO) << "@free_dblock " << id;
+        if(id < sblock.s_dblock || id >= sblock.nr_block) {
+            throw fs_error("@free_dblock: ", id, " out of range ");
+        }
+        // it may be written as a group below
+        pool.forget(id);
+        // before the block may become the head group, whose write takes it out of the discard queue
+        if(discard) {
+            p_storage->discard(id, 1);
+        }
+        if(batch == 0) {
+            std::lock_guard<std::mutex> lk(mutex);
+            free_locked(id);
+            return;
+        }
+        Shard& shard = local_shard();
+        std::lock_guard<std::mutex> lk(shard.mutex);
+        shard.blocks.push_back(id);
+        nr_cached++;
+        if(shard.blocks.size() > 2 * batch) {
+            drain(shard, batch);
+        }
+    }
+
+    /**
+     * @brief take a block from the global free list, the head group is kept in memory so that
+     * it's not read every time
+     * @param goal: take the entry of the head group closest to it, otherwise the first one
+    */
+    BlockID FreeListBlockManager::allocate_locked(BlockID goal) {
+        BlockID head_id = sblock.h_dblock;
+        if (head_id == 0) {
             throw fs_exception( std::errc::no_space_on_device,
                 "@allocate_dblock: run out of data block");
         }
-        Block bl = read_dblock(head);
-        uint64_t i=1;
-        for(;i<nr_blocks_per_group;i++) {
-            if(bl.fl_entry[i] != 0)
+        mark_unclean();
+        Block& bl = load_head();
+        uint64_t i=nr_blocks_per_group;
+        for(uint64_t j=1;j<nr_blocks_per_group;j++) {
+            BlockID e = bl.fl_entry[j];
+            if(e == 0)
+                continue;
+            if(i == nr_blocks_per_group) {
+                i = j;
+                if(goal == 0)
+                    break;
+            } else if(distance(e, goal) < distance(bl.fl_entry[i], goal)) {
+                i = j;
+            }
+            if(e == goal)
                 break;
         }
+        nr_free = nr_free > 0 ? nr_free - 1 : 0;
         if(i < nr_blocks_per_group) {
             BlockID ret = bl.fl_entry[i];
             bl.fl_entry[i] = 0;
-            write_dblock(head,bl);
+            head_modified();
             return ret;
         } else {
-            BlockID new_head = bl.fl_entry[0];
-            bl.fl_entry[0] = 0;
-            write_dblock(head,bl);
-            sblock.h_dblock = new_head;
-            p_storage->write_block(0,sblock.data);
-            return head;
+            // the empty head group is handed out itself, there is no need to write it
+            sblock.h_dblock = bl.fl_entry[0];
+            head_loaded = false;
+            head_dirty = false;
+            sb_modified();
+            return head_id;
         }
     }
 
     /**
-     * @brief free a data block with BlockID id, inserting to the head of the free list
-     * @return 1 for success, 0 for failure
+     * @brief insert a data block with BlockID id to the head of the global free list
     */
 
-    // TODO(lonhh): whether we need to make sure that id is in range?
-    // TODO(lonhh): one performance issue----if we free one block, which needs to write the sblock, and then allocate a block and free it again.
     // TODO(lonhh): also do we need to check that the block is avaible or not? double free?
-    void FreeListBlockManager::free_dblock(BlockID id) {
-        LOG(INFO) << "@free_dblock " << id;
-        
-        if(id < sblock.s_dblock || id >= sblock.nr_block) {
-            throw fs_error("@free_dblock: ", id, " out of range ");
-        }
-        BlockID head = sblock.h_dblock;
-        Block bl;
-        p_storage->read_block(head,bl.data); 
-        uint64_t i=1;
-        for(;i<nr_blocks_per_group;i++) {
-            if(bl.fl_entry[i] == 0)
-                break;
+    void FreeListBlockManager::free_locked(BlockID id) {
+        mark_unclean();
+        nr_free++;
+        if(sblock.h_dblock != 0) {
+            Block& bl = load_head();
+            uint64_t i=1;
+            for(;i<nr_blocks_per_group;i++) {
+                if(bl.fl_entry[i] == 0)
+                    break;
+            }
+            if(i < nr_blocks_per_group) {
+                bl.fl_entry[i] = id;
+                head_modified();
+                return;
+            }
+            // the full head group leaves memory
+            if(head_dirty) {
+                p_storage->write_block(sblock.h_dblock,bl.data);
+            }
         }
-        if(head!=0 && i < nr_blocks_per_group) {
-            bl.fl_entry[i] = id;
-            write_dblock(head,bl);
+        // id becomes the new head group
+        std::memset(head.data,0,config::block_size);
+        head.fl_entry[0] = sblock.h_dblock;
+        sblock.h_dblock = id;
+        head_loaded = true;
+        if(writeback || deferred) {
+            head_dirty = true;
         } else {
-            // write the block
-            Block tmp;
-            memset(tmp.fl_entry+1,0,config::block_size);
-            tmp.fl_entry[0] = sblock.h_dblock;
-            write_dblock(id,tmp);
-            // modify the super block
-            sblock.h_dblock = id;
+            p_storage->write_block(id,head.data);
+        }
+        sb_modified();
+    }
+
+    /**
+     * @brief free the run e straight to the global free list under one lock, the head group and
+     * the super block are written once at the end rather than per block
+    */
+    void FreeListBlockManager::free_dblocks(const extent& e) {
+        LOG(INFO) << "@free_dblocks " << e.start << " " << e.len;
+        if(e.len == 0) {
+            return;
+        }
+        if(e.start < sblock.s_dblock || e.start + e.len > sblock.nr_block) {
+            throw fs_error("@free_dblocks: ", e.start, " ", e.len, " out of range ");
+        }
+        pool.forget(e.start, e.len);
+        if(discard) {
+            p_storage->discard(e.start, e.len);
+        }
+        std::lock_guard<std::mutex> lk(mutex);
+        deferred = true;
+        for(uint64_t i=0;i<e.len;i++) {
+            free_locked(e.start + i);
+        }
+        deferred = false;
+        if(writeback) {
+            return;
+        }
+        if(head_dirty) {
+            p_storage->write_block(sblock.h_dblock,head.data);
+            head_dirty = false;
+        }
+        if(sb_dirty) {
             p_storage->write_block(0,sblock.data);
+            sb_dirty = false;
         }
     }
 };
\ No newline at end of file
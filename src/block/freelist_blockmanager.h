@@ -1,21 +1,89 @@
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include "block/block_manager.h"
 #include "block/super_block.h"
 namespace solid {
+    /**
+     * @brief the free data blocks are kept in a chain of groups, the head group is cached in memory
+     * @param p_sb: shared with the other managers, so that none of them writes a stale super block
+     * @param writeback: write the head group and the super block on sync() only (a checkpoint),
+     * otherwise write the head group on every change
+     * @param batch: if non-zero, each thread allocates from and frees to its own shard of cached free
+     * blocks, refilled from (and drained to) the global free list batch blocks at a time under its lock
+     * @param nr_shards: # of shards, threads are assigned to them round-robin
+     * an allocation goal picks the closest block of the head group, the shards ignore it
+     * a lazy mkfs writes no group: the groups from sblock.s_lazy_dblock on are the ones an eager
+     * mkfs would write, and each of them is written when it becomes the head
+    */
     class FreeListBlockManager: public BlockManager {
     public:
-        FreeListBlockManager(Storage* p_storage,const super_block* p_sb=nullptr);
+        FreeListBlockManager(Storage* p_storage,super_block* p_sb=nullptr,bool writeback=false,
+                             uint64_t batch=0,uint64_t nr_shards=16);
+        ~FreeListBlockManager();
 
         const static BlockID nr_blocks_per_group = config::block_size / sizeof(BlockID);
             
-        virtual void mkfs();
+        virtual void mkfs(bool lazy=false);
         virtual Block read_dblock(BlockID id);
         virtual void write_dblock(BlockID id, Block& src);
-        virtual BlockID allocate_dblock();
+        virtual BlockID allocate_dblock(BlockID goal=0);
         virtual void free_dblock(BlockID id);
+        virtual void free_dblocks(const extent& e);
+        virtual void sync();
+        virtual void rebuild(const std::vector<BlockID>& in_use);
+
+        // the cached blocks are free
+        virtual uint64_t get_nr_free_blocks() const { return nr_free + nr_cached; };
+        virtual std::future<void> read_dblock_async(BlockID id, Block& dst);
+        virtual std::future<void> write_dblock_async(BlockID id, const Block& src);
+        virtual void read_dblocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        virtual void write_dblocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
 
     private:
         // since super block doesn't usually change its config, let's cache it.
-        super_block sblock;
+        // sblock refers to own_sblock if no shared super block is given
+        super_block own_sblock;
+        super_block& sblock;
+        const bool writeback;
+
+        // protect the global free list below
+        std::mutex mutex;
+        // the group at sblock.h_dblock, valid if head_loaded
+        Block head;
+        bool head_loaded;
+        bool head_dirty;
+        bool sb_dirty;
+        // the head group and the super block are written once a batch of frees is done
+        bool deferred;
+        // # of free blocks on the global free list
+        std::atomic<uint64_t> nr_free;
+
+        struct Shard {
+            std::mutex mutex;
+            // popped from the back, in the order of the free list
+            std::vector<BlockID> blocks;
+        };
+        const uint64_t batch;
+        const uint64_t nr_shards;
+        std::unique_ptr<Shard[]> shards;
+        std::atomic<uint64_t> nr_cached;
+
+        Shard& local_shard();
+        void refill(Shard& shard);
+        void drain(Shard& shard, uint64_t n);
+        void drain_all();
+        void clear_shards();
+
+        // the helpers below expect the caller to hold mutex
+        BlockID allocate_locked(BlockID goal=0);
+        void free_locked(BlockID id);
+        Block& load_head();
+        // the group at i as laid out by mkfs
+        void fill_group(BlockID i, Block& bl);
+        void mark_unclean();
+        void head_modified();
+        void sb_modified();
     };
 
 };
\ No newline at end of file
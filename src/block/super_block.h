@@ -16,6 +16,27 @@ namespace solid {
             BlockID nr_dblock;
 
             BlockID h_dblock;
+
+            // the free-inode bitmap takes the last nr_ibitmap blocks of the inode table,
+            // 0 if there is none (the bitmap is then rebuilt in memory at mount)
+            BlockID s_ibitmap;
+            BlockID nr_ibitmap;
+            uint64_t nr_free_inode;
+
+            // BlockAllocator of the data region
+            uint64_t allocator;
+
+            // 1 if the allocator state on the storage is up to date (a checkpoint), cleared by the
+            // first allocation or free after it; the allocator is rebuilt at mount if it's 0
+            uint64_t clean;
+            // # of free data blocks as of the last checkpoint
+            uint64_t nr_free_dblock;
+
+            // lazy mkfs: the first block of the allocator metadata (freelist groups or bitmap blocks)
+            // and of the inode table not initialized on the storage yet, 0 if all of it is;
+            // the blocks from there on are implied by the layout and written on first touch
+            BlockID s_lazy_dblock;
+            BlockID s_lazy_iblock;
         };
         uint8_t data[config::block_size];
     };
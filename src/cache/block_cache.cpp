@@ -0,0 +1,230 @@
+#include "cache/block_cache.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <algorithm>
+#include <cstring>
+
+namespace solid {
+    BlockCache::BlockCache(Storage* inner, uint64_t nr_blocks, bool writeback, uint64_t nr_shards)
+        : inner(inner), writeback(writeback), nr_shards(std::max<uint64_t>(nr_shards, 1)),
+          hits(0), misses(0), evictions(0), writebacks(0) {
+        capacity = std::max<uint64_t>(nr_blocks / this->nr_shards, 1);
+        kin = std::max<uint64_t>(capacity / 4, 1);
+        kout = std::max<uint64_t>(capacity / 2, 1);
+        shards.reset(new Shard[this->nr_shards]);
+    }
+
+    BlockCache::~BlockCache() {
+        try {
+            write_dirty();
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "@~BlockCache: fail to write back " << e.what();
+        }
+        cache_stats st = stats();
+        LOG(INFO) << "block cache: " << st.hits << " hits, " << st.misses << " misses, "
+                  << st.evictions << " evictions, " << st.writebacks << " writebacks";
+        delete inner;
+    }
+
+    /**
+     * @brief the cached entry of Block id, or nullptr; the caller should hold s.mutex
+    */
+    BlockCache::Entry* BlockCache::lookup(Shard& s, BlockID id) {
+        auto p = s.map.find(id);
+        if(p == s.map.end()) {
+            return nullptr;
+        }
+        auto it = p->second;
+        // 2Q: a hit in A1in doesn't count, the block may just be part of a scan
+        if(it->hot) {
+            s.am.splice(s.am.begin(), s.am, it);
+        }
+        return &*it;
+    }
+
+    // the caller should hold s.mutex
+    void BlockCache::remember(Shard& s, BlockID id) {
+        s.a1out.push_front(id);
+        s.ghost[id] = s.a1out.begin();
+        if(s.a1out.size() > kout) {
+            s.ghost.erase(s.a1out.back());
+            s.a1out.pop_back();
+        }
+    }
+
+    /**
+     * @brief make an entry for Block id (not cached yet), evicting one if the shard is full
+     * the content of the entry is undefined; the caller should hold s.mutex
+    */
+    BlockCache::Entry* BlockCache::insert(Shard& s, BlockID id) {
+        // seen recently, so it goes to Am directly
+        bool hot = false;
+        auto g = s.ghost.find(id);
+        if(g != s.ghost.end()) {
+            s.a1out.erase(g->second);
+            s.ghost.erase(g);
+            hot = true;
+        }
+        std::list<Entry>& target = hot ? s.am : s.a1in;
+        if(s.map.size() >= capacity) {
+            bool from_in = !s.a1in.empty() && (s.a1in.size() > kin || s.am.empty());
+            std::list<Entry>& victims = from_in ? s.a1in : s.am;
+            Entry& v = victims.back();
+            if(v.dirty) {
+                inner->write_block(v.id, v.block.data);
+                writebacks++;
+            }
+            s.map.erase(v.id);
+            if(from_in) {
+                remember(s, v.id);
+            }
+            evictions++;
+            // reuse the node of the victim
+            target.splice(target.begin(), victims, std::prev(victims.end()));
+        } else {
+            target.emplace_front();
+        }
+        Entry& e = target.front();
+        e.id = id;
+        e.dirty = false;
+        e.hot = hot;
+        s.map[id] = target.begin();
+        return &e;
+    }
+
+    /** 
+     * @brief read Block id to dst, from the cache if possible
+     * @return if it's out of range, throw exception
+     */
+    void BlockCache::read_block(BlockID id, uint8_t* dst) {
+        Shard& s = shard(id);
+        {
+            std::lock_guard<std::mutex> lk(s.mutex);
+            Entry* e = lookup(s, id);
+            if(e != nullptr) {
+                hits++;
+                std::memcpy(dst, e->block.data, config::block_size);
+                return;
+            }
+        }
+        read_blocks({id}, {dst});
+    }
+
+    /**
+     * @brief read Block ids[i] to dsts[i], the misses are read from the inner storage in one call
+     * @return if it's out of range, throw exception
+     */
+    void BlockCache::read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        std::vector<BlockID> miss_ids;
+        std::vector<uint8_t*> miss_dsts;
+        for(auto i=0;i<ids.size();i++) {
+            Shard& s = shard(ids[i]);
+            std::lock_guard<std::mutex> lk(s.mutex);
+            Entry* e = lookup(s, ids[i]);
+            if(e != nullptr) {
+                hits++;
+                std::memcpy(dsts[i], e->block.data, config::block_size);
+            } else {
+                misses++;
+                miss_ids.push_back(ids[i]);
+                miss_dsts.push_back(dsts[i]);
+            }
+        }
+        if(miss_ids.empty()) {
+            return;
+        }
+        inner->read_blocks(miss_ids, miss_dsts);
+        for(auto i=0;i<miss_ids.size();i++) {
+            Shard& s = shard(miss_ids[i]);
+            std::lock_guard<std::mutex> lk(s.mutex);
+            Entry* e = lookup(s, miss_ids[i]);
+            if(e != nullptr) {
+                // written while we were reading, the cached one is newer
+                std::memcpy(miss_dsts[i], e->block.data, config::block_size);
+            } else {
+                e = insert(s, miss_ids[i]);
+                std::memcpy(e->block.data, miss_dsts[i], config::block_size);
+            }
+        }
+    }
+
+    /** 
+     * @brief write src to Block id
+     * @return if it's out of range, throw exception
+     */
+    void BlockCache::write_block(BlockID id, const uint8_t* src) {
+        write_blocks({id}, {src});
+    }
+
+    void BlockCache::write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        if(!writeback) {
+            inner->write_blocks(ids, srcs);
+        }
+        for(auto i=0;i<ids.size();i++) {
+            Shard& s = shard(ids[i]);
+            std::lock_guard<std::mutex> lk(s.mutex);
+            Entry* e = lookup(s, ids[i]);
+            if(e == nullptr) {
+                e = insert(s, ids[i]);
+            }
+            std::memcpy(e->block.data, srcs[i], config::block_size);
+            e->dirty = writeback;
+        }
+    }
+
+    /**
+     * @brief in write-through mode the inner storage is up to date, so its pointer is valid
+     * @return nullptr in write-back mode or if the inner storage can't do it
+     */
+    const uint8_t* BlockCache::block_ptr(BlockID id) {
+        if(writeback) {
+            return nullptr;
+        }
+        return inner->block_ptr(id);
+    }
+
+    /**
+     * @brief write all the dirty blocks to the inner storage in block order
+     */
+    void BlockCache::write_dirty() {
+        if(writeback) {
+            std::vector<std::unique_lock<std::mutex>> locks;
+            std::vector<Entry*> dirty;
+            for(uint64_t i=0;i<nr_shards;i++) {
+                locks.emplace_back(shards[i].mutex);
+                for(auto l : {&shards[i].a1in, &shards[i].am}) {
+                    for(auto& e : *l) {
+                        if(e.dirty)
+                            dirty.push_back(&e);
+                    }
+                }
+            }
+            std::sort(dirty.begin(), dirty.end(), [](Entry* a, Entry* b){ return a->id < b->id; });
+            std::vector<BlockID> ids;
+            std::vector<const uint8_t*> srcs;
+            for(auto e : dirty) {
+                ids.push_back(e->id);
+                srcs.push_back(e->block.data);
+            }
+            inner->write_blocks(ids, srcs);
+            for(auto e : dirty) {
+                e->dirty = false;
+            }
+            writebacks += dirty.size();
+        }
+    }
+
+    void BlockCache::flush() {
+        write_dirty();
+        inner->flush();
+    }
+
+    void BlockCache::sync() {
+        write_dirty();
+        inner->sync();
+    }
+
+    cache_stats BlockCache::stats() const {
+        return cache_stats{hits.load(), misses.load(), evictions.load(), writebacks.load()};
+    }
+};
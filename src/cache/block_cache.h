@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "storage/storage.h"
+#include "block/block.h"
+#include "common.h"
+
+namespace solid {
+    struct cache_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        // dirty blocks written to the inner storage
+        uint64_t writebacks;
+    };
+
+    /**
+     * @brief a sized block cache in front of the inner storage, split into shards by block id
+     * each shard runs 2Q: a block enters a FIFO (A1in) and is only promoted to the LRU (Am)
+     * if it's referenced again after leaving the FIFO (remembered by the ghost list A1out),
+     * so a cold scan passes through the FIFO without pushing the hot metadata out of Am
+     * The inner storage is owned and deleted with the cache.
+     * @param nr_blocks: # of blocks cached in total
+     * @param writeback: keep the written blocks dirty until eviction or flush(), otherwise write through
+    */
+    class BlockCache: public Storage {
+    private:
+        struct Entry {
+            BlockID id;
+            bool dirty;
+            // in Am
+            bool hot;
+            Block block;
+        };
+
+        struct Shard {
+            std::mutex mutex;
+            std::list<Entry> a1in;
+            std::list<Entry> am;
+            std::unordered_map<BlockID, std::list<Entry>::iterator> map;
+            // the ids recently evicted from A1in, most recent first
+            std::list<BlockID> a1out;
+            std::unordered_map<BlockID, std::list<BlockID>::iterator> ghost;
+        };
+
+        Storage* inner;
+        const bool writeback;
+        const uint64_t nr_shards;
+        // per shard: # of cached blocks, the target size of A1in, the size of A1out
+        uint64_t capacity;
+        uint64_t kin;
+        uint64_t kout;
+        std::unique_ptr<Shard[]> shards;
+
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> evictions;
+        std::atomic<uint64_t> writebacks;
+
+        Shard& shard(BlockID id) { return shards[id % nr_shards]; }
+        Entry* lookup(Shard& s, BlockID id);
+        Entry* insert(Shard& s, BlockID id);
+        void remember(Shard& s, BlockID id);
+        void write_dirty();
+
+    public:
+        BlockCache(Storage* inner, uint64_t nr_blocks, bool writeback=false, uint64_t nr_shards=16);
+        ~BlockCache();
+        void read_block(BlockID id, uint8_t* dst);
+        void write_block(BlockID id, const uint8_t* src);
+        void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+        const uint8_t* block_ptr(BlockID id);
+        // passed down, the cached copies are left alone since nobody reads a free block
+        void discard(BlockID id, uint64_t n) { inner->discard(id, n); };
+
+        void flush();
+        void sync();
+
+        cache_stats stats() const;
+    };
+};
@@ -1,23 +1,66 @@
 #include <iostream>
 #include <algorithm>
+#include <iterator>
 #include <sstream>
 #include <stack>
 #include "fs/file_system.h"
 #include "storage/memory_storage.h"
 #include "storage/file_storage.h"
+#include "storage/posix_storage.h"
+#include "storage/uring_storage.h"
+#include "storage/mmap_storage.h"
+#include "storage/writeback_storage.h"
+#include "storage/discard_storage.h"
 #include "block/freelist_blockmanager.h"
+#include "block/bitmap_blockmanager.h"
 #include "block/block.h"
 #include "directory/directory.h"
 #include "utils/fs_exception.h"
 
 namespace solid {
-    FileSystem::FileSystem(BlockID nr_blocks,BlockID nr_iblock_blocks,const std::string& path) {
+    FileSystem::FileSystem(BlockID nr_blocks,BlockID nr_iblock_blocks,const std::string& path,const mount_options& opts) {
         //TODO(lonhh)
         // this should be actually initilized with a file or disk
         if(path == "") {
-            storage = new MemoryStorage(nr_blocks);
-        } else {
+            MemoryStorage::HugePage huge_page = MemoryStorage::HugePage::NONE;
+            if(opts.huge_page == "thp") {
+                huge_page = MemoryStorage::HugePage::TRANSPARENT;
+            } else if(opts.huge_page == "explicit") {
+                huge_page = MemoryStorage::HugePage::EXPLICIT;
+            } else if(opts.huge_page != "none") {
+                throw fs_error("unknown huge page mode ",opts.huge_page);
+            }
+            storage = new MemoryStorage(nr_blocks,huge_page);
+        } else if(opts.backend == "fstream") {
             storage = new FileStorage(nr_blocks,path);
+        } else if(opts.backend == "pread" || opts.backend == "direct") {
+            storage = new PosixStorage(nr_blocks,path,opts.backend == "direct");
+        } else if(opts.backend == "uring") {
+            storage = new UringStorage(nr_blocks,path);
+        } else if(opts.backend == "mmap") {
+            storage = new MmapStorage(nr_blocks,path);
+        } else {
+            throw fs_error("unknown storage backend ",opts.backend);
+        }
+        if(opts.discard) {
+            // right above the device, so that every write reaching it cancels a pending discard
+            storage = new DiscardStorage(storage,opts.discard_rate);
+        }
+        if(opts.writeback) {
+            storage = new WriteBackStorage(storage,opts.commit_interval_ms,opts.dirty_threshold);
+        }
+        cache = nullptr;
+        prealloc_blocks = opts.prealloc_blocks;
+        delalloc_blocks = opts.delalloc_blocks;
+        lazy_init = opts.lazy_init;
+        extents = opts.extents;
+        nr_delayed = 0;
+        nr_reserved = 0;
+        nr_prealloc = 0;
+        if(opts.cache_blocks > 0 && path != "") {
+            // write through, the write-back layer below (if any) bounds how long a block stays dirty
+            cache = new BlockCache(storage,opts.cache_blocks);
+            storage = cache;
         }
         init = true;
 
@@ -32,13 +75,40 @@ namespace solid {
             sb.s_dblock = 1 + nr_iblock_blocks;
             sb.nr_dblock = nr_blocks - 1 - nr_iblock_blocks;
 
+            // the free-inode bitmap lives at the end of the inode table
+            sb.nr_ibitmap = INodeManager::bitmap_blocks(nr_iblock_blocks);
+            sb.s_ibitmap = sb.nr_ibitmap > 0 ? sb.s_iblock + nr_iblock_blocks - sb.nr_ibitmap : 0;
+            sb.nr_free_inode = 0;
+            sb.s_lazy_dblock = 0;
+            sb.s_lazy_iblock = 0;
+
+            if(opts.allocator == "freelist") {
+                sb.allocator = BlockAllocator::FREELIST;
+            } else if(opts.allocator == "bitmap") {
+                sb.allocator = BlockAllocator::BITMAP;
+            } else {
+                throw fs_error("unknown block allocator ",opts.allocator);
+            }
+
             sb.magic_number = 0xdeadbeef;
             storage->write_block(0,sb.data);
             init = false;
         }
         
-        bm = new FreeListBlockManager(storage,&sb);
-        im = new INodeManager(storage,&sb);
+        if(sb.allocator == BlockAllocator::FREELIST) {
+            bm = new FreeListBlockManager(storage,&sb,opts.writeback,opts.alloc_batch);
+        } else if(sb.allocator == BlockAllocator::BITMAP) {
+            bm = new BitmapBlockManager(storage,&sb,opts.writeback);
+        } else {
+            throw fs_error("unknown block allocator ",sb.allocator," in the super block");
+        }
+        bm->set_discard(opts.discard);
+        im = new INodeManager(storage,&sb,opts.writeback);
+        if(init && !sb.clean) {
+            // not unmounted since the last checkpoint, the allocator state on the storage is stale
+            LOG(WARNING) << "the file system was not cleanly unmounted, rebuild the block allocator";
+            rebuild_allocator();
+        }
 
         maximum_file_size = config::data_ptr_cnt - 3;
         const uint64_t factor = config::block_size/sizeof(BlockID);
@@ -46,14 +116,74 @@ namespace solid {
         maximum_file_size *= config::block_size;
     }
 
+    FileSystem::~FileSystem() {
+        if(bm != nullptr) {
+            try {
+                flush_all_delayed();
+                release_all_prealloc();
+            } catch (const std::exception& e) {
+                LOG(ERROR) << "@~FileSystem: fail to release the preallocated blocks " << e.what();
+            }
+        }
+        // the cursors pin blocks of bm
+        cursors.clear();
+        delete im;
+        delete bm;
+        if(storage != nullptr) {
+            try {
+                storage->sync();
+            } catch (const std::exception& e) {
+                LOG(ERROR) << "@~FileSystem: fail to sync " << e.what();
+            }
+        }
+        delete storage;
+    }
+
+    void FileSystem::flush() {
+        flush_all_delayed();
+        im->flush();
+        bm->sync();
+        storage->flush();
+    }
+
+    void FileSystem::sync() {
+        flush_all_delayed();
+        // a checkpoint must not count the reserved blocks as used, they would leak after a crash
+        release_all_prealloc();
+        im->flush();
+        bm->sync();
+        storage->sync();
+    }
+
+    /**
+     * @brief the blocks reserved ahead of the appends count as free, the ones set aside for the
+     * delayed blocks as used
+    */
+    void FileSystem::statfs(struct statvfs* st) {
+        uint64_t nr_free = bm->get_nr_free_blocks() + nr_prealloc;
+        nr_free = nr_free > nr_reserved ? nr_free - nr_reserved : 0;
+        std::memset(st, 0, sizeof(struct statvfs));
+        st->f_bsize = config::block_size;
+        st->f_frsize = config::block_size;
+        st->f_blocks = sb.nr_dblock;
+        st->f_bfree = nr_free;
+        st->f_bavail = nr_free;
+        st->f_files = im->get_nr_inodes();
+        st->f_ffree = im->get_nr_free_inodes();
+        st->f_favail = st->f_ffree;
+        st->f_fsid = sb.magic_number;
+        st->f_flag = 0;
+        st->f_namemax = 1024;
+    }
+
     void FileSystem::mkfs() {
         //root should be inserted by im->mkfs()
-        im->mkfs();
-        bm->mkfs();
+        im->mkfs(lazy_init);
+        bm->mkfs(lazy_init);
 
         // init inode for the root
         INode inode = INode::get_inode(0,INodeType::DIRECTORY,0777);
-        BlockID b = bm->allocate_dblock();
+        BlockID b = bm->allocate_dblock(goal_dblock(inode));
         inode.p_block[0] = b;
         inode.block++;
 
@@ -124,16 +254,46 @@ namespace solid {
         uint64_t s_index = config::idiv_block_size(offset);
         uint64_t e_index = (config::mod_block_size(offset+size) == 0) ? config::idiv_block_size(offset+size) : config::idiv_block_size(offset+size) + 1;
         uint64_t nr_blocks = e_index - s_index;
-        std::vector<BlockID> blockid_arrays = read_dblock_index(inode,s_index,e_index);
+        // in delayed allocation, the blocks past the last data block are in memory or holes
+        uint64_t m_index = is_delayed(inode) ? std::max(s_index,std::min<uint64_t>(e_index,inode.block)) : e_index;
+        std::vector<BlockID> blockid_arrays = read_dblock_index(inode,s_index,m_index);
+
+        // read all the blocks in one call, so that adjacent blocks become one I/O
+        // a block covered by the read goes straight to dst, only a partial head or tail is read into a copy
+        const uint64_t nr_mapped = blockid_arrays.size();
+        Block edge[2];
+        std::vector<uint8_t*> dsts(nr_mapped);
+        std::vector<const uint8_t*> ptrs(nr_blocks,nullptr);
+        for(uint64_t i=0;i<nr_mapped;i++) {
+            uint64_t b_offset = (s_index + i) * config::block_size;
+            if(offset <= b_offset && offset + size >= b_offset + config::block_size) {
+                dsts[i] = dst + (b_offset - offset);
+            } else {
+                dsts[i] = edge[i == 0 ? 0 : 1].data;
+                ptrs[i] = dsts[i];
+            }
+        }
+        bm->read_dblocks(blockid_arrays,dsts);
+        auto pages = delayed.find(id);
+        for(auto i=m_index;i<e_index;i++) {
+            std::map<uint64_t, Block>::iterator q;
+            if(pages != delayed.end() && (q = pages->second.find(i)) != pages->second.end()) {
+                ptrs[i - s_index] = q->second.data;
+            }
+        }
 
         // the total number of bytes
         uint64_t s = 0;
         // read [s_addr,s_addr+nr_bytes) in the block
         uint64_t s_addr = config::mod_block_size(offset);
         uint64_t nr_bytes = std::min(config::block_size - s_addr, size - s);
-        for(auto p=blockid_arrays.begin();p!=blockid_arrays.end();p++) {
-            Block bl = bm->read_dblock(*p);
-            std::memcpy(dst+s,bl.data+s_addr,nr_bytes);
+        for(uint64_t i=0;i<nr_blocks;i++) {
+            if(ptrs[i] != nullptr) {
+                std::memcpy(dst+s,ptrs[i]+s_addr,nr_bytes);
+            } else if(i >= nr_mapped) {
+                // a hole of the delayed blocks
+                std::memset(dst+s,0,nr_bytes);
+            }
 
             //update the s_addr and nr_bytes
             s = s + nr_bytes;
@@ -157,15 +317,27 @@ namespace solid {
         inode.mtime = inode.atime;
 
 
-        if(offset + size > inode.block * config::block_size) {
+        // the blocks from old_block on are allocated by this write, their content is garbage
+        const uint64_t old_block = inode.block;
+        if(offset + size > inode.block * config::block_size && !is_delayed(inode)) {
             // the last block index [)
             uint64_t nr_allocate_blocks = ((config::mod_block_size(offset+size) == 0) ?
                      config::idiv_block_size(offset+size) : config::idiv_block_size(offset+size) + 1) - inode.block;
+            // the blocks set aside for the delayed ones are not for the taking
+            if(nr_reserved > 0 && nr_allocate_blocks + nr_reserved > bm->get_nr_free_blocks()) {
+                throw fs_exception(std::errc::no_space_on_device,
+                    "@write: run out of data block for ",id);
+            }
             allocated_blocks.reserve(nr_allocate_blocks);
+            // get all the data blocks in one go, so that they are as contiguous as possible
+            std::vector<BlockID> dblocks = allocate_append(inode,nr_allocate_blocks,offset,size);
             for(auto i=0;i<nr_allocate_blocks;i++){
                 try {
-                    allocated_blocks.push_back(new_dblock(inode));
+                    allocated_blocks.push_back(new_dblock(inode,dblocks[i]));
                 } catch (const fs_exception& e) {
+                    for(auto j=i;j<nr_allocate_blocks;j++) {
+                        bm->free_dblock(dblocks[j]);
+                    }
                     for(auto t : allocated_blocks) {
                         delete_dblock(inode);
                     }
@@ -198,33 +370,102 @@ namespace solid {
         uint64_t e_index = (config::mod_block_size(offset+size) == 0) ? config::idiv_block_size(offset+size) : config::idiv_block_size(offset+size) + 1;
         uint64_t nr_blocks = e_index - s_index;
         
-        // don't count the just-allocated blocks
-        std::vector<BlockID> blockid_arrays = read_dblock_index(inode,s_index,e_index);
-        blockid_arrays.reserve(blockid_arrays.size() + std::distance(allocated_blocks.begin(),allocated_blocks.end()));
-        blockid_arrays.insert(blockid_arrays.end(),allocated_blocks.begin(),allocated_blocks.end());
+        // the inode has been updated by new_dblock, so this includes the just-allocated blocks.
+        // each block must appear once, or a stale copy may overwrite the patched one
+        // in delayed allocation, the blocks from m_index on are patched in memory
+        uint64_t m_index = is_delayed(inode) ? std::max(s_index,std::min<uint64_t>(e_index,inode.block)) : e_index;
+        if(m_index < e_index) {
+            // the flush has to find the blocks up to the new end, fail now rather than then
+            uint64_t end = config::mod_block_size(inode.size) == 0 ?
+                           config::idiv_block_size(inode.size) : config::idiv_block_size(inode.size) + 1;
+            reserve_delayed(inode,std::max(end,e_index));
+        }
+        std::vector<BlockID> blockid_arrays = read_dblock_index(inode,s_index,m_index);
+
+        // a block covered by the write goes straight from src; only the head and the tail can be
+        // partially covered, they are patched in a copy read first unless it was just allocated.
+        // adjacent blocks become one I/O
+        const uint64_t nr_mapped = blockid_arrays.size();
+        std::vector<const uint8_t*> srcs(nr_mapped);
+        std::vector<uint8_t*> ptrs(nr_blocks,nullptr);
+        Block edge[2];
+        std::vector<BlockID> read_ids;
+        std::vector<uint8_t*> read_dsts;
+        for(uint64_t i=0;i<nr_mapped;i++) {
+            uint64_t b_offset = (s_index + i) * config::block_size;
+            if(offset <= b_offset && offset + size >= b_offset + config::block_size) {
+                srcs[i] = src + (b_offset - offset);
+                continue;
+            }
+            uint8_t* buf = edge[i == 0 ? 0 : 1].data;
+            if(s_index + i >= old_block) {
+                std::memset(buf,0,config::block_size);
+            } else {
+                read_ids.push_back(blockid_arrays[i]);
+                read_dsts.push_back(buf);
+            }
+            srcs[i] = buf;
+            ptrs[i] = buf;
+        }
+        bm->read_dblocks(read_ids,read_dsts);
+        if(m_index < e_index) {
+            std::map<uint64_t, Block>& pages = delayed[id];
+            for(auto i=m_index;i<e_index;i++) {
+                auto q = pages.find(i);
+                if(q == pages.end()) {
+                    q = pages.emplace(i,Block()).first;
+                    std::memset(q->second.data,0,config::block_size);
+                    nr_delayed++;
+                }
+                ptrs[i - s_index] = q->second.data;
+            }
+        }
 
         // the total number of bytes
         uint64_t s = 0;
         // read [s_addr,s_addr+nr_bytes) in the block
         uint64_t s_addr = config::mod_block_size(offset);
         uint64_t nr_bytes = std::min(config::block_size - s_addr, size - s);
-        for(auto p=blockid_arrays.begin();p!=blockid_arrays.end();p++) {
-            Block bl = bm->read_dblock(*p);
-            std::memcpy(bl.data+s_addr,src+s,nr_bytes);
-            bm->write_dblock(*p,bl);
+        for(auto i=0;i<ptrs.size();i++) {
+            if(ptrs[i] != nullptr) {
+                std::memcpy(ptrs[i]+s_addr,src+s,nr_bytes);
+            }
 
             //update the s_addr and nr_bytes
             s = s + nr_bytes;
             s_addr = config::mod_block_size(offset + s);
             nr_bytes = std::min(config::block_size - s_addr, size - s);
         }
+        // the blocks allocated for a gap past the old end are not covered by the write, they are
+        // zeroed so that the file doesn't expose what they held
+        Block zero;
+        const uint64_t g_index = std::min(s_index,inode.block);
+        if(old_block < g_index) {
+            std::memset(zero.data,0,config::block_size);
+            std::vector<BlockID> gap = read_dblock_index(inode,old_block,g_index);
+            blockid_arrays.insert(blockid_arrays.begin(),gap.begin(),gap.end());
+            srcs.insert(srcs.begin(),gap.size(),zero.data);
+        }
+        bm->write_dblocks(blockid_arrays,srcs);
         inode.size = std::max(inode.size,(uint64_t)offset+size);
         im->write_inode(id,inode);
+        if(nr_delayed > delalloc_blocks) {
+            flush_all_delayed();
+        }
         return s;
     }
 
     // read [begin,end) entries
     std::vector<BlockID> FileSystem::read_dblock_index(INode& inode,uint64_t begin,uint64_t end) {
+        auto c = cursors.find(inode.inode_number);
+        if(c != cursors.end() && end == begin + 1 && c->second.last_block != 0 && c->second.last_index == begin) {
+            return {c->second.last_block};
+        }
+        if(is_extent_mapped(inode)) {
+            std::vector<BlockID> ret = read_extent_index(inode,begin,end);
+            remember_mapping(inode,end - 1,ret);
+            return ret;
+        }
         std::vector<BlockID> ret;
         ret.reserve(end - begin);
 
@@ -248,6 +489,7 @@ namespace solid {
                 throw fs_error("Trying to access maxmium file size");
             }
         }
+        remember_mapping(inode,end - 1,ret);
         return ret;
     }
 
@@ -270,7 +512,7 @@ namespace solid {
             }
         // note here [begin, end) in [0,512)
         } else if (depth == 1) {
-            Block bl = bm->read_dblock(inode.p_block[10]);
+            const Block& bl = index_block(cursor(inode.inode_number),0,inode.p_block[10]);
             for(uint64_t i=begin; begin < end && i< factor ;i++, begin++){
                 vec.push_back(bl.bl_entry[i]);
                 ret++;
@@ -278,10 +520,11 @@ namespace solid {
             }
         // note here [begin, end) in [0,512 * 512)
         } else if (depth == 2) {
-            Block bl_1 = bm->read_dblock(inode.p_block[11]);
+            map_cursor& c = cursor(inode.inode_number);
+            const Block& bl_1 = index_block(c,0,inode.p_block[11]);
             auto si = begin / factor;
             for(uint64_t i=si; i < factor && begin < end;i++){
-                Block bl_2 = bm->read_dblock(bl_1.bl_entry[i]);
+                const Block& bl_2 = index_block(c,1,bl_1.bl_entry[i]);
                 
                 auto sj = begin % factor;
                 for(uint64_t j=sj; j < factor && begin < end;j++, begin++){
@@ -292,14 +535,15 @@ namespace solid {
             }
         // note here [begin, end) in [0,512 * 512)
         } else {
-            Block bl_1 = bm->read_dblock(inode.p_block[12]);
+            map_cursor& c = cursor(inode.inode_number);
+            const Block& bl_1 = index_block(c,0,inode.p_block[12]);
             auto si = begin / factor / factor;
             for(uint64_t i=si; i < factor && begin < end;i++){
-                Block bl_2 = bm->read_dblock(bl_1.bl_entry[i]);
+                const Block& bl_2 = index_block(c,1,bl_1.bl_entry[i]);
                 
                 auto sj = (begin / factor ) % factor;
                 for(uint64_t j=sj; j < factor && begin < end;j++){
-                    Block bl_3 = bm->read_dblock(bl_2.bl_entry[j]);
+                    const Block& bl_3 = index_block(c,2,bl_2.bl_entry[j]);
                 
                 
                     auto sk = begin % factor ;
@@ -314,7 +558,351 @@ namespace solid {
         return ret;
     }
 
-    BlockID FileSystem::new_dblock(INode& inode) {
+    /**
+     * @brief allocate the n new blocks of the write [offset, offset+size) which extends inode
+     * an append starting where the previous one ended is streaming: it takes its blocks from the
+     * window of inode, which is refilled with twice as many blocks as the last time (up to
+     * prealloc_blocks); any other write drops the window
+    */
+    std::vector<BlockID> FileSystem::allocate_append(INode& inode,uint64_t n,uint64_t offset,uint64_t size) {
+        std::vector<BlockID> dblocks;
+        dblocks.reserve(n);
+        auto flatten = [&](const std::vector<extent>& extents, std::deque<BlockID>* to) {
+            for(auto& e : extents) {
+                for(auto b=e.start;b<e.start+e.len;b++) {
+                    if(to != nullptr)
+                        to->push_back(b);
+                    else
+                        dblocks.push_back(b);
+                }
+            }
+        };
+        if(prealloc_blocks == 0) {
+            flatten(bm->allocate_dblocks(n,goal_dblock(inode)),nullptr);
+            return dblocks;
+        }
+
+        INodeID id = inode.inode_number;
+        auto p = windows.find(id);
+        if(p == windows.end() || p->second.end != offset) {
+            // the first extending write, or not a streaming one
+            if(p != windows.end()) {
+                release_prealloc(id);
+            }
+            flatten(bm->allocate_dblocks(n,goal_dblock(inode)),nullptr);
+            prealloc_window& w = windows[id];
+            w.end = offset + size;
+            w.next = std::min<uint64_t>(16,prealloc_blocks);
+            return dblocks;
+        }
+
+        prealloc_window& w = p->second;
+        const uint64_t before = w.blocks.size();
+        if(w.blocks.size() < n) {
+            uint64_t want = std::max(n - w.blocks.size(),w.next);
+            BlockID goal = w.blocks.empty() ? goal_dblock(inode) : w.blocks.back() + 1;
+            try {
+                flatten(bm->allocate_dblocks(want,goal),&w.blocks);
+            } catch (const fs_exception& e) {
+                // not enough room for the whole window, just take what the write needs
+                flatten(bm->allocate_dblocks(n - w.blocks.size(),goal),&w.blocks);
+            }
+            w.next = std::min(w.next * 2,prealloc_blocks);
+        }
+        for(uint64_t i=0;i<n;i++) {
+            dblocks.push_back(w.blocks.front());
+            w.blocks.pop_front();
+        }
+        w.end = offset + size;
+        nr_prealloc = nr_prealloc + w.blocks.size() - before;
+        return dblocks;
+    }
+
+    void FileSystem::release(INodeID id) {
+        release_prealloc(id);
+        cursors.erase(id);
+    }
+
+    void FileSystem::release_prealloc(INodeID id) {
+        auto p = windows.find(id);
+        if(p == windows.end()) {
+            return;
+        }
+        std::deque<BlockID> blocks;
+        blocks.swap(p->second.blocks);
+        windows.erase(p);
+        nr_prealloc -= blocks.size();
+        Storage::for_each_run(std::vector<BlockID>(blocks.begin(),blocks.end()),[&](uint64_t begin, uint64_t len){
+            bm->free_dblocks(extent{blocks[begin],len});
+        });
+    }
+
+    void FileSystem::release_all_prealloc() {
+        while(!windows.empty()) {
+            release_prealloc(windows.begin()->first);
+        }
+    }
+
+    /**
+     * @brief give the delayed blocks of id data blocks, map them, and write them in one call
+    */
+    void FileSystem::flush_delayed(INodeID id) {
+        auto p = delayed.find(id);
+        if(p == delayed.end()) {
+            return;
+        }
+        std::map<uint64_t, Block>& pages = p->second;
+        INode inode = im->read_inode(id);
+        uint64_t begin = inode.block;
+        uint64_t end = config::mod_block_size(inode.size) == 0 ?
+                       config::idiv_block_size(inode.size) : config::idiv_block_size(inode.size) + 1;
+        if(begin < end) {
+            uint64_t n = end - begin;
+            std::vector<extent> extents = bm->allocate_dblocks(n,goal_dblock(inode));
+            std::vector<BlockID> dblocks;
+            dblocks.reserve(n);
+            for(auto& e : extents) {
+                for(auto b=e.start;b<e.start+e.len;b++) {
+                    dblocks.push_back(b);
+                }
+            }
+            for(auto i=0;i<n;i++) {
+                try {
+                    new_dblock(inode,dblocks[i]);
+                } catch (const fs_exception& e) {
+                    for(auto j=i;j<n;j++) {
+                        bm->free_dblock(dblocks[j]);
+                    }
+                    while(inode.block > begin) {
+                        delete_dblock(inode);
+                    }
+                    throw;
+                }
+            }
+            Block zero;
+            std::memset(zero.data,0,config::block_size);
+            std::vector<const uint8_t*> srcs(n,zero.data);
+            for(auto& q : pages) {
+                if(q.first >= begin && q.first < end)
+                    srcs[q.first - begin] = q.second.data;
+            }
+            bm->write_dblocks(dblocks,srcs);
+        }
+        nr_delayed -= pages.size();
+        delayed.erase(p);
+        unreserve_delayed(id);
+    }
+
+    void FileSystem::flush_all_delayed() {
+        while(!delayed.empty()) {
+            flush_delayed(delayed.begin()->first);
+        }
+    }
+
+    void FileSystem::drop_delayed(INodeID id,uint64_t begin) {
+        auto p = delayed.find(id);
+        if(p == delayed.end()) {
+            return;
+        }
+        std::map<uint64_t, Block>& pages = p->second;
+        auto q = pages.lower_bound(begin);
+        nr_delayed -= std::distance(q,pages.end());
+        pages.erase(q,pages.end());
+        if(pages.empty()) {
+            delayed.erase(p);
+            unreserve_delayed(id);
+        } else {
+            // begin is the new end of the file
+            reserve_delayed(im->read_inode(id),begin);
+        }
+    }
+
+    void FileSystem::reserve_delayed(const INode& inode,uint64_t end) {
+        uint64_t need = end > inode.block ? end - inode.block : 0;
+        if(is_extent_mapped(inode) || (inode.block == 0 && extents)) {
+            // a leaf block, or the whole tree if the extents don't fit in it
+            need += nr_index_blocks(end) + 1;
+        } else {
+            need += nr_index_blocks(end) - nr_index_blocks(inode.block);
+        }
+        auto p = reserved.find(inode.inode_number);
+        uint64_t old = p == reserved.end() ? 0 : p->second;
+        if(need > old && nr_reserved + need - old > bm->get_nr_free_blocks()) {
+            throw fs_exception(std::errc::no_space_on_device,
+                "@write: no room for the delayed blocks of ",inode.inode_number);
+        }
+        nr_reserved = nr_reserved - old + need;
+        reserved[inode.inode_number] = need;
+    }
+
+    void FileSystem::unreserve_delayed(INodeID id) {
+        auto p = reserved.find(id);
+        if(p != reserved.end()) {
+            nr_reserved -= p->second;
+            reserved.erase(p);
+        }
+    }
+
+    uint64_t FileSystem::nr_index_blocks(uint64_t n) {
+        const uint64_t factor = config::block_size/sizeof(BlockID);
+        uint64_t ret = 0;
+        uint64_t base = 10;
+        uint64_t per = 1;
+        for(auto depth=1;depth<=3 && n > base;depth++) {
+            per *= factor;
+            uint64_t cnt = std::min(n - base,per);
+            // a subtree covering per blocks, each level has a block per span blocks in use
+            for(uint64_t span=per;span >= factor;span /= factor) {
+                ret += (cnt + span - 1) / span;
+            }
+            base += per;
+        }
+        return ret;
+    }
+
+    /**
+     * @brief where the next block of inode should go: right after its last block, or for an empty
+     * file, at the same relative position in the data region as the inode in the inode table
+    */
+    BlockID FileSystem::goal_dblock(INode& inode) {
+        if(inode.block > 0) {
+            return read_dblock_index(inode,inode.block - 1,inode.block)[0] + 1;
+        }
+        uint64_t nr_inodes = std::max<uint64_t>(im->get_nr_inodes(),1);
+        return sb.s_dblock + (sb.nr_block - sb.s_dblock) / nr_inodes * inode.inode_number;
+    }
+
+    /**
+     * @brief rebuild the block allocator from the blocks reachable from the inodes in use
+    */
+    void FileSystem::rebuild_allocator() {
+        std::vector<BlockID> in_use;
+        for(INodeID id=0;id<im->get_nr_inodes();id++) {
+            INode inode = im->read_inode(id);
+            if(inode.itype != INodeType::FREE) {
+                collect_dblocks(inode,in_use);
+            }
+        }
+        bm->rebuild(in_use);
+    }
+
+    /**
+     * @brief append all the blocks of inode, the mapping blocks included, to vec
+     * only the first inode.block entries are followed, the rest of a mapping block is garbage
+    */
+    void FileSystem::collect_dblocks(INode& inode,std::vector<BlockID>& vec) {
+        if(is_extent_mapped(inode)) {
+            std::vector<BlockID> v = read_extent_index(inode,0,inode.block);
+            vec.insert(vec.end(),v.begin(),v.end());
+            if(inode.block > 0 && inode.e_header.depth == 1) {
+                vec.push_back(inode.e_extent[0].pblock);
+            }
+            return;
+        }
+        const uint64_t factor = config::block_size/sizeof(BlockID);
+        uint64_t n = inode.block;
+        for(auto i=0;i<10 && n > 0;i++,n--) {
+            vec.push_back(inode.p_block[i]);
+        }
+        uint64_t per = 1;
+        for(auto depth=1;depth<=3 && n > 0;depth++) {
+            per *= factor;
+            uint64_t cnt = std::min(n,per);
+            collect_index(inode.p_block[9 + depth],depth,cnt,vec);
+            n -= cnt;
+        }
+    }
+
+    /**
+     * @brief id is a mapping block of the given depth covering n data blocks
+    */
+    void FileSystem::collect_index(BlockID id,int depth,uint64_t n,std::vector<BlockID>& vec) {
+        vec.push_back(id);
+        const uint64_t factor = config::block_size/sizeof(BlockID);
+        uint64_t per = 1;
+        for(auto i=1;i<depth;i++) {
+            per *= factor;
+        }
+        BlockRef bl = bm->get_dblock(id);
+        for(uint64_t i=0;n > 0;i++) {
+            uint64_t cnt = std::min(n,per);
+            if(depth == 1) {
+                vec.push_back(bl->bl_entry[i]);
+            } else {
+                collect_index(bl->bl_entry[i],depth - 1,cnt,vec);
+            }
+            n -= cnt;
+        }
+    }
+
+    FileSystem::map_cursor& FileSystem::cursor(INodeID id) {
+        auto p = cursors.find(id);
+        if(p != cursors.end()) {
+            return p->second;
+        }
+        if(cursors.size() >= max_cursors) {
+            cursors.erase(cursors.begin());
+        }
+        return cursors[id];
+    }
+
+    Block& FileSystem::index_block(map_cursor& c,int level,BlockID id,bool fresh) {
+        if(!c.ref[level] || c.ref[level].get_id() != id) {
+            c.ref[level] = bm->get_dblock(id,fresh);
+        } else if(fresh) {
+            std::memset(c.ref[level]->data,0,config::block_size);
+        }
+        return *c.ref[level];
+    }
+
+    /**
+     * @brief the cursor of inode after blocks were unmapped: the mapping blocks in freed are
+     * forgotten, and so is the last mapping if it's past the end
+    */
+    void FileSystem::forget_mapping(INode& inode,const BlockID* freed,uint64_t n) {
+        auto p = cursors.find(inode.inode_number);
+        if(p == cursors.end()) {
+            return;
+        }
+        for(auto i=0;i<n;i++) {
+            p->second.forget(freed[i]);
+        }
+        if(p->second.last_index >= inode.block) {
+            p->second.last_block = 0;
+        }
+    }
+
+    void FileSystem::remember_mapping(INode& inode,uint64_t index,const std::vector<BlockID>& ret) {
+        auto p = cursors.find(inode.inode_number);
+        if(p != cursors.end() && !ret.empty()) {
+            p->second.last_index = index;
+            p->second.last_block = ret.back();
+        }
+    }
+
+    BlockID FileSystem::new_dblock(INode& inode,BlockID dblock) {
+        // the format of the mapping is picked when the file gets its first block
+        if(inode.block == 0) {
+            if(extents) {
+                inode.flags |= INodeFlag::EXTENTS;
+                inode.e_header.magic = extent_header::extent_magic;
+                inode.e_header.nr = 0;
+                inode.e_header.depth = 0;
+                inode.e_header.reserved = 0;
+            } else {
+                inode.flags &= ~INodeFlag::EXTENTS;
+            }
+        }
+        BlockID b = is_extent_mapped(inode) ? new_extent_dblock(inode,dblock) : new_tree_dblock(inode,dblock);
+        auto c = cursors.find(inode.inode_number);
+        if(c != cursors.end()) {
+            c->second.last_index = inode.block - 1;
+            c->second.last_block = b;
+        }
+        return b;
+    }
+
+    BlockID FileSystem::new_tree_dblock(INode& inode,BlockID dblock) {
         //TODO(lonhh) : do we need to check maximum file size or maximum # of blocks
         const BlockID factor = config::block_size/sizeof(BlockID);
 
@@ -366,11 +954,18 @@ namespace solid {
             nr_mblock += (flag_array[i] == 0 ? 1 : 0);
         }
 
-        // try to allocate nr_mblock + 1 blocks
+        // try to allocate nr_mblock + 1 blocks, or only the mapping blocks if dblock is given
         auto flag = 0;
-        for(auto i=0;i<nr_mblock+1;i++) {
+        auto nr_allocate = nr_mblock + (dblock == 0 ? 1 : 0);
+        if(dblock != 0) {
+            allocate_block_array[nr_mblock] = dblock;
+        }
+        // the mapping blocks go next to the data block they lead to
+        BlockID goal = dblock != 0 ? dblock : goal_dblock(inode);
+        for(auto i=0;i<nr_allocate;i++) {
             try {
-                allocate_block_array[i] = bm->allocate_dblock();
+                allocate_block_array[i] = bm->allocate_dblock(goal);
+                goal = allocate_block_array[i] + 1;
             } catch (const fs_exception& e) {
                 for(auto i=0;i<flag;i++) {
                     bm->free_dblock(allocate_block_array[i]);
@@ -382,7 +977,7 @@ namespace solid {
         }
 
         // we don't get enough blocks. Just free all of them
-        if (flag != nr_mblock + 1) {
+        if (flag != nr_allocate) {
             return 0;
         }
 
@@ -393,6 +988,7 @@ namespace solid {
         if(index_array[0] == 0) {
             inode.p_block[index_array[1]] = allocate_block_array[nr_mblock];
         } else if (index_array[0] == 1) {
+            map_cursor& c = cursor(inode.inode_number);
             // update the inode
             auto i_mblock = 0;
             if(flag_array[1] == 0) {
@@ -400,57 +996,59 @@ namespace solid {
                 i_mblock++;
             }
             // update the mapping block
-            Block bl = bm->read_dblock(inode.p_block[10]);
+            Block& bl = index_block(c,0,inode.p_block[10],flag_array[1] == 0);
             bl.bl_entry[index_array[1]] = allocate_block_array[nr_mblock];
-            bm->write_dblock(inode.p_block[10],bl);
+            c.ref[0].mark_dirty();
 
         } else if (index_array[0] == 2) {
+            map_cursor& c = cursor(inode.inode_number);
             // try to read inode.p_block[12] as the first level mapping bl1
             auto i_mblock = 0;
             if(flag_array[1] == 0) {
                 inode.p_block[11] = allocate_block_array[i_mblock];
                 i_mblock++;
             }
-            Block bl1 = bm->read_dblock(inode.p_block[11]);
+            Block& bl1 = index_block(c,0,inode.p_block[11],flag_array[1] == 0);
 
             // try to read bl1 entry[index_array[1]] as the second level mapping bl2
             if(flag_array[2] == 0) {
                 bl1.bl_entry[index_array[1]] = allocate_block_array[i_mblock];
-                bm->write_dblock(inode.p_block[11],bl1);
+                c.ref[0].mark_dirty();
                 i_mblock++;
             }
-            Block bl2 = bm->read_dblock(bl1.bl_entry[index_array[1]]);
+            Block& bl2 = index_block(c,1,bl1.bl_entry[index_array[1]],flag_array[2] == 0);
             // allocate the data block
             bl2.bl_entry[index_array[2]] = allocate_block_array[nr_mblock];
-            bm->write_dblock(bl1.bl_entry[index_array[1]],bl2);
+            c.ref[1].mark_dirty();
         } else {
+            map_cursor& c = cursor(inode.inode_number);
             // try to read inode.p_block[13] as the first level mapping bl1
             auto i_mblock = 0;
             if(flag_array[1] == 0) {
                 inode.p_block[12] = allocate_block_array[i_mblock];
                 i_mblock++;
             }
-            Block bl1 = bm->read_dblock(inode.p_block[12]);
+            Block& bl1 = index_block(c,0,inode.p_block[12],flag_array[1] == 0);
 
             // try to read bl1 entry[index_array[1]] as the second level mapping bl2
             if(flag_array[2] == 0) {
                 bl1.bl_entry[index_array[1]] = allocate_block_array[i_mblock];
-                bm->write_dblock(inode.p_block[12],bl1);
+                c.ref[0].mark_dirty();
                 i_mblock++;
             }
-            Block bl2 = bm->read_dblock(bl1.bl_entry[index_array[1]]);
+            Block& bl2 = index_block(c,1,bl1.bl_entry[index_array[1]],flag_array[2] == 0);
             
             // try to read bl2 entry[index_array[2]] as the third level mapping bl3
             if(flag_array[3] == 0) {
                 bl2.bl_entry[index_array[2]] = allocate_block_array[i_mblock];
-                bm->write_dblock(bl1.bl_entry[index_array[1]],bl2);
+                c.ref[1].mark_dirty();
                 i_mblock++;
             }
             
             // allocate the data block
-            Block bl3 = bm->read_dblock(bl2.bl_entry[index_array[2]]);
+            Block& bl3 = index_block(c,2,bl2.bl_entry[index_array[2]],flag_array[3] == 0);
             bl3.bl_entry[index_array[3]] = allocate_block_array[nr_mblock];
-            bm->write_dblock(bl2.bl_entry[index_array[2]],bl3);
+            c.ref[2].mark_dirty();
         }
         im->write_inode(inode.inode_number,inode);
         return allocate_block_array[nr_mblock];
@@ -463,6 +1061,9 @@ namespace solid {
             LOG(WARNING) << "@delete_dblock: delete blocks for empty file " << inode.inode_number;
             return 0;
         }
+        if(is_extent_mapped(inode)) {
+            return delete_extent_dblock(inode);
+        }
 
         int ret = 0;
 
@@ -525,6 +1126,7 @@ namespace solid {
             //ret = bm->free_dblock(inode.p_block[index_array[1]]);
             free_block_array[0] = inode.p_block[index_array[1]];
         } else if (index_array[0] == 1) {
+            map_cursor& c = cursor(inode.inode_number);
             // update the inode
             auto i_fblock = 0;
             if(flag_array[1] == 0) {
@@ -532,40 +1134,42 @@ namespace solid {
                 i_fblock++;
             }
             // get the mapping block
-            Block bl = bm->read_dblock(inode.p_block[10]);
+            const Block& bl = index_block(c,0,inode.p_block[10]);
             free_block_array[i_fblock] = bl.bl_entry[index_array[1]];
         } else if (index_array[0] == 2) {
+            map_cursor& c = cursor(inode.inode_number);
             // try to read inode.p_block[12] as the first level mapping bl1
             auto i_fblock = 0;
             if(flag_array[1] == 0) {
                 free_block_array[i_fblock] = inode.p_block[11];
                 i_fblock++;
             }
-            Block bl1 = bm->read_dblock(inode.p_block[11]);
+            const Block& bl1 = index_block(c,0,inode.p_block[11]);
 
             // whether to free the 2-level mapping block
             if(flag_array[2] == 0) {
                 free_block_array[i_fblock] = bl1.bl_entry[index_array[1]];
                 i_fblock++;
             }
-            Block bl2 = bm->read_dblock(bl1.bl_entry[index_array[1]]);
+            const Block& bl2 = index_block(c,1,bl1.bl_entry[index_array[1]]);
             // allocate the data block
             free_block_array[i_fblock] = bl2.bl_entry[index_array[2]];
         } else {
+            map_cursor& c = cursor(inode.inode_number);
             // try to read inode.p_block[13] as the first level mapping bl1
             auto i_fblock = 0;
             if(flag_array[1] == 0) {
                 free_block_array[i_fblock] = inode.p_block[12];
                 i_fblock++;
             }
-            Block bl1 = bm->read_dblock(inode.p_block[12]);
+            const Block& bl1 = index_block(c,0,inode.p_block[12]);
 
             // try to read bl1 entry[index_array[1]] as the second level mapping bl2
             if(flag_array[2] == 0) {
                 free_block_array[i_fblock] = bl1.bl_entry[index_array[1]];
                 i_fblock++;
             }
-            Block bl2 = bm->read_dblock(bl1.bl_entry[index_array[1]]);
+            const Block& bl2 = index_block(c,1,bl1.bl_entry[index_array[1]]);
             
             // try to read bl2 entry[index_array[2]] as the third level mapping bl3
             if(flag_array[3] == 0) {
@@ -574,16 +1178,343 @@ namespace solid {
             }
             
             // allocate the data block
-            Block bl3 = bm->read_dblock(bl2.bl_entry[index_array[2]]);
+            const Block& bl3 = index_block(c,2,bl2.bl_entry[index_array[2]]);
             free_block_array[i_fblock] =bl3.bl_entry[index_array[3]];
         }
         im->write_inode(inode.inode_number,inode);
 
+        // unpin them before they are freed
+        forget_mapping(inode,free_block_array,nr_fblock+1);
         for(auto i=0;i<=nr_fblock;i++) {
             bm->free_dblock(free_block_array[i]);
         }
         return nr_fblock+1;
     }
+
+    std::pair<const file_extent*,uint64_t> FileSystem::load_extents(const INode& inode) {
+        if(inode.e_header.magic != extent_header::extent_magic) {
+            throw fs_error("@load_extents: bad extent header of ",inode.inode_number);
+        }
+        if(inode.e_header.depth == 0) {
+            return {inode.e_extent,inode.e_header.nr};
+        }
+        const Block& bl = index_block(cursor(inode.inode_number),0,inode.e_extent[0].pblock);
+        if(bl.ex_header.magic != extent_header::extent_magic) {
+            throw fs_error("@load_extents: bad extent leaf ",inode.e_extent[0].pblock," of ",inode.inode_number);
+        }
+        return {bl.ex_entry,bl.ex_header.nr};
+    }
+
+    /**
+     * @brief read [begin,end) entries of an inode mapped by extents
+     * the extents are sorted and cover [0,inode.block) without a gap, so the first one is found by
+     * a binary search and the rest follow it
+    */
+    std::vector<BlockID> FileSystem::read_extent_index(INode& inode,uint64_t begin,uint64_t end) {
+        std::vector<BlockID> ret;
+        if(begin >= end) {
+            return ret;
+        }
+        ret.reserve(end - begin);
+        auto ex = load_extents(inode);
+        const file_extent* last = ex.first + ex.second;
+        const file_extent* p = std::upper_bound(ex.first,last,begin,[](uint64_t i,const file_extent& e){
+            return i < e.lblock;
+        });
+        if(p == ex.first) {
+            throw fs_error("@read_extent_index: block ",begin," of ",inode.inode_number," is not mapped");
+        }
+        --p;
+        for(uint64_t i=begin;i<end;p++) {
+            if(p == last || i >= (uint64_t)p->lblock + p->len) {
+                throw fs_error("@read_extent_index: block ",i," of ",inode.inode_number," is not mapped");
+            }
+            uint64_t e = std::min<uint64_t>(end,(uint64_t)p->lblock + p->len);
+            for(;i<e;i++) {
+                ret.push_back(p->pblock + (i - p->lblock));
+            }
+        }
+        return ret;
+    }
+
+    /**
+     * @brief map dblock (allocated here if 0) as the next block of an inode mapped by extents
+     * it grows the last extent if it's adjacent, otherwise it's a new extent. The extents are kept
+     * in the inode while they fit, then all of them move to a leaf block; a file too fragmented for
+     * the leaf block is remapped by the tree
+    */
+    BlockID FileSystem::new_extent_dblock(INode& inode,BlockID dblock) {
+        const uint64_t nr_inline = sizeof(inode.e_extent) / sizeof(file_extent);
+        const uint64_t nr_leaf = sizeof(Block::ex_entry) / sizeof(file_extent);
+        bool allocated = dblock == 0;
+        if(allocated) {
+            try {
+                dblock = bm->allocate_dblock(goal_dblock(inode));
+            } catch (const fs_exception& e) {
+                throw fs_exception(std::errc::no_space_on_device,
+                    "@new_dblock: run out of data blocks for ",inode.inode_number);
+            }
+        }
+        // try to append to the last one of the n extents in ex
+        auto append = [&](file_extent* ex,uint64_t n) {
+            if(n > 0) {
+                file_extent& e = ex[n - 1];
+                if(e.pblock + e.len == dblock && e.len < std::numeric_limits<uint32_t>::max()) {
+                    e.len++;
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        if(inode.e_header.depth == 0) {
+            uint64_t n = inode.e_header.nr;
+            if(!append(inode.e_extent,n)) {
+                if(n < nr_inline) {
+                    inode.e_extent[n] = {(uint32_t)inode.block,1,dblock};
+                    inode.e_header.nr++;
+                } else {
+                    // move the extents out of the inode
+                    BlockID leaf;
+                    try {
+                        leaf = bm->allocate_dblock(dblock + 1);
+                    } catch (const fs_exception& e) {
+                        if(allocated) {
+                            bm->free_dblock(dblock);
+                        }
+                        throw fs_exception(std::errc::no_space_on_device,
+                            "@new_dblock: run out of data blocks for ",inode.inode_number);
+                    }
+                    map_cursor& c = cursor(inode.inode_number);
+                    Block& bl = index_block(c,0,leaf,true);
+                    bl.ex_header = inode.e_header;
+                    std::copy(inode.e_extent,inode.e_extent + n,bl.ex_entry);
+                    bl.ex_entry[n] = {(uint32_t)inode.block,1,dblock};
+                    bl.ex_header.nr++;
+                    c.ref[0].mark_dirty();
+                    inode.e_header.depth = 1;
+                    inode.e_header.nr = 1;
+                    inode.e_extent[0] = {0,0,leaf};
+                }
+            }
+        } else {
+            BlockID leaf = inode.e_extent[0].pblock;
+            map_cursor& c = cursor(inode.inode_number);
+            Block& bl = index_block(c,0,leaf);
+            uint64_t n = bl.ex_header.nr;
+            if(!append(bl.ex_entry,n)) {
+                if(n == nr_leaf) {
+                    try {
+                        extents_to_tree(inode);
+                        return new_tree_dblock(inode,dblock);
+                    } catch (const fs_exception& e) {
+                        if(allocated) {
+                            bm->free_dblock(dblock);
+                        }
+                        throw;
+                    }
+                }
+                bl.ex_entry[n] = {(uint32_t)inode.block,1,dblock};
+                bl.ex_header.nr++;
+            }
+            c.ref[0].mark_dirty();
+        }
+        inode.block++;
+        im->write_inode(inode.inode_number,inode);
+        return dblock;
+    }
+
+    // delete the last block of an inode mapped by extents
+    int FileSystem::delete_extent_dblock(INode& inode) {
+        const uint64_t nr_inline = sizeof(inode.e_extent) / sizeof(file_extent);
+        BlockID free_block_array[2];
+        int nr_fblock = 0;
+        auto shrink = [&](file_extent* ex,uint16_t& n) {
+            file_extent& e = ex[n - 1];
+            free_block_array[nr_fblock++] = e.pblock + e.len - 1;
+            if(--e.len == 0) {
+                n--;
+            }
+        };
+
+        if(inode.e_header.depth == 0) {
+            shrink(inode.e_extent,inode.e_header.nr);
+        } else {
+            BlockID leaf = inode.e_extent[0].pblock;
+            map_cursor& c = cursor(inode.inode_number);
+            Block& bl = index_block(c,0,leaf);
+            shrink(bl.ex_entry,bl.ex_header.nr);
+            // only once there's room to spare, so a file hovering around nr_inline
+            // extents doesn't move in and out of the leaf on every append and delete
+            if(bl.ex_header.nr < nr_inline - 1) {
+                std::copy(bl.ex_entry,bl.ex_entry + bl.ex_header.nr,inode.e_extent);
+                inode.e_header.nr = bl.ex_header.nr;
+                inode.e_header.depth = 0;
+                free_block_array[nr_fblock++] = leaf;
+            } else {
+                c.ref[0].mark_dirty();
+            }
+        }
+        inode.block--;
+        im->write_inode(inode.inode_number,inode);
+
+        forget_mapping(inode,free_block_array,nr_fblock);
+        for(auto i=0;i<nr_fblock;i++) {
+            bm->free_dblock(free_block_array[i]);
+        }
+        return nr_fblock;
+    }
+
+    /**
+     * @brief unmap the blocks of inode from index n on in one pass, the mapping blocks which only
+     * cover freed blocks go with them, then free everything as runs
+     * the kept mapping blocks are not rewritten, their entries past inode.block are garbage anyway
+     * @return # of blocks freed, the mapping blocks included
+    */
+    uint64_t FileSystem::truncate_dblocks(INode& inode,uint64_t n) {
+        if(n >= inode.block) {
+            return 0;
+        }
+        std::vector<extent> runs;
+        if(is_extent_mapped(inode)) {
+            truncate_extents(inode,n,runs);
+        } else {
+            const uint64_t factor = config::block_size/sizeof(BlockID);
+            std::vector<BlockID> vec;
+            for(uint64_t i=n;i<10 && i<inode.block;i++) {
+                vec.push_back(inode.p_block[i]);
+            }
+            uint64_t base = 10;
+            uint64_t per = 1;
+            for(auto depth=1;depth<=3 && base < inode.block;depth++) {
+                per *= factor;
+                uint64_t cnt = std::min(inode.block - base,per);
+                if(n <= base) {
+                    collect_index(inode.p_block[9 + depth],depth,cnt,vec);
+                } else if(n < base + cnt) {
+                    trim_index(inode.p_block[9 + depth],depth,cnt,n - base,vec);
+                }
+                base += per;
+            }
+            std::sort(vec.begin(),vec.end());
+            Storage::for_each_run(vec,[&](uint64_t begin, uint64_t len){
+                runs.push_back(extent{vec[begin],len});
+            });
+        }
+        inode.block = n;
+        im->write_inode(inode.inode_number,inode);
+
+        // the cursor may pin some of them
+        cursors.erase(inode.inode_number);
+        uint64_t ret = 0;
+        for(auto& e : runs) {
+            bm->free_dblocks(e);
+            ret += e.len;
+        }
+        return ret;
+    }
+
+    /**
+     * @brief id is a mapping block of the given depth covering n data blocks, of which the first
+     * keep stay; append the blocks below it past them to vec
+    */
+    void FileSystem::trim_index(BlockID id,int depth,uint64_t n,uint64_t keep,std::vector<BlockID>& vec) {
+        const uint64_t factor = config::block_size/sizeof(BlockID);
+        uint64_t per = 1;
+        for(auto i=1;i<depth;i++) {
+            per *= factor;
+        }
+        BlockRef bl = bm->get_dblock(id);
+        for(uint64_t i=keep/per,base=i*per;base < n;i++,base += per) {
+            uint64_t cnt = std::min(n - base,per);
+            if(depth == 1) {
+                vec.push_back(bl->bl_entry[i]);
+            } else if(base >= keep) {
+                collect_index(bl->bl_entry[i],depth - 1,cnt,vec);
+            } else {
+                trim_index(bl->bl_entry[i],depth - 1,cnt,keep - base,vec);
+            }
+        }
+    }
+
+    /**
+     * @brief cut the extents of inode at block index n, the runs past it are appended to runs
+     * the leaf block goes as well once the rest fit in the inode
+    */
+    void FileSystem::truncate_extents(INode& inode,uint64_t n,std::vector<extent>& runs) {
+        const uint64_t nr_inline = sizeof(inode.e_extent) / sizeof(file_extent);
+        auto cut = [&](file_extent* ex,uint16_t& nr) {
+            uint16_t kept = 0;
+            for(uint16_t i=0;i<nr;i++) {
+                uint64_t keep = n > ex[i].lblock ? std::min<uint64_t>(n - ex[i].lblock,ex[i].len) : 0;
+                if(keep < ex[i].len) {
+                    runs.push_back(extent{ex[i].pblock + keep,ex[i].len - keep});
+                    ex[i].len = keep;
+                }
+                if(keep > 0) {
+                    kept++;
+                }
+            }
+            nr = kept;
+        };
+
+        if(inode.e_header.depth == 0) {
+            cut(inode.e_extent,inode.e_header.nr);
+            return;
+        }
+        BlockID leaf = inode.e_extent[0].pblock;
+        map_cursor& c = cursor(inode.inode_number);
+        Block& bl = index_block(c,0,leaf);
+        cut(bl.ex_entry,bl.ex_header.nr);
+        // same margin as delete_extent_dblock
+        if(bl.ex_header.nr < nr_inline - 1) {
+            std::copy(bl.ex_entry,bl.ex_entry + bl.ex_header.nr,inode.e_extent);
+            inode.e_header.nr = bl.ex_header.nr;
+            inode.e_header.depth = 0;
+            runs.push_back(extent{leaf,1});
+        } else {
+            c.ref[0].mark_dirty();
+        }
+    }
+
+    /**
+     * @brief rebuild the mapping of inode as a tree over the same data blocks
+     * on failure the mapping blocks taken so far are given back and inode is left as it was
+    */
+    void FileSystem::extents_to_tree(INode& inode) {
+        std::vector<BlockID> dblocks = read_extent_index(inode,0,inode.block);
+        BlockID leaf = inode.e_header.depth == 1 ? inode.e_extent[0].pblock : 0;
+        INode old = inode;
+        inode.flags &= ~INodeFlag::EXTENTS;
+        inode.block = 0;
+        std::memset(inode.p_block,0,sizeof(inode.p_block));
+        try {
+            for(auto b : dblocks) {
+                new_tree_dblock(inode,b);
+            }
+        } catch (const fs_exception& e) {
+            std::vector<BlockID> v;
+            collect_dblocks(inode,v);
+            std::sort(v.begin(),v.end());
+            std::vector<BlockID> mapped(dblocks.begin(),dblocks.begin() + inode.block);
+            std::sort(mapped.begin(),mapped.end());
+            std::vector<BlockID> mblocks;
+            std::set_difference(v.begin(),v.end(),mapped.begin(),mapped.end(),std::back_inserter(mblocks));
+            cursors.erase(inode.inode_number);
+            for(auto b : mblocks) {
+                bm->free_dblock(b);
+            }
+            inode = old;
+            im->write_inode(inode.inode_number,inode);
+            throw;
+        }
+        cursors.erase(inode.inode_number);
+        if(leaf != 0) {
+            bm->free_dblock(leaf);
+        }
+        LOG(INFO) << "@extents_to_tree: " << inode.inode_number << " has too many extents, map it by the tree";
+    }
+
     Directory FileSystem::read_directory(INodeID id) {
         INode inode = im->read_inode(id);
         return std::move(read_directory(inode));
@@ -656,6 +1587,7 @@ namespace solid {
 
     // * truncate should also examine the blocks rather than only the size
     void FileSystem::truncate(INodeID id, uint64_t size) {
+        release_prealloc(id);
         INode inode = im->read_inode(id);
         
         if(size > maximum_file_size)
@@ -676,10 +1608,10 @@ namespace solid {
         uint64_t e_index  = inode.block;
         //uint64_t s_index  = (config::mod_block_size(inode.size) == 0) ? config::idiv_block_size(inode.size) : config::idiv_block_size(inode.size) + 1;
         uint64_t s_index  = (config::mod_block_size(size) == 0) ? config::idiv_block_size(size) : config::idiv_block_size(size) + 1;
-        uint64_t nr_free_blocks = e_index - s_index;
-
-        for(auto i=0;i<nr_free_blocks;i++) {
-            delete_dblock(inode);
+        // the delayed blocks past the new end are simply forgotten
+        drop_delayed(id,s_index);
+        if(e_index > s_index) {
+            truncate_dblocks(inode,s_index);
         }
         inode.size = size;
         im->write_inode(id,inode);
@@ -692,6 +1624,7 @@ namespace solid {
         if(inode.links == 0) {
             truncate(id,0);
             im->free_inode(id);
+            cursors.erase(id);
         } else {
             inode.ctime = time(nullptr);
             im->write_inode(id,inode);
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <deque>
+#include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
+#include <sys/statvfs.h>
 #include "common.h"
 #include "utils/log_utils.h"
 #include "utils/fs_exception.h"
@@ -9,29 +13,126 @@
 #include "block/block_manager.h"
 #include "directory/directory.h"
 #include "block/super_block.h"
+#include "fs/mount_options.h"
+#include "cache/block_cache.h"
 
 namespace solid {
     //TODO(lonhh) when should we update the inode?
     class FileSystem {
-    
+    private:
+        /**
+         * @brief the blocks reserved for the next appends of a file
+         * they are allocated as far as the block manager knows, but not mapped by the file
+        */
+        struct prealloc_window {
+            std::deque<BlockID> blocks;
+            // where the last extending write ended, an append is streaming if it starts there
+            uint64_t end = 0;
+            // # of blocks of the next reservation, doubled by each streaming append
+            uint64_t next = 0;
+        };
+        uint64_t prealloc_blocks;
+        std::unordered_map<INodeID, prealloc_window> windows;
+        // # of blocks in all the windows
+        uint64_t nr_prealloc;
+
+        // n blocks for the append [offset, offset+size) of inode, from its window if it's streaming
+        std::vector<BlockID> allocate_append(INode& inode,uint64_t n,uint64_t offset,uint64_t size);
+
+        // delayed allocation: the blocks of a regular file past its last data block (inode.block)
+        // stay in memory by index until they are flushed, the missing ones are zeros
+        uint64_t delalloc_blocks;
+        std::unordered_map<INodeID, std::map<uint64_t, Block>> delayed;
+        uint64_t nr_delayed;
+
+        bool is_delayed(const INode& inode) const {
+            return delalloc_blocks > 0 && inode.itype == INodeType::REGULAR;
+        }
+        // drop the delayed blocks of id from block index begin on
+        void drop_delayed(INodeID id,uint64_t begin);
+        // the free blocks set aside for the flush of the delayed blocks of each file: the data
+        // blocks past inode.block and the mapping blocks they may need at worst
+        std::unordered_map<INodeID, uint64_t> reserved;
+        uint64_t nr_reserved;
+        // reserve for the delayed blocks of inode up to block index end, ENOSPC if they don't fit
+        void reserve_delayed(const INode& inode,uint64_t end);
+        void unreserve_delayed(INodeID id);
+        // # of mapping blocks of a file of n blocks mapped by the tree
+        static uint64_t nr_index_blocks(uint64_t n);
+
+        // mkfs leaves the free list and the inode table to be initialized on first use
+        bool lazy_init;
+
+        // map the blocks of the files which get their first block with extents
+        bool extents;
+
+        /**
+         * @brief the mapping blocks a file went through lately, one per level of the tree (the
+         * extent leaf block is level 0), pinned so that nearby lookups and updates use them in place
+        */
+        struct map_cursor {
+            BlockRef ref[3];
+            // the last block index looked up or mapped, and its data block; 0 if none
+            uint64_t last_index = 0;
+            BlockID last_block = 0;
+
+            void forget(BlockID b) {
+                for(auto& r : ref) {
+                    if(r && r.get_id() == b) {
+                        r.release();
+                    }
+                }
+            }
+        };
+        // # of files with a cursor at most
+        static const uint64_t max_cursors = 128;
+        std::unordered_map<INodeID, map_cursor> cursors;
+
+        map_cursor& cursor(INodeID id);
+        // the mapping block id at level of the tree, pinned in the cursor; call mark_dirty() on the
+        // ref after changing it. fresh: it was just allocated, start from zeros
+        Block& index_block(map_cursor& c,int level,BlockID id,bool fresh=false);
+        void forget_mapping(INode& inode,const BlockID* freed,uint64_t n);
+        // the last of the data blocks ret, which maps block index, is remembered if inode has a cursor
+        void remember_mapping(INode& inode,uint64_t index,const std::vector<BlockID>& ret);
+
     public:
         INodeManager* im;
         BlockManager* bm;
         Storage* storage;
+        // the top of storage if the block cache is on, otherwise nullptr
+        BlockCache* cache;
         super_block sb;
         uint64_t maximum_file_size;
         bool init;
 
     public:
         // just used for DEBUG
-        FileSystem() {};
-        FileSystem(BlockID nr_blocks,BlockID nr_iblock_blocks,const std::string& path="");
+        FileSystem() : prealloc_blocks(0), nr_prealloc(0), delalloc_blocks(0), nr_delayed(0), nr_reserved(0),
+                       lazy_init(false), extents(false), im(nullptr), bm(nullptr), storage(nullptr), cache(nullptr) {};
+        FileSystem(BlockID nr_blocks,BlockID nr_iblock_blocks,const std::string& path="",const mount_options& opts=mount_options());
+        ~FileSystem();
         void mkfs();
 
+        // hand the buffered writes to the storage
+        void flush();
+        // a durability barrier, everything written before is on the storage when it returns
+        void sync();
+        // the sizes and the free counters, served from memory
+        void statfs(struct statvfs* st);
+
         int read(INodeID id,uint8_t* dst,uint64_t size,uint64_t offset);
         int write(INodeID id,const uint8_t* src,uint64_t size,uint64_t offset);
         void truncate(INodeID id, uint64_t size);
         void unlink(INodeID id);
+        // the file is closed, drop what is kept for it in memory
+        void release(INodeID id);
+        // give the unused preallocated blocks of id back, e.g. when the file is closed
+        void release_prealloc(INodeID id);
+        void release_all_prealloc();
+        // allocate and write the delayed blocks of id, in one batch sized to the file
+        void flush_delayed(INodeID id);
+        void flush_all_delayed();
 
         INodeID path2iid(const std::string& path);
         Directory read_directory(INodeID id);
@@ -42,10 +143,27 @@ namespace solid {
     //private:
         // allocate a new datablock for inode, but shall we see the index of datablocks? yes we can
         // most of the time we should write the file immediately after allocating a new block for it
-        BlockID new_dblock(INode& inode);
+        // dblock: a data block allocated by the caller, 0 to allocate one here
+        BlockID new_dblock(INode& inode,BlockID dblock=0);
 
         // we don't modify the file size
         int delete_dblock(INode& inode);
+        // unmap and free the blocks from index n on at once, neither the size
+        uint64_t truncate_dblocks(INode& inode,uint64_t n);
+
+        // the mapping of inode by the direct/indirect tree, or by extents
+        BlockID new_tree_dblock(INode& inode,BlockID dblock);
+        BlockID new_extent_dblock(INode& inode,BlockID dblock);
+        int delete_extent_dblock(INode& inode);
+        void truncate_extents(INode& inode,uint64_t n,std::vector<extent>& runs);
+        std::vector<BlockID> read_extent_index(INode& inode,uint64_t begin,uint64_t end);
+        // the extents of inode and their #, from the inode or its leaf block
+        std::pair<const file_extent*,uint64_t> load_extents(const INode& inode);
+        // remap a file with more extents than a leaf block holds by the tree
+        void extents_to_tree(INode& inode);
+        static bool is_extent_mapped(const INode& inode) {
+            return (inode.flags & INodeFlag::EXTENTS) != 0;
+        }
         // notice we only allocate a new inode, but we need to write it/init it
         INodeID new_inode(const std::string& file_name,INode& inode);
 
@@ -55,6 +173,15 @@ namespace solid {
         std::vector<BlockID> read_dblock_index(INode& inode,uint64_t begin,uint64_t end);
         uint64_t block_lookup_per_region(INode& inode,uint64_t begin,uint64_t end,std::vector<BlockID>& vec,int depth);
 
+        // the allocation goal for the next block of inode
+        BlockID goal_dblock(INode& inode);
+
+        // rebuild the block allocator after an unclean shutdown
+        void rebuild_allocator();
+        void collect_dblocks(INode& inode,std::vector<BlockID>& vec);
+        void collect_index(BlockID id,int depth,uint64_t n,std::vector<BlockID>& vec);
+        void trim_index(BlockID id,int depth,uint64_t n,uint64_t keep,std::vector<BlockID>& vec);
+
         std::string simplifyPath(std::string path);
         std::string directory_name(std::string path);
         std::string file_name(std::string path);
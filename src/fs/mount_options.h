@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include "common.h"
+
+namespace solid {
+    /**
+     * @brief options picked at mount time, they are not persisted in the super block
+    */
+    struct mount_options {
+        // storage backend for a non-empty path: "fstream", "pread", "direct", "uring" or "mmap"
+        std::string backend = "pread";
+        // huge pages for the in-memory storage (empty path): "none", "thp" or "explicit"
+        std::string huge_page = "none";
+        // buffer the writes and commit them in groups, durable only after sync()
+        bool writeback = false;
+        // write-back: the longest time a dirty block waits for its commit
+        uint64_t commit_interval_ms = 5000;
+        // write-back: # of dirty blocks which triggers a commit before the interval elapses
+        uint64_t dirty_threshold = 1024;
+        // data block allocator of a new file system: "freelist" or "bitmap", an existing one keeps its own
+        std::string allocator = "freelist";
+        // freelist: # of free blocks each thread takes from the global list at a time, 0 to disable
+        uint64_t alloc_batch = 0;
+        // delayed allocation: # of blocks of regular files held in memory before they get data blocks
+        // (at the latest on flush() or sync()), 0 to allocate them at write time
+        uint64_t delalloc_blocks = 0;
+        // the largest window of blocks reserved ahead of a streaming append, 0 to disable
+        uint64_t prealloc_blocks = 0;
+        // hand the freed data blocks to the storage (punch holes, trim the device) from a background thread
+        bool discard = false;
+        // discard: # of blocks discarded per second at most, 0 for no limit
+        uint64_t discard_rate = 0;
+        // mkfs: skip writing the free list groups and the inode table, they are initialized on first use
+        bool lazy_init = false;
+        // map the blocks of new files by extents instead of the direct/indirect tree
+        bool extents = false;
+        // # of blocks in the block cache, 0 to disable; ignored by the in-memory storage
+        uint64_t cache_blocks = 0;
+    };
+};
@@ -7,6 +7,25 @@ namespace solid {
   enum INodeType {
     FREE,DIRECTORY,REGULAR,SYMLINK
   };
+  enum INodeFlag : uint32_t {
+    // the blocks are mapped by extents instead of the direct/indirect tree
+    EXTENTS = 1
+  };
+  // a run of len blocks of a file from block index lblock on, stored in [pblock, pblock+len)
+  struct file_extent {
+    uint32_t lblock;
+    uint32_t len;
+    BlockID pblock;
+  };
+  // the head of an array of extents, in the inode or in a leaf block
+  struct extent_header {
+    static const uint16_t extent_magic = 0xf30a;
+    uint16_t magic;
+    uint16_t nr;                                        // # of entries in use
+    uint16_t depth;                                     // 0: the entries are extents
+                                                        // 1: the only entry points to a leaf block
+    uint16_t reserved;
+  };
   struct INode{
     union {
       uint8_t data[config::inode_size];
@@ -21,8 +40,15 @@ namespace solid {
         time_t atime;                                 // last access time
         time_t ctime;                                 // last change time (inode)
         time_t mtime;                                 // last modify time (file content)
-        BlockID p_block[config::data_ptr_cnt];          // ptr to data blocks
+        union {
+          BlockID p_block[config::data_ptr_cnt];        // ptr to data blocks
+          struct {
+            extent_header e_header;                     // or the extents, if flags has EXTENTS
+            file_extent e_extent[(config::data_ptr_cnt * sizeof(BlockID) - sizeof(extent_header)) / sizeof(file_extent)];
+          };
+        };
         enum INodeType itype;
+        uint32_t flags;                                 // INodeFlag
       };
     };
     //TODO(lonhh): whether mode_t matches uint16_t?
@@ -31,6 +57,7 @@ namespace solid {
       INode inode;
       inode.inode_number = inode_number;
       inode.itype = itype;
+      inode.flags = 0;
       inode.block = 0;
       inode.size = 0;
       inode.links = 1;
@@ -47,6 +74,7 @@ namespace solid {
       fuse_context* context = fuse_get_context(); 
       inode.inode_number = inode_number;
       inode.itype = itype;
+      inode.flags = 0;
       inode.block = 0;
       inode.size = 0;
       inode.links = 1;
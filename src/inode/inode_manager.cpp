@@ -5,6 +5,7 @@
 #include "utils/log_utils.h"
 #include "block/block.h"
 #include "utils/fs_exception.h"
+#include <algorithm>
 
 namespace solid {
     inline INodeID conv_iID_bID(INodeID id, INodeID s_iblock) {
@@ -17,72 +18,418 @@ namespace solid {
         return (id % nr_iblock_block);
     }
 
-    void INodeManager:: mkfs() {
-        Block bl;
-        storage->read_block(s_iblock,bl.data);
+    INodeHandle& INodeHandle::operator=(INodeHandle&& h) {
+        if(this != &h) {
+            release();
+            im = h.im;
+            id = h.id;
+            p = h.p;
+            h.im = nullptr;
+            h.p = nullptr;
+        }
+        return *this;
+    }
 
-        for(auto j=0;j<nr_inode_per_block;j++) {
-            bl.inode[j].itype = INodeType::FREE;
+    void INodeHandle::mark_dirty() {
+        im->mark_dirty(id);
+    }
+
+    void INodeHandle::release() {
+        if(im != nullptr) {
+            im->unpin(id);
+            im = nullptr;
+            p = nullptr;
         }
-        storage->write_block(s_iblock,bl.data);
+    }
 
+    /**
+     * @brief mark all the inodes FREE and clear the bitmap
+     * @param lazy: leave the table as it is, it's initialized on first write
+    */
+    void INodeManager:: mkfs(bool lazy) {
+        std::lock_guard<std::mutex> lk(mutex);
+        // the table is about to be wiped
+        cache.clear();
+        lru.clear();
 
-        for(auto i=s_iblock+1;i<s_iblock+nr_iblock;i++) {
-            storage->read_block(i,bl.data);
-            for(auto j=0;j<nr_inode_per_block;j++) {
-                bl.inode[j].itype = INodeType::FREE;
+        sb->s_lazy_iblock = 0;
+        if(lazy) {
+            sb->s_lazy_iblock = nr_inodes > 0 ? s_iblock : 0;
+        } else {
+            Block bl;
+            for(auto i=s_iblock;i<s_iblock+nr_iblock-nr_ibitmap;i++) {
+                storage->read_block(i,bl.data);
+                for(auto j=0;j<nr_inode_per_block;j++) {
+                    bl.inode[j].itype = INodeType::FREE;
+                }
+                storage->write_block(i,bl.data);
             }
-            storage->write_block(i,bl.data);
         }
+
+        // all free, except the bits past the last inode
+        std::fill(bitmap.begin(),bitmap.end(),0);
+        for(auto i=nr_inodes;i<bitmap.size()*64;i++) {
+            bitmap[i/64] |= 1ULL << (i%64);
+        }
+        hint = 0;
+        sb->nr_free_inode = nr_inodes;
+        for(BlockID i=0;i<nr_ibitmap;i++) {
+            dirty_bitmap.insert(i);
+        }
+        sb_dirty = true;
+        write_back_bitmap();
     }
 
-    INodeManager::INodeManager(Storage* p_storage,const super_block* p_sb) {
+    BlockID INodeManager::bitmap_blocks(BlockID nr_iblock) {
+        // b blocks cover the (nr_iblock - b) * nr_inode_per_block inodes left
+        BlockID b = (nr_iblock * nr_inode_per_block + nr_inode_per_bitmap_block + nr_inode_per_block - 1)
+                    / (nr_inode_per_bitmap_block + nr_inode_per_block);
+        return b < nr_iblock ? b : 0;
+    }
+
+    INodeManager::INodeManager(Storage* p_storage,super_block* p_sb,bool writeback,uint64_t nr_cached)
+        : hint(0), sb_dirty(false), writeback(writeback), nr_cached(nr_cached) {
         this->storage = p_storage;
         if(p_sb == nullptr) {
-            super_block sb;
-            storage->read_block(0,sb.data);
-            this->s_iblock = sb.s_iblock;
-            this->nr_iblock = sb.nr_iblock;
+            storage->read_block(0,own_sb.data);
+            p_sb = &own_sb;
+        }
+        this->sb = p_sb;
+        this->s_iblock = sb->s_iblock;
+        this->nr_iblock = sb->nr_iblock;
+        if(sb->nr_ibitmap > 0 && sb->nr_ibitmap < nr_iblock
+           && sb->s_ibitmap == s_iblock + nr_iblock - sb->nr_ibitmap) {
+            this->s_ibitmap = sb->s_ibitmap;
+            this->nr_ibitmap = sb->nr_ibitmap;
+        } else {
+            // an old layout, keep the bitmap in memory only
+            this->s_ibitmap = 0;
+            this->nr_ibitmap = 0;
+        }
+        nr_inodes = (nr_iblock - nr_ibitmap) * nr_inode_per_block;
+        load_bitmap();
+    }
+
+    /**
+     * @brief read the bitmap, or build it from the inode table if it's not persisted
+     * the free-inode count in the super block is recomputed from it
+    */
+    void INodeManager::load_bitmap() {
+        const uint64_t nr_words_per_block = config::block_size / sizeof(uint64_t);
+        BlockID nr_blocks = nr_ibitmap > 0 ? nr_ibitmap
+                            : (nr_inodes + nr_inode_per_bitmap_block - 1) / nr_inode_per_bitmap_block;
+        bitmap.assign(nr_blocks * nr_words_per_block, 0);
+
+        if(nr_ibitmap > 0) {
+            std::vector<BlockID> ids;
+            std::vector<uint8_t*> dsts;
+            for(BlockID i=0;i<nr_ibitmap;i++) {
+                ids.push_back(s_ibitmap + i);
+                dsts.push_back((uint8_t*)(bitmap.data() + i * nr_words_per_block));
+            }
+            storage->read_blocks(ids,dsts);
+        } else {
+            // scan the table in batches, so that adjacent blocks are read together
+            const BlockID batch = 256;
+            std::vector<Block> bls(std::min<BlockID>(batch,nr_iblock));
+            for(BlockID i=0;i<nr_iblock;i+=batch) {
+                std::vector<BlockID> ids;
+                std::vector<uint8_t*> dsts;
+                for(BlockID k=i;k<std::min(i+batch,nr_iblock);k++) {
+                    ids.push_back(s_iblock + k);
+                    dsts.push_back(bls[k-i].data);
+                }
+                storage->read_blocks(ids,dsts);
+                for(BlockID k=0;k<ids.size();k++) {
+                    if(is_lazy(ids[k])) {
+                        break;
+                    }
+                    for(auto j=0;j<nr_inode_per_block;j++) {
+                        INodeID id = (i + k) * nr_inode_per_block + j;
+                        if(bls[k].inode[j].itype != INodeType::FREE)
+                            bitmap[id/64] |= 1ULL << (id%64);
+                    }
+                }
+            }
+        }
+        for(auto i=nr_inodes;i<bitmap.size()*64;i++) {
+            bitmap[i/64] |= 1ULL << (i%64);
+        }
+
+        uint64_t nr_used = 0;
+        for(auto w : bitmap) {
+            nr_used += __builtin_popcountll(w);
+        }
+        sb->nr_free_inode = nr_inodes - (nr_used - (bitmap.size() * 64 - nr_inodes));
+        hint = 0;
+        while(hint < bitmap.size() && bitmap[hint] == ~0ULL) {
+            hint++;
+        }
+    }
+
+    /**
+     * @brief keep the bit of inode id and the free-inode count in line with its type
+    */
+    void INodeManager::set_used(INodeID id, bool used) {
+        uint64_t& w = bitmap[id/64];
+        uint64_t bit = 1ULL << (id%64);
+        if(((w & bit) != 0) == used) {
+            return;
+        }
+        if(used) {
+            w |= bit;
+            sb->nr_free_inode--;
+            while(hint < bitmap.size() && bitmap[hint] == ~0ULL) {
+                hint++;
+            }
+        } else {
+            w &= ~bit;
+            sb->nr_free_inode++;
+            hint = std::min<uint64_t>(hint,id/64);
+        }
+        if(nr_ibitmap > 0) {
+            dirty_bitmap.insert(id / nr_inode_per_bitmap_block);
+        }
+        sb_dirty = true;
+    }
+
+    /**
+     * @brief write the dirty bitmap blocks and the super block
+    */
+    void INodeManager::write_back_bitmap() {
+        if(!dirty_bitmap.empty()) {
+            const uint64_t nr_words_per_block = config::block_size / sizeof(uint64_t);
+            std::vector<BlockID> ids;
+            std::vector<const uint8_t*> srcs;
+            for(auto i : dirty_bitmap) {
+                ids.push_back(s_ibitmap + i);
+                srcs.push_back((const uint8_t*)(bitmap.data() + i * nr_words_per_block));
+            }
+            storage->write_blocks(ids,srcs);
+            dirty_bitmap.clear();
+        }
+        if(sb_dirty) {
+            storage->write_block(0,sb->data);
+            sb_dirty = false;
+        }
+    }
+
+    INodeManager::~INodeManager() {
+        try {
+            flush();
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "@~INodeManager: fail to write back the inodes " << e.what();
+        }
+    }
+
+    /**
+     * @brief the cached inode id, on a miss all the inodes of its table block are loaded
+    */
+    INodeManager::CachedINode& INodeManager::get(INodeID id) {
+        auto p = cache.find(id);
+        if(p != cache.end()) {
+            lru.splice(lru.begin(), lru, p->second.lru);
+            return p->second;
+        }
+        evict(nr_inode_per_block);
+
+        BlockID bid = conv_iID_bID(id,s_iblock);
+        Block bl;
+        const Block* b = nullptr;
+        if(is_lazy(bid)) {
+            // never written, i.e. all FREE
+            memset(bl.data,0,config::block_size);
+            b = &bl;
         } else {
-            this->s_iblock = p_sb->s_iblock;
-            this->nr_iblock = p_sb->nr_iblock;
+            b = (const Block*)storage->block_ptr(bid);
+        }
+        if(b == nullptr) {
+            storage->read_block(bid,bl.data);
+            b = &bl;
+        }
+        INodeID base = id - conv_iID_offset(id);
+        for(auto j=0;j<nr_inode_per_block;j++) {
+            // the cached ones may be dirty
+            if(cache.count(base + j)) {
+                continue;
+            }
+            CachedINode& c = cache[base + j];
+            memcpy(c.inode.data,&b->inode[j],sizeof(INode));
+            c.dirty = false;
+            c.refs = 0;
+            lru.push_front(base + j);
+            c.lru = lru.begin();
+        }
+        CachedINode& c = cache[id];
+        lru.splice(lru.begin(), lru, c.lru);
+        return c;
+    }
+
+    /**
+     * @brief drop the least recently used unpinned inodes until there is room for more
+     * dirty ones are written back together with the rest of their table block
+    */
+    void INodeManager::evict(uint64_t room) {
+        auto p = lru.end();
+        while(cache.size() + room > nr_cached && p != lru.begin()) {
+            --p;
+            CachedINode& c = cache[*p];
+            if(c.refs > 0) {
+                continue;
+            }
+            if(c.dirty) {
+                write_back_blocks({conv_iID_bID(*p,s_iblock)});
+            }
+            cache.erase(*p);
+            p = lru.erase(p);
+        }
+    }
+
+    /**
+     * @brief the inode has been modified, write it through unless it's write-back mode
+    */
+    void INodeManager::modified(INodeID id, CachedINode& c) {
+        c.dirty = true;
+        set_used(id,c.inode.itype != INodeType::FREE);
+        if(!writeback) {
+            write_back_blocks({conv_iID_bID(id,s_iblock)});
+            write_back_bitmap();
+        }
+    }
+
+    /**
+     * @brief write the table blocks bids (sorted) from the cache and clear their dirty flags
+     * a block is only read if some of its inodes are not cached (and it has been written before)
+    */
+    void INodeManager::write_back_blocks(const std::vector<BlockID>& bids) {
+        std::vector<Block> bls(bids.size());
+        std::vector<BlockID> partial_ids;
+        std::vector<uint8_t*> partial_dsts;
+        for(auto i=0;i<bids.size();i++) {
+            INodeID base = (bids[i] - s_iblock) * nr_inode_per_block;
+            if(is_lazy(bids[i])) {
+                memset(bls[i].data,0,config::block_size);
+                continue;
+            }
+            for(auto j=0;j<nr_inode_per_block;j++) {
+                if(!cache.count(base + j)) {
+                    partial_ids.push_back(bids[i]);
+                    partial_dsts.push_back(bls[i].data);
+                    break;
+                }
+            }
+        }
+        storage->read_blocks(partial_ids,partial_dsts);
+
+        std::vector<const uint8_t*> srcs(bids.size());
+        for(auto i=0;i<bids.size();i++) {
+            INodeID base = (bids[i] - s_iblock) * nr_inode_per_block;
+            for(auto j=0;j<nr_inode_per_block;j++) {
+                auto p = cache.find(base + j);
+                if(p != cache.end()) {
+                    memcpy(&bls[i].inode[j],p->second.inode.data,sizeof(INode));
+                }
+            }
+            srcs[i] = bls[i].data;
+        }
+        storage->write_blocks(bids,srcs);
+        if(!bids.empty() && is_lazy(bids.back())) {
+            // the unwritten blocks below the last one become FREE on the storage as well
+            Block zero;
+            memset(zero.data,0,config::block_size);
+            std::vector<BlockID> gap;
+            for(BlockID bid=sb->s_lazy_iblock;bid<bids.back();bid++) {
+                if(!std::binary_search(bids.begin(),bids.end(),bid)) {
+                    gap.push_back(bid);
+                }
+            }
+            storage->write_blocks(gap,std::vector<const uint8_t*>(gap.size(),zero.data));
+            sb->s_lazy_iblock = bids.back() + 1 < s_iblock + nr_iblock - nr_ibitmap ? bids.back() + 1 : 0;
+            // right away, the blocks past the old boundary would read as FREE otherwise
+            storage->write_block(0,sb->data);
+        }
+
+        for(auto bid : bids) {
+            INodeID base = (bid - s_iblock) * nr_inode_per_block;
+            for(auto j=0;j<nr_inode_per_block;j++) {
+                auto p = cache.find(base + j);
+                if(p != cache.end()) {
+                    p->second.dirty = false;
+                }
+            }
         }
     }
 
+    void INodeManager::flush() {
+        std::lock_guard<std::mutex> lk(mutex);
+        std::vector<BlockID> bids;
+        for(auto& p : cache) {
+            if(p.second.dirty) {
+                bids.push_back(conv_iID_bID(p.first,s_iblock));
+            }
+        }
+        if(!bids.empty()) {
+            std::sort(bids.begin(),bids.end());
+            bids.erase(std::unique(bids.begin(),bids.end()),bids.end());
+            write_back_blocks(bids);
+        }
+        write_back_bitmap();
+    }
+
     INode INodeManager::read_inode(INodeID id) {
         LOG(INFO) << "@read_inode " << id;
-        if(id >= nr_iblock * nr_inode_per_block){
+        if(id >= nr_inodes){
             throw fs_error("read_inode ",id, " out of range");
         }
-        Block bl;
-        storage->read_block(conv_iID_bID(id,s_iblock),bl.data);
-        INode inode;
-        memcpy(inode.data,&bl.inode[conv_iID_offset(id)],sizeof(INode));
-        return inode;
+        std::lock_guard<std::mutex> lk(mutex);
+        return get(id).inode;
     }
 
     void INodeManager::write_inode(INodeID id, const INode& src) {
         LOG(INFO) << "@write_inode " << id;
-        if(id >= nr_iblock * nr_inode_per_block){
+        if(id >= nr_inodes){
             throw fs_error("write_inode ",id, " out of range");
         }
-        Block bl;
-        storage->read_block(conv_iID_bID(id,s_iblock),bl.data);
-        memcpy(&bl.inode[conv_iID_offset(id)],src.data,sizeof(INode));
-        storage->write_block(conv_iID_bID(id,s_iblock),bl.data);
+        std::lock_guard<std::mutex> lk(mutex);
+        CachedINode& c = get(id);
+        memcpy(c.inode.data,src.data,sizeof(INode));
+        modified(id,c);
     }
 
+    INodeHandle INodeManager::get_inode(INodeID id) {
+        if(id >= nr_inodes){
+            throw fs_error("get_inode ",id, " out of range");
+        }
+        std::lock_guard<std::mutex> lk(mutex);
+        CachedINode& c = get(id);
+        c.refs++;
+        return INodeHandle(this,id,&c.inode);
+    }
+
+    void INodeManager::mark_dirty(INodeID id) {
+        std::lock_guard<std::mutex> lk(mutex);
+        modified(id,cache.at(id));
+    }
+
+    void INodeManager::unpin(INodeID id) {
+        std::lock_guard<std::mutex> lk(mutex);
+        cache.at(id).refs--;
+    }
+
+    /**
+     * @brief the lowest free inode; it's not taken until it's written with a type other than FREE
+    */
     INodeID INodeManager::allocate_inode() {
         LOG(INFO) << "@allocate_inode";
-        Block bl;
-        for(BlockID i=s_iblock;i < s_iblock + nr_iblock; i++) {
-            storage->read_block(i,bl.data);
-            for(auto j=0;j<nr_inode_per_block;j++) {
-                if(bl.inode[j].itype==INodeType::FREE) {
-                    return (i - s_iblock) * nr_inode_per_block+ j;
-                }
+        std::lock_guard<std::mutex> lk(mutex);
+        // the bits past the last inode are set, so any zero bit is a valid inode
+        for(uint64_t w=hint;w<bitmap.size();w++) {
+            if(bitmap[w] != ~0ULL) {
+                hint = w;
+                return w * 64 + __builtin_ctzll(~bitmap[w]);
             }
         }
+        hint = bitmap.size();
         throw fs_exception(
             std::errc::no_space_on_device,
             "@allocate_inode: no free inode");
@@ -90,14 +437,18 @@ namespace solid {
 
     void INodeManager::free_inode(INodeID id) {
         LOG(INFO) << "@free_inode " << id;
-        Block bl;
-        storage->read_block(conv_iID_bID(id,s_iblock),bl.data);
-        if(bl.inode[conv_iID_offset(id)].itype != INodeType::FREE) {
-            bl.inode[conv_iID_offset(id)].itype = INodeType::FREE;
-            storage->write_block(conv_iID_bID(id,s_iblock),bl.data);
+        if(id >= nr_inodes) {
+            LOG(WARNING) << "@free_inode " << id << " out of range";
+            return;
+        }
+        std::lock_guard<std::mutex> lk(mutex);
+        CachedINode& c = get(id);
+        if(c.inode.itype != INodeType::FREE) {
+            c.inode.itype = INodeType::FREE;
+            modified(id,c);
             return;
         }
         // TODO(lonhh): this might be an error or not
         // throw fs_error("@free_inode: double free inode ",id);
     }
-};
\ No newline at end of file
+};
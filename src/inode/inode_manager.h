@@ -1,25 +1,132 @@
 #pragma once
 
+#include <list>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
 #include "common.h"
 #include "inode/inode.h"
 #include "storage/storage.h"
 #include "block/super_block.h"
 
 namespace solid {
+    class INodeManager;
+
+    /**
+     * @brief a reference to a cached inode, which stays in the cache (pinned) until released
+     * call mark_dirty() after modifying it, so that it's written back (or through)
+    */
+    class INodeHandle {
+    private:
+        INodeManager* im;
+        INodeID id;
+        INode* p;
+
+    public:
+        INodeHandle() : im(nullptr), id(0), p(nullptr) {};
+        INodeHandle(INodeManager* im, INodeID id, INode* p) : im(im), id(id), p(p) {};
+        INodeHandle(const INodeHandle&) = delete;
+        INodeHandle& operator=(const INodeHandle&) = delete;
+        INodeHandle(INodeHandle&& h) : im(h.im), id(h.id), p(h.p) { h.im = nullptr; h.p = nullptr; };
+        INodeHandle& operator=(INodeHandle&& h);
+        ~INodeHandle() { release(); };
+
+        INode& operator*() const { return *p; };
+        INode* operator->() const { return p; };
+        INodeID get_id() const { return id; };
+
+        void mark_dirty();
+        void release();
+    };
+
+    /**
+     * @brief the inode table with an in-memory inode cache and a free-inode bitmap
+     * a miss loads all the inodes of the table block; in write-back mode modified inodes are
+     * kept dirty until flush() or eviction, and written back one table block at a time
+     * the bitmap (a bit per inode, set if it's not FREE) is loaded at mount and searched a word
+     * at a time from the lowest word which may have a free inode
+     * a lazy mkfs leaves the table blocks from sb->s_lazy_iblock on unwritten, they read as all FREE
+     * and are initialized (with the ones below them) when they are first written
+     * @param p_sb: the super block shared with the other managers, nullptr to read our own copy
+     * @param writeback: keep the modified inodes in memory until flush(), otherwise write through
+     * @param nr_cached: # of inodes cached, pinned ones may exceed it
+    */
     class INodeManager {
     private:
+        struct CachedINode {
+            INode inode;
+            bool dirty;
+            // # of handles
+            uint32_t refs;
+            std::list<INodeID>::iterator lru;
+        };
+
         BlockID s_iblock;
         BlockID nr_iblock;
         Storage* storage;
+        super_block own_sb;
+        super_block* sb;
+
+        // # of inodes, the bitmap blocks are not part of the table
+        uint64_t nr_inodes;
+        // 0 if the bitmap is not persisted
+        BlockID s_ibitmap;
+        BlockID nr_ibitmap;
+        // covers whole bitmap blocks, the bits past nr_inodes are set
+        std::vector<uint64_t> bitmap;
+        // all the words before it are full
+        uint64_t hint;
+        // the bitmap blocks (relative to s_ibitmap) and the super block to write back
+        std::set<BlockID> dirty_bitmap;
+        bool sb_dirty;
+
+        const bool writeback;
+        const uint64_t nr_cached;
+        // protect cache and lru
+        std::mutex mutex;
+        std::unordered_map<INodeID, CachedINode> cache;
+        // most recently used first
+        std::list<INodeID> lru;
+
+        // the helpers below expect the caller to hold mutex
+        CachedINode& get(INodeID id);
+        void evict(uint64_t room);
+        void modified(INodeID id, CachedINode& c);
+        void write_back_blocks(const std::vector<BlockID>& bids);
+        void load_bitmap();
+        // the table block bid has never been written
+        bool is_lazy(BlockID bid) const {
+            return sb->s_lazy_iblock != 0 && bid >= sb->s_lazy_iblock;
+        }
+        void set_used(INodeID id, bool used);
+        void write_back_bitmap();
+
+        friend class INodeHandle;
+        void mark_dirty(INodeID id);
+        void unpin(INodeID id);
 
     public:
         const static uint64_t nr_inode_per_block = config::block_size/sizeof(INode);
+        const static uint64_t nr_inode_per_bitmap_block = config::block_size * 8;
+
+        // # of bitmap blocks to carve out of an inode table of nr_iblock blocks, 0 if it's too small
+        static BlockID bitmap_blocks(BlockID nr_iblock);
 
-        INodeManager(Storage* storage,const super_block* p_sb=nullptr);
-        virtual void mkfs();
+        INodeManager(Storage* storage,super_block* p_sb=nullptr,bool writeback=false,uint64_t nr_cached=4096);
+        virtual ~INodeManager();
+        virtual void mkfs(bool lazy=false);
         virtual INode read_inode(INodeID id);
         virtual void write_inode(INodeID id, const INode& src);
         virtual INodeID allocate_inode();
         virtual void free_inode(INodeID id);
+
+        // pin inode id in the cache and hand out a reference to it
+        virtual INodeHandle get_inode(INodeID id);
+        // write all the dirty inodes back to the storage, one write per table block
+        virtual void flush();
+
+        uint64_t get_nr_inodes() const { return nr_inodes; };
+        uint64_t get_nr_free_inodes() const { return sb->nr_free_inode; };
     };
-};
\ No newline at end of file
+};
@@ -0,0 +1,227 @@
+#include "storage/discard_storage.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+namespace solid {
+    bool discard_range(int fd, BlockID id, uint64_t n) {
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            throw fs_error("@discard_range: fstat failed ",std::strerror(errno));
+        }
+        uint64_t offset = id * config::block_size;
+        uint64_t len = n * config::block_size;
+        int ret;
+        if(S_ISBLK(st.st_mode)) {
+            uint64_t range[2] = {offset, len};
+            ret = ioctl(fd, BLKDISCARD, range);
+        } else {
+            ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+        }
+        if(ret == 0) {
+            return true;
+        }
+        if(errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS) {
+            return false;
+        }
+        throw fs_error("@discard_range: ",id," ",n," failed: ",std::strerror(errno));
+    }
+
+    DiscardStorage::DiscardStorage(Storage* inner, uint64_t rate, uint64_t interval_ms)
+        : inner(inner), rate(rate), interval(interval_ms), nr_pending(0),
+          busy_start(0), busy_len(0), stop(false) {
+        discarder = std::thread([this](){ run(); });
+    }
+
+    DiscardStorage::~DiscardStorage() {
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            stop = true;
+            cv_queue.notify_all();
+        }
+        discarder.join();
+        // nothing competes with us any more, so the rest goes without the rate limit
+        for(auto& p : pending) {
+            try {
+                inner->discard(p.first, p.second);
+            } catch (const std::exception& e) {
+                LOG(ERROR) << "@~DiscardStorage: fail to discard " << e.what();
+            }
+        }
+        delete inner;
+    }
+
+    /**
+     * @brief the discard thread, drain the queue once per interval, the lowest range first
+     * with a rate limit a range is cut to a tenth of a second worth of blocks at a time
+    */
+    void DiscardStorage::run() {
+        std::unique_lock<std::mutex> lk(mutex);
+        auto next = std::chrono::steady_clock::now();
+        while(!stop) {
+            cv_queue.wait_for(lk, interval, [this](){ return stop; });
+            while(!stop && !pending.empty()) {
+                auto now = std::chrono::steady_clock::now();
+                if(rate > 0 && next > now) {
+                    cv_queue.wait_until(lk, next, [this](){ return stop; });
+                    continue;
+                }
+                BlockID start = pending.begin()->first;
+                uint64_t n = pending.begin()->second;
+                if(rate > 0) {
+                    n = std::min<uint64_t>(n, std::max<uint64_t>(rate / 10, 1));
+                }
+                take(start, n);
+                busy_start = start;
+                busy_len = n;
+                lk.unlock();
+                try {
+                    inner->discard(start, n);
+                } catch (const std::exception& e) {
+                    LOG(ERROR) << "@DiscardStorage: discard failed " << e.what();
+                }
+                lk.lock();
+                busy_len = 0;
+                cv_done.notify_all();
+                if(rate > 0) {
+                    next = std::max(next, now) + std::chrono::microseconds(n * 1000000 / rate);
+                }
+            }
+        }
+    }
+
+    // the caller should hold mutex, start is the first block of a pending range
+    void DiscardStorage::take(BlockID start, uint64_t n) {
+        auto p = pending.find(start);
+        uint64_t len = p->second;
+        pending.erase(p);
+        if(len > n) {
+            pending[start + n] = len - n;
+        }
+        nr_pending -= n;
+    }
+
+    /**
+     * @brief Block id is about to be written, don't discard it
+     * the caller should hold mutex through lk, it's released while waiting for a busy range
+    */
+    void DiscardStorage::cancel(BlockID id, std::unique_lock<std::mutex>& lk) {
+        while(busy_len > 0 && id >= busy_start && id < busy_start + busy_len) {
+            cv_done.wait(lk);
+        }
+        auto p = pending.upper_bound(id);
+        if(p == pending.begin()) {
+            return;
+        }
+        --p;
+        BlockID start = p->first;
+        uint64_t len = p->second;
+        if(id >= start + len) {
+            return;
+        }
+        pending.erase(p);
+        if(id > start) {
+            pending[start] = id - start;
+        }
+        if(id + 1 < start + len) {
+            pending[id + 1] = start + len - id - 1;
+        }
+        nr_pending--;
+    }
+
+    void DiscardStorage::cancel(const std::vector<BlockID>& ids) {
+        std::unique_lock<std::mutex> lk(mutex);
+        if(pending.empty() && busy_len == 0) {
+            return;
+        }
+        for(auto id : ids) {
+            cancel(id, lk);
+        }
+    }
+
+    void DiscardStorage::read_block(BlockID id, uint8_t* dst) {
+        inner->read_block(id, dst);
+    }
+
+    void DiscardStorage::write_block(BlockID id, const uint8_t* src) {
+        cancel({id});
+        inner->write_block(id, src);
+    }
+
+    std::future<void> DiscardStorage::read_block_async(BlockID id, uint8_t* dst) {
+        return inner->read_block_async(id, dst);
+    }
+
+    std::future<void> DiscardStorage::write_block_async(BlockID id, const uint8_t* src) {
+        cancel({id});
+        return inner->write_block_async(id, src);
+    }
+
+    void DiscardStorage::submit() {
+        inner->submit();
+    }
+
+    void DiscardStorage::read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        inner->read_blocks(ids, dsts);
+    }
+
+    void DiscardStorage::write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        cancel(ids);
+        inner->write_blocks(ids, srcs);
+    }
+
+    const uint8_t* DiscardStorage::block_ptr(BlockID id) {
+        return inner->block_ptr(id);
+    }
+
+    /**
+     * @brief queue [id, id+n), merged with the pending ranges it overlaps or touches
+    */
+    void DiscardStorage::discard(BlockID id, uint64_t n) {
+        if(n == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(mutex);
+        BlockID start = id;
+        BlockID end = id + n;
+        auto p = pending.upper_bound(id);
+        if(p != pending.begin()) {
+            auto q = std::prev(p);
+            if(q->first + q->second >= id) {
+                start = q->first;
+                end = std::max(end, q->first + q->second);
+                nr_pending -= q->second;
+                pending.erase(q);
+            }
+        }
+        while(p != pending.end() && p->first <= end) {
+            end = std::max(end, p->first + p->second);
+            nr_pending -= p->second;
+            p = pending.erase(p);
+        }
+        pending[start] = end - start;
+        nr_pending += end - start;
+    }
+
+    /**
+     * @brief the queued discards are hints, neither flush() nor sync() waits for them
+    */
+    void DiscardStorage::flush() {
+        inner->flush();
+    }
+
+    void DiscardStorage::sync() {
+        inner->sync();
+    }
+
+    uint64_t DiscardStorage::nr_queued() {
+        std::lock_guard<std::mutex> lk(mutex);
+        return nr_pending;
+    }
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "storage/storage.h"
+#include "common.h"
+
+namespace solid {
+    /**
+     * @brief drop the content of the blocks [id, id+n) of an open file or block device:
+     * BLKDISCARD on a block device, otherwise punch a hole in the file (its size is kept)
+     * @return false if the device or the file system can't do it, throw exception on other errors
+    */
+    bool discard_range(int fd, BlockID id, uint64_t n);
+
+    /**
+     * @brief queue the discarded blocks and hand them to the inner storage from a background thread
+     * adjacent ranges are merged, and the queue is drained once per interval so that the frees of
+     * a truncate become a few large discards. A write to a queued block takes it out of the queue
+     * (and waits if it's being discarded), so a block reused meanwhile keeps its new content.
+     * The inner storage is owned and deleted with this one.
+     * @param rate: # of blocks discarded per second at most, 0 for no limit
+     * @param interval_ms: how long a freed block waits in the queue
+    */
+    class DiscardStorage: public Storage {
+    private:
+        Storage* inner;
+        const uint64_t rate;
+        const std::chrono::milliseconds interval;
+
+        // protect pending, busy_* and stop
+        std::mutex mutex;
+        std::condition_variable cv_queue;
+        std::condition_variable cv_done;
+        // start -> # of blocks, no two of them adjacent
+        std::map<BlockID, uint64_t> pending;
+        uint64_t nr_pending;
+        // the range handed to the inner storage right now, busy_len is 0 if none
+        BlockID busy_start;
+        uint64_t busy_len;
+        bool stop;
+        std::thread discarder;
+
+        void run();
+        void take(BlockID start, uint64_t n);
+        void cancel(BlockID id, std::unique_lock<std::mutex>& lk);
+        void cancel(const std::vector<BlockID>& ids);
+
+    public:
+        DiscardStorage(Storage* inner, uint64_t rate=0, uint64_t interval_ms=1000);
+        ~DiscardStorage();
+        void read_block(BlockID id, uint8_t* dst);
+        void write_block(BlockID id, const uint8_t* src);
+        std::future<void> read_block_async(BlockID id, uint8_t* dst);
+        std::future<void> write_block_async(BlockID id, const uint8_t* src);
+        void submit();
+        void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+        const uint8_t* block_ptr(BlockID id);
+
+        void discard(BlockID id, uint64_t n);
+        void flush();
+        void sync();
+
+        // # of blocks waiting to be discarded
+        uint64_t nr_queued();
+    };
+};
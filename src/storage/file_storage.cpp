@@ -1,8 +1,11 @@
 #include "storage/file_storage.h"
+#include "storage/discard_storage.h"
 #include "utils/log_utils.h"
 #include "utils/fs_exception.h"
 #include <cstring>
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace solid {
     FileStorage::FileStorage(BlockID capacity, const std::string& path)
@@ -10,16 +13,21 @@ namespace solid {
         if(!file.good()) {
             throw fs_error("Fail to open the file ",path," for storage");
         }
+        discard_fd = open(path.c_str(), O_RDWR);
     }
 
     FileStorage::~FileStorage() {
         file.close();
+        if(discard_fd >= 0) {
+            close(discard_fd);
+        }
     }
     /** 
      * @brief read Block id to dst
      * @return if it's out of range, throw exception
      */
     void FileStorage::read_block(BlockID id, uint8_t* dst) {
+        std::lock_guard<std::mutex> lk(mutex);
         //LOG(INFO) << "read_block: " << id;
         if(id >= capacity){
             throw fs_error("@read_block ",id," out of range ",capacity);
@@ -36,6 +44,7 @@ namespace solid {
      * @return if it's out of range, throw exception
      */
     void FileStorage::write_block(BlockID id, const uint8_t* src) {
+        std::lock_guard<std::mutex> lk(mutex);
         //LOG(INFO) << "write_block " << id;
         if(id >= capacity){
             throw fs_error("@write_block ",id," out of range ",capacity);
@@ -47,4 +56,76 @@ namespace solid {
         }
         file.flush();
     }
-};
+
+    /**
+     * @brief read Block ids[i] to dsts[i], seeking once per run of adjacent ids
+     * @return if it's out of range, throw exception
+     */
+    void FileStorage::read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        std::lock_guard<std::mutex> lk(mutex);
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@read_blocks ",id," out of range ",capacity);
+            }
+        }
+        Storage::for_each_run(ids, [&](uint64_t begin, uint64_t len){
+            file.seekg(ids[begin] * config::block_size);
+            for(auto i=begin;i<begin+len;i++) {
+                file.read((char*)dsts[i], config::block_size);
+            }
+            if(file.fail()) {
+                throw fs_error("read_blocks ", ids[begin], " failed.");
+            }
+        });
+    }
+
+    /**
+     * @brief write srcs[i] to Block ids[i], seeking once per run and flushing once per call
+     * @return if it's out of range, throw exception
+     */
+    void FileStorage::write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        std::lock_guard<std::mutex> lk(mutex);
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@write_blocks ",id," out of range ",capacity);
+            }
+        }
+        Storage::for_each_run(ids, [&](uint64_t begin, uint64_t len){
+            file.seekp(ids[begin] * config::block_size);
+            for(auto i=begin;i<begin+len;i++) {
+                file.write((const char*)srcs[i], config::block_size);
+            }
+            if(file.fail()) {
+                throw fs_error("write_blocks ", ids[begin], " failed.");
+            }
+        });
+        file.flush();
+    }
+
+    /**
+     * @brief push the stream buffer to the file, fstream can't fsync
+     */
+    void FileStorage::flush() {
+        std::lock_guard<std::mutex> lk(mutex);
+        file.flush();
+        if(file.fail()) {
+            throw fs_error("@flush failed.");
+        }
+    }
+
+    /**
+     * @brief punch a hole over [id, id+n), the reads seek first so the stream buffer is never stale
+     * @return if it's out of range, throw exception
+     */
+    void FileStorage::discard(BlockID id, uint64_t n) {
+        std::lock_guard<std::mutex> lk(mutex);
+        if(id + n > capacity){
+            throw fs_error("@discard ",id," ",n," out of range ",capacity);
+        }
+        if(discard_fd >= 0 && !discard_range(discard_fd, id, n)) {
+            LOG(WARNING) << "@discard: the storage doesn't support discard, ignore it";
+            close(discard_fd);
+            discard_fd = -1;
+        }
+    }
+};
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include <fstream>
+#include <mutex>
 #include "storage/storage.h"
 #include "common.h"
 
@@ -8,11 +9,20 @@ namespace solid {
     private:
         std::fstream file;
         const BlockID capacity;
+        // fstream can't punch holes, discard() goes through a raw fd, -1 once it's unsupported
+        int discard_fd;
+        // the stream has a single position, so the calls from the write-back and discard threads
+        // must not interleave with the others
+        std::mutex mutex;
 
     public:
         FileStorage(uint64_t nr_blocks, const std::string& path);
         ~FileStorage();
         void read_block(BlockID id, uint8_t* dst);
         void write_block(BlockID id, const uint8_t* src);
+        void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+        void flush();
+        void discard(BlockID id, uint64_t n);
     };
 };
\ No newline at end of file
@@ -1,18 +1,109 @@
 #include "storage/memory_storage.h"
 #include "utils/log_utils.h"
 #include "utils/fs_exception.h"
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
+#include <sys/mman.h>
 
 namespace solid {
-    MemoryStorage::MemoryStorage(BlockID capacity) : capacity(capacity) {
-        data = new uint8_t[capacity * config::block_size];
+    namespace {
+        const uint8_t zero_block[config::block_size] = {0};
+
+        inline bool is_zero(const uint8_t* p) {
+            return p[0] == 0 && std::memcmp(p, p + 1, config::block_size - 1) == 0;
+        }
+
+        /**
+         * @brief the end of the span starting at i which is adjacent on both the block ids
+         * and the buffers, and stays in one chunk
+        */
+        template<typename T>
+        uint64_t span_end(const std::vector<BlockID>& ids, const std::vector<T*>& bufs, uint64_t i) {
+            uint64_t j = i + 1;
+            while(j < ids.size() && ids[j] == ids[j-1] + 1 && bufs[j] == bufs[j-1] + config::block_size
+                  && ids[j] % MemoryStorage::nr_blocks_per_chunk != 0) {
+                j++;
+            }
+            return j;
+        }
+    };
+
+    const uint64_t MemoryStorage::nr_blocks_per_chunk;
+    const uint64_t MemoryStorage::chunk_size;
+
+    MemoryStorage::MemoryStorage(BlockID capacity, HugePage huge_page)
+        : capacity(capacity), huge_page(huge_page), nr_chunks(0) {
+        uint64_t n = (capacity + nr_blocks_per_chunk - 1) / nr_blocks_per_chunk;
+        // value-initialized, so all the chunks are nullptr
+        chunks.reset(new std::atomic<uint8_t*>[n]());
     }
 
     MemoryStorage::~MemoryStorage() {
-        delete []data;
+        uint64_t n = (capacity + nr_blocks_per_chunk - 1) / nr_blocks_per_chunk;
+        for(uint64_t i=0;i<n;i++) {
+            uint8_t* p = chunks[i].load();
+            if(p != nullptr) {
+                munmap(p, chunk_size);
+            }
+        }
+    }
+
+    /**
+     * @brief map a chunk, aligned to its size so that it can be a transparent huge page
+    */
+    uint8_t* MemoryStorage::allocate_chunk() {
+        if(huge_page == EXPLICIT) {
+            void* p = mmap(nullptr, chunk_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if(p != MAP_FAILED) {
+                return (uint8_t*)p;
+            }
+            // no huge page reserved (vm.nr_hugepages), fall back to the transparent ones
+            LOG(WARNING) << "@allocate_chunk: MAP_HUGETLB failed " << std::strerror(errno);
+            huge_page = TRANSPARENT;
+        }
+        void* p = mmap(nullptr, chunk_size * 2, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) {
+            throw fs_error("@allocate_chunk: out of memory ",std::strerror(errno));
+        }
+        uint8_t* begin = (uint8_t*)p;
+        uint8_t* aligned = (uint8_t*)(((uintptr_t)begin + chunk_size - 1) & ~(uintptr_t)(chunk_size - 1));
+        if(aligned != begin) {
+            munmap(begin, aligned - begin);
+        }
+        munmap(aligned + chunk_size, begin + chunk_size * 2 - (aligned + chunk_size));
+        if(huge_page == TRANSPARENT) {
+            madvise(aligned, chunk_size, MADV_HUGEPAGE);
+        }
+        return aligned;
+    }
+
+    /**
+     * @brief the chunk holding Block id
+     * @param create: allocate the chunk if it's missing, unless src is a zero block
+     * @return nullptr if the chunk is not allocated
+    */
+    uint8_t* MemoryStorage::get_chunk(BlockID id, bool create, const uint8_t* src) {
+        std::atomic<uint8_t*>& chunk = chunks[id / nr_blocks_per_chunk];
+        uint8_t* p = chunk.load(std::memory_order_acquire);
+        if(p != nullptr || !create || (src != nullptr && is_zero(src))) {
+            return p;
+        }
+        std::lock_guard<std::mutex> lk(alloc_mutex);
+        p = chunk.load(std::memory_order_relaxed);
+        if(p == nullptr) {
+            // fresh anonymous memory is zero-filled
+            p = allocate_chunk();
+            chunk.store(p, std::memory_order_release);
+            nr_chunks++;
+        }
+        return p;
     }
-    /** 
+
+    /**
      * @brief read Block id to dst
      * @return if it's out of range, throw exception
      */
@@ -21,10 +112,15 @@ namespace solid {
         if(id >= capacity){
             throw fs_error("@read_block ",id," out of range ",capacity);
         }
-        std::memcpy(dst,data + id * config::block_size, config::block_size);
+        uint8_t* p = get_chunk(id, false);
+        if(p == nullptr) {
+            std::memset(dst, 0, config::block_size);
+            return;
+        }
+        std::memcpy(dst, p + (id % nr_blocks_per_chunk) * config::block_size, config::block_size);
     }
 
-    /** 
+    /**
      * @brief write src to Block id
      * @return if it's out of range, throw exception
      */
@@ -33,6 +129,81 @@ namespace solid {
         if(id >= capacity){
             throw fs_error("@write_block ",id," out of range ",capacity);
         }
-        std::memcpy(data + id * config::block_size, src, config::block_size);
+        uint8_t* p = get_chunk(id, true, src);
+        if(p == nullptr) {
+            return;
+        }
+        std::memcpy(p + (id % nr_blocks_per_chunk) * config::block_size, src, config::block_size);
+    }
+
+    /**
+     * @brief read Block ids[i] to dsts[i], one memcpy for each span adjacent on both sides
+     * @return if it's out of range, throw exception
+     */
+    void MemoryStorage::read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@read_blocks ",id," out of range ",capacity);
+            }
+        }
+        for(uint64_t i=0, j; i<ids.size(); i=j) {
+            j = span_end(ids, dsts, i);
+            uint8_t* p = get_chunk(ids[i], false);
+            if(p == nullptr) {
+                std::memset(dsts[i], 0, (j - i) * config::block_size);
+            } else {
+                std::memcpy(dsts[i], p + (ids[i] % nr_blocks_per_chunk) * config::block_size, (j - i) * config::block_size);
+            }
+        }
+    }
+
+    void MemoryStorage::write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@write_blocks ",id," out of range ",capacity);
+            }
+        }
+        for(uint64_t i=0, j; i<ids.size(); i=j) {
+            j = span_end(ids, srcs, i);
+            uint8_t* p = get_chunk(ids[i], true);
+            std::memcpy(p + (ids[i] % nr_blocks_per_chunk) * config::block_size, srcs[i], (j - i) * config::block_size);
+        }
+    }
+
+    /**
+     * @brief the block inside its chunk, or a shared zero block if the chunk is untouched
+     * @return if it's out of range, throw exception
+     */
+    const uint8_t* MemoryStorage::block_ptr(BlockID id) {
+        if(id >= capacity){
+            throw fs_error("@block_ptr ",id," out of range ",capacity);
+        }
+        uint8_t* p = get_chunk(id, false);
+        if(p == nullptr) {
+            return zero_block;
+        }
+        return p + (id % nr_blocks_per_chunk) * config::block_size;
+    }
+
+    /**
+     * @brief drop the pages of [id, id+n) in the allocated chunks, the chunks themselves stay
+     * @return if it's out of range, throw exception
+     */
+    void MemoryStorage::discard(BlockID id, uint64_t n) {
+        if(id + n > capacity){
+            throw fs_error("@discard ",id," ",n," out of range ",capacity);
+        }
+        for(BlockID i=id, j; i<id+n; i=j) {
+            j = std::min<BlockID>(id + n, (i / nr_blocks_per_chunk + 1) * nr_blocks_per_chunk);
+            uint8_t* p = get_chunk(i, false);
+            if(p == nullptr) {
+                continue;
+            }
+            uint8_t* begin = p + (i % nr_blocks_per_chunk) * config::block_size;
+            // a private anonymous page is zero-filled on the next touch; a huge page can't be split
+            if(madvise(begin, (j - i) * config::block_size, MADV_DONTNEED) != 0) {
+                std::memset(begin, 0, (j - i) * config::block_size);
+            }
+        }
     }
 };
\ No newline at end of file
@@ -1,17 +1,48 @@
 #pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include "storage/storage.h"
 #include "common.h"
 
 namespace solid {
+    /**
+     * @brief sparse in-memory storage
+     * memory is allocated in chunks on the first non-zero write, untouched blocks read as zeros
+     * @param huge_page: back the chunks with transparent or explicit (hugetlbfs) huge pages
+    */
     class MemoryStorage : public Storage {
+    public:
+        enum HugePage {
+            NONE,TRANSPARENT,EXPLICIT
+        };
+        // one chunk is one 2 MB huge page on x86_64
+        const static uint64_t nr_blocks_per_chunk = 512;
+        const static uint64_t chunk_size = nr_blocks_per_chunk * config::block_size;
+
     private:
         const BlockID capacity;
-        uint8_t* data;
+        HugePage huge_page;
+        std::unique_ptr<std::atomic<uint8_t*>[]> chunks;
+        std::atomic<uint64_t> nr_chunks;
+        // only taken to allocate a chunk
+        std::mutex alloc_mutex;
+
+        uint8_t* get_chunk(BlockID id, bool create, const uint8_t* src=nullptr);
+        uint8_t* allocate_chunk();
 
     public:
-        MemoryStorage(BlockID nr_blocks);
+        MemoryStorage(BlockID nr_blocks, HugePage huge_page=NONE);
         ~MemoryStorage();
         void read_block(BlockID id, uint8_t* dst);
         void write_block(BlockID id, const uint8_t* src);
+        void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+        const uint8_t* block_ptr(BlockID id);
+        // give the pages back, they read as zeros afterwards
+        void discard(BlockID id, uint64_t n);
+
+        // the memory really in use, which tracks the written data rather than the capacity
+        uint64_t allocated_bytes() const { return nr_chunks * chunk_size; }
     };
-};
\ No newline at end of file
+};
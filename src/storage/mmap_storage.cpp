@@ -0,0 +1,127 @@
+#include "storage/mmap_storage.h"
+#include "storage/discard_storage.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace solid {
+    MmapStorage::MmapStorage(BlockID capacity, const std::string& path) : capacity(capacity), can_discard(true) {
+        fd = open(path.c_str(), O_RDWR);
+        if(fd < 0) {
+            throw fs_error("Fail to open the file ",path," for storage: ",std::strerror(errno));
+        }
+        // touching a page beyond the end of a regular file raises SIGBUS, so extend it first
+        struct stat st;
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size < capacity * config::block_size) {
+            if(ftruncate(fd, capacity * config::block_size) != 0) {
+                close(fd);
+                throw fs_error("Fail to extend the file ",path," to ",capacity," blocks: ",std::strerror(errno));
+            }
+        }
+        void* p = mmap(nullptr, capacity * config::block_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED) {
+            close(fd);
+            throw fs_error("Fail to map the file ",path," for storage: ",std::strerror(errno));
+        }
+        data = (uint8_t*)p;
+        // most accesses are single blocks, don't let the kernel read ahead for them
+        madvise(data, capacity * config::block_size, MADV_RANDOM);
+    }
+
+    MmapStorage::~MmapStorage() {
+        try {
+            sync();
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "@~MmapStorage: fail to sync " << e.what();
+        }
+        munmap(data, capacity * config::block_size);
+        close(fd);
+    }
+
+    void MmapStorage::sync() {
+        if(msync(data, capacity * config::block_size, MS_SYNC) != 0) {
+            throw fs_error("@sync: msync failed ", std::strerror(errno));
+        }
+    }
+
+    /** 
+     * @brief read Block id to dst
+     * @return if it's out of range, throw exception
+     */
+    void MmapStorage::read_block(BlockID id, uint8_t* dst) {
+        if(id >= capacity){
+            throw fs_error("@read_block ",id," out of range ",capacity);
+        }
+        std::memcpy(dst, data + id * config::block_size, config::block_size);
+    }
+
+    /** 
+     * @brief write src to Block id
+     * @return if it's out of range, throw exception
+     */
+    void MmapStorage::write_block(BlockID id, const uint8_t* src) {
+        if(id >= capacity){
+            throw fs_error("@write_block ",id," out of range ",capacity);
+        }
+        std::memcpy(data + id * config::block_size, src, config::block_size);
+    }
+
+    void MmapStorage::read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@read_blocks ",id," out of range ",capacity);
+            }
+        }
+        Storage::for_each_run(ids, [&](uint64_t begin, uint64_t len){
+            // MADV_RANDOM disabled the read ahead, ask for the long runs explicitly
+            if(len >= nr_willneed_blocks) {
+                madvise(data + ids[begin] * config::block_size, len * config::block_size, MADV_WILLNEED);
+            }
+            for(auto i=begin;i<begin+len;i++) {
+                std::memcpy(dsts[i], data + ids[i] * config::block_size, config::block_size);
+            }
+        });
+    }
+
+    void MmapStorage::write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@write_blocks ",id," out of range ",capacity);
+            }
+        }
+        for(auto i=0;i<ids.size();i++) {
+            std::memcpy(data + ids[i] * config::block_size, srcs[i], config::block_size);
+        }
+    }
+
+    /**
+     * @brief the block inside the mapping, no copy at all
+     * @return if it's out of range, throw exception
+     */
+    const uint8_t* MmapStorage::block_ptr(BlockID id) {
+        if(id >= capacity){
+            throw fs_error("@block_ptr ",id," out of range ",capacity);
+        }
+        return data + id * config::block_size;
+    }
+
+    /**
+     * @brief punch a hole (or BLKDISCARD a device) over [id, id+n), once it turns out to be
+     * unsupported the rest are ignored
+     * @return if it's out of range, throw exception
+     */
+    void MmapStorage::discard(BlockID id, uint64_t n) {
+        if(id + n > capacity){
+            throw fs_error("@discard ",id," ",n," out of range ",capacity);
+        }
+        if(can_discard && !discard_range(fd, id, n)) {
+            LOG(WARNING) << "@discard: the storage doesn't support discard, ignore it";
+            can_discard = false;
+        }
+    }
+};
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include "storage/storage.h"
+#include "common.h"
+
+namespace solid {
+    /**
+     * @brief storage on a shared mapping of the file/device, block I/O is a memcpy
+     * the mapping is written back by the kernel, call sync() for a durability point
+    */
+    class MmapStorage: public Storage {
+    private:
+        int fd;
+        const BlockID capacity;
+        uint8_t* data;
+        // cleared when the file system or the device rejects a discard
+        bool can_discard;
+
+    public:
+        // runs at least this long are prefetched with MADV_WILLNEED before copying
+        const static uint64_t nr_willneed_blocks = 16;
+
+        MmapStorage(BlockID nr_blocks, const std::string& path);
+        ~MmapStorage();
+        void read_block(BlockID id, uint8_t* dst);
+        void write_block(BlockID id, const uint8_t* src);
+        void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+        const uint8_t* block_ptr(BlockID id);
+        // the mapping sees the hole right away
+        void discard(BlockID id, uint64_t n);
+
+        // msync the whole mapping
+        void sync();
+    };
+};
@@ -0,0 +1,204 @@
+#include "storage/posix_storage.h"
+#include "storage/discard_storage.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+namespace solid {
+    namespace {
+        // each thread owns its bounce buffer, so unaligned callers don't need a lock
+        uint8_t* bounce_buffer() {
+            alignas(PosixStorage::alignment) static thread_local uint8_t buffer[config::block_size];
+            return buffer;
+        }
+
+        inline bool is_aligned(const void* p) {
+            return ((uintptr_t)p & (PosixStorage::alignment - 1)) == 0;
+        }
+    };
+
+    PosixStorage::PosixStorage(BlockID capacity, const std::string& path, bool direct)
+        : capacity(capacity), direct(direct), can_discard(true) {
+        int flags = O_RDWR;
+        if(direct) {
+            flags |= O_DIRECT;
+        }
+        fd = open(path.c_str(), flags);
+        if(fd < 0 && direct && errno == EINVAL) {
+            // e.g. tmpfs doesn't support O_DIRECT, fall back to the page cache
+            LOG(WARNING) << "O_DIRECT is not supported by " << path << ", use buffered I/O";
+            this->direct = false;
+            fd = open(path.c_str(), O_RDWR);
+        }
+        if(fd < 0) {
+            throw fs_error("Fail to open the file ",path," for storage: ",std::strerror(errno));
+        }
+    }
+
+    PosixStorage::~PosixStorage() {
+        close(fd);
+    }
+
+    /**
+     * @brief read Block id to dst
+     * @return if it's out of range, throw exception
+     */
+    void PosixStorage::read_block(BlockID id, uint8_t* dst) {
+        if(id >= capacity){
+            throw fs_error("@read_block ",id," out of range ",capacity);
+        }
+        uint8_t* buf = (direct && !is_aligned(dst)) ? bounce_buffer() : dst;
+        uint64_t s = 0;
+        while(s < config::block_size) {
+            ssize_t ret = pread(fd, buf + s, config::block_size - s, id * config::block_size + s);
+            if(ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if(ret <= 0) {
+                throw fs_error("read_block ", id, " failed: ", ret == 0 ? "EOF" : std::strerror(errno));
+            }
+            s += ret;
+        }
+        if(buf != dst) {
+            std::memcpy(dst, buf, config::block_size);
+        }
+    }
+
+    /**
+     * @brief write src to Block id
+     * @return if it's out of range, throw exception
+     */
+    void PosixStorage::write_block(BlockID id, const uint8_t* src) {
+        if(id >= capacity){
+            throw fs_error("@write_block ",id," out of range ",capacity);
+        }
+        const uint8_t* buf = src;
+        if(direct && !is_aligned(src)) {
+            uint8_t* bounce = bounce_buffer();
+            std::memcpy(bounce, src, config::block_size);
+            buf = bounce;
+        }
+        uint64_t s = 0;
+        while(s < config::block_size) {
+            ssize_t ret = pwrite(fd, buf + s, config::block_size - s, id * config::block_size + s);
+            if(ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if(ret <= 0) {
+                throw fs_error("write_block ", id, " failed: ", std::strerror(errno));
+            }
+            s += ret;
+        }
+    }
+
+    /**
+     * @brief preadv/pwritev the run [id, id+n), one syscall per IOV_MAX blocks
+     * short transfers are resumed from where they stopped
+    */
+    void PosixStorage::transfer_run(BlockID id, uint8_t* const* bufs, uint64_t n, bool is_read) {
+        std::vector<iovec> iov(std::min<uint64_t>(n, IOV_MAX));
+        for(uint64_t done = 0; done < n;) {
+            uint64_t cnt = std::min<uint64_t>(n - done, IOV_MAX);
+            for(uint64_t i=0;i<cnt;i++) {
+                iov[i].iov_base = bufs[done + i];
+                iov[i].iov_len = config::block_size;
+            }
+            uint64_t nr_bytes = cnt * config::block_size;
+            uint64_t offset = (id + done) * config::block_size;
+            iovec* p = iov.data();
+            uint64_t s = 0;
+            while(s < nr_bytes) {
+                ssize_t ret = is_read ? preadv(fd, p, (int)(iov.data() + cnt - p), offset + s)
+                                      : pwritev(fd, p, (int)(iov.data() + cnt - p), offset + s);
+                if(ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(ret <= 0) {
+                    throw fs_error(is_read ? "read_blocks " : "write_blocks ", id + done, " failed: ",
+                                   ret == 0 ? "EOF" : std::strerror(errno));
+                }
+                s += ret;
+                // skip the iovecs which are done, and trim the partial one
+                while(ret > 0 && ret >= (ssize_t)p->iov_len) {
+                    ret -= p->iov_len;
+                    p++;
+                }
+                if(ret > 0) {
+                    p->iov_base = (uint8_t*)p->iov_base + ret;
+                    p->iov_len -= ret;
+                }
+            }
+            done += cnt;
+        }
+    }
+
+    void PosixStorage::read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@read_blocks ",id," out of range ",capacity);
+            }
+        }
+        Storage::for_each_run(ids, [&](uint64_t begin, uint64_t len){
+            if(direct) {
+                // O_DIRECT can't take unaligned buffers, bounce them one by one
+                for(auto i=begin;i<begin+len;i++) {
+                    if(!is_aligned(dsts[i])) {
+                        for(auto j=begin;j<begin+len;j++)
+                            read_block(ids[j], dsts[j]);
+                        return;
+                    }
+                }
+            }
+            transfer_run(ids[begin], dsts.data() + begin, len, true);
+        });
+    }
+
+    void PosixStorage::write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@write_blocks ",id," out of range ",capacity);
+            }
+        }
+        Storage::for_each_run(ids, [&](uint64_t begin, uint64_t len){
+            if(direct) {
+                for(auto i=begin;i<begin+len;i++) {
+                    if(!is_aligned(srcs[i])) {
+                        for(auto j=begin;j<begin+len;j++)
+                            write_block(ids[j], srcs[j]);
+                        return;
+                    }
+                }
+            }
+            transfer_run(ids[begin], (uint8_t* const*)srcs.data() + begin, len, false);
+        });
+    }
+
+    /**
+     * @brief punch a hole (or BLKDISCARD a device) over [id, id+n), once it turns out to be
+     * unsupported the rest are ignored
+     * @return if it's out of range, throw exception
+     */
+    void PosixStorage::discard(BlockID id, uint64_t n) {
+        if(id + n > capacity){
+            throw fs_error("@discard ",id," ",n," out of range ",capacity);
+        }
+        if(can_discard && !discard_range(fd, id, n)) {
+            LOG(WARNING) << "@discard: the storage doesn't support discard, ignore it";
+            can_discard = false;
+        }
+    }
+
+    /**
+     * @brief fdatasync the file, even O_DIRECT writes may sit in the device cache
+     */
+    void PosixStorage::sync() {
+        if(fdatasync(fd) != 0) {
+            throw fs_error("@sync: fdatasync failed ",std::strerror(errno));
+        }
+    }
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include "storage/storage.h"
+#include "common.h"
+
+namespace solid {
+    /**
+     * @brief storage on a raw fd with pread/pwrite, safe to be shared by several threads
+     * @param direct: open the file with O_DIRECT, bypassing the page cache
+    */
+    class PosixStorage: public Storage {
+    private:
+        int fd;
+        const BlockID capacity;
+        bool direct;
+        // cleared when the file system or the device rejects a discard
+        bool can_discard;
+
+        void transfer_run(BlockID id, uint8_t* const* bufs, uint64_t n, bool is_read);
+
+    public:
+        // O_DIRECT needs the buffer, the offset and the length aligned to the logical block size
+        const static uint64_t alignment = config::block_size;
+
+        PosixStorage(BlockID nr_blocks, const std::string& path, bool direct=false);
+        ~PosixStorage();
+        void read_block(BlockID id, uint8_t* dst);
+        void write_block(BlockID id, const uint8_t* src);
+        void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+        void discard(BlockID id, uint64_t n);
+        void sync();
+
+        bool is_direct() const { return direct; }
+    };
+};
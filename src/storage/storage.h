@@ -1,13 +1,113 @@
 #pragma once
 
+#include <exception>
+#include <future>
+#include <vector>
 #include "common.h"
 namespace solid {
     class Storage{
     public:
         Storage() {};
-        virtual ~Storage() {}; 
+        virtual ~Storage() {};
 
         virtual void read_block(BlockID id, uint8_t* dst) = 0;
         virtual void write_block(BlockID id, const uint8_t* src) = 0;
+
+        /**
+         * @brief queue an asynchronous read/write, the buffer must stay alive until the future is ready
+         * the default implementation just does a synchronous I/O
+         * @return a future which throws the I/O error (if any) on get()
+        */
+        virtual std::future<void> read_block_async(BlockID id, uint8_t* dst) {
+            std::promise<void> p;
+            try {
+                read_block(id,dst);
+                p.set_value();
+            } catch (...) {
+                p.set_exception(std::current_exception());
+            }
+            return p.get_future();
+        }
+        virtual std::future<void> write_block_async(BlockID id, const uint8_t* src) {
+            std::promise<void> p;
+            try {
+                write_block(id,src);
+                p.set_value();
+            } catch (...) {
+                p.set_exception(std::current_exception());
+            }
+            return p.get_future();
+        }
+        // hand all the queued asynchronous requests to the device
+        virtual void submit() {};
+
+        /**
+         * @brief flush: push the buffered writes down to the device, no durability promised
+         * sync: a barrier, all the completed writes are durable when it returns
+        */
+        virtual void flush() {};
+        virtual void sync() { flush(); };
+
+        /**
+         * @brief the blocks [id, id+n) are no longer in use, the storage may drop their content
+         * (punch a hole in the file, trim the device); they read as garbage until written again
+         * the default implementation keeps them as they are
+        */
+        virtual void discard(BlockID id, uint64_t n) {};
+
+        /**
+         * @brief a read-only pointer to Block id if the storage can expose it without a copy
+         * it's only meant for metadata which is read right away, don't keep it across writes
+         * @return nullptr if the storage can't do it
+        */
+        virtual const uint8_t* block_ptr(BlockID id) { return nullptr; }
+
+        /**
+         * @brief read Block ids[i] to dsts[i]; backends merge runs of adjacent ids into one I/O
+         * @return if any id is out of range, throw exception
+        */
+        virtual void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+            for(auto i=0;i<ids.size();i++) {
+                read_block(ids[i],dsts[i]);
+            }
+        }
+        virtual void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+            for(auto i=0;i<ids.size();i++) {
+                write_block(ids[i],srcs[i]);
+            }
+        }
+
+        /**
+         * @brief call f(begin, len) for each maximal run ids[begin, begin+len) of adjacent block ids
+        */
+        template<typename F>
+        static void for_each_run(const std::vector<BlockID>& ids, F f) {
+            uint64_t begin = 0;
+            for(uint64_t i=1;i<=ids.size();i++) {
+                if(i == ids.size() || ids[i] != ids[i-1] + 1) {
+                    f(begin, i - begin);
+                    begin = i;
+                }
+            }
+        }
+
+        /**
+         * @brief wait for all the futures, then rethrow the first error
+         * we can't stop at the first error since the others may still be writing to the buffers
+        */
+        static void wait_all(std::vector<std::future<void>>& futures) {
+            std::exception_ptr error = nullptr;
+            for(auto& f : futures) {
+                try {
+                    f.get();
+                } catch (...) {
+                    if(error == nullptr)
+                        error = std::current_exception();
+                }
+            }
+            if(error != nullptr) {
+                std::rethrow_exception(error);
+            }
+        }
     };
-};
\ No newline at end of file
+};
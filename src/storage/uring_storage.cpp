@@ -0,0 +1,339 @@
+#include "storage/uring_storage.h"
+#include "storage/discard_storage.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace solid {
+    namespace {
+        inline int io_uring_setup(unsigned entries, io_uring_params* p) {
+            return (int)syscall(__NR_io_uring_setup, entries, p);
+        }
+
+        inline int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+            return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+        }
+
+        inline unsigned load_acquire(const unsigned* p) {
+            return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+        }
+
+        inline void store_release(unsigned* p, unsigned v) {
+            __atomic_store_n(p, v, __ATOMIC_RELEASE);
+        }
+    };
+
+    UringStorage::UringStorage(BlockID capacity, const std::string& path, uint32_t depth, uint32_t batch)
+        : capacity(capacity), batch(batch), can_discard(true), nr_queued(0), nr_inflight(0), stop(false) {
+        fd = open(path.c_str(), O_RDWR);
+        if(fd < 0) {
+            throw fs_error("Fail to open the file ",path," for storage: ",std::strerror(errno));
+        }
+
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        ring_fd = io_uring_setup(depth, &p);
+        if(ring_fd < 0) {
+            close(fd);
+            throw fs_error("io_uring is not available: ",std::strerror(errno));
+        }
+        sq_entries = p.sq_entries;
+
+        // map the two rings, since 5.4 they share one mapping
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+        if(sq_ptr == MAP_FAILED) {
+            close(ring_fd);
+            close(fd);
+            throw fs_error("Fail to map the io_uring submission ring: ",std::strerror(errno));
+        }
+        if(single_mmap) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd, IORING_OFF_CQ_RING);
+            if(cq_ptr == MAP_FAILED) {
+                munmap(sq_ptr, sq_size);
+                close(ring_fd);
+                close(fd);
+                throw fs_error("Fail to map the io_uring completion ring: ",std::strerror(errno));
+            }
+        }
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   ring_fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) {
+            if(!single_mmap)
+                munmap(cq_ptr, cq_size);
+            munmap(sq_ptr, sq_size);
+            close(ring_fd);
+            close(fd);
+            throw fs_error("Fail to map the io_uring entries: ",std::strerror(errno));
+        }
+
+        uint8_t* sq = (uint8_t*)sq_ptr;
+        sq_head = (unsigned*)(sq + p.sq_off.head);
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+
+        uint8_t* cq = (uint8_t*)cq_ptr;
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+        reaper = std::thread([this](){ reap(); });
+    }
+
+    UringStorage::~UringStorage() {
+        {
+            std::unique_lock<std::mutex> lk(sq_mutex);
+            submit_locked();
+            cv_slot.wait(lk, [this](){ return nr_inflight == 0; });
+
+            // a NOP without a request tells the reaper to quit
+            stop = true;
+            unsigned tail = *sq_tail;
+            unsigned idx = tail & *sq_mask;
+            std::memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+            sqes[idx].opcode = IORING_OP_NOP;
+            sqes[idx].user_data = 0;
+            sq_array[idx] = idx;
+            store_release(sq_tail, tail + 1);
+            nr_queued++;
+            nr_inflight++;
+            submit_locked();
+        }
+        reaper.join();
+
+        munmap(sqes, sqes_size);
+        if(cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        munmap(sq_ptr, sq_size);
+        close(ring_fd);
+        close(fd);
+    }
+
+    /**
+     * @brief put one request for the run [id, id+n) into the submission ring
+     * @return the future fulfilled by the reaper
+    */
+    std::future<void> UringStorage::queue(BlockID id, uint8_t* const* bufs, uint64_t n, bool is_read) {
+        if(id + n > capacity){
+            throw fs_error(is_read ? "@read_block " : "@write_block ",id + n - 1," out of range ",capacity);
+        }
+        Request* r = new Request();
+        r->id = id;
+        r->is_read = is_read;
+        r->iov.resize(n);
+        for(uint64_t i=0;i<n;i++) {
+            r->iov[i].iov_base = bufs[i];
+            r->iov[i].iov_len = config::block_size;
+        }
+        std::future<void> ret = r->promise.get_future();
+
+        std::unique_lock<std::mutex> lk(sq_mutex);
+        // never let the in-flight requests overflow the completion ring
+        while(nr_inflight >= sq_entries) {
+            submit_locked();
+            cv_slot.wait(lk);
+        }
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[idx];
+        std::memset(sqe, 0, sizeof(io_uring_sqe));
+        sqe->opcode = is_read ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->off = id * config::block_size;
+        sqe->addr = (uint64_t)r->iov.data();
+        sqe->len = (uint32_t)n;
+        sqe->user_data = (uint64_t)r;
+        sq_array[idx] = idx;
+        store_release(sq_tail, tail + 1);
+        nr_queued++;
+        nr_inflight++;
+
+        if(nr_queued >= batch) {
+            submit_locked();
+        }
+        return ret;
+    }
+
+    // the caller should hold sq_mutex
+    void UringStorage::submit_locked() {
+        while(nr_queued > 0) {
+            int ret = io_uring_enter(ring_fd, nr_queued, 0, 0);
+            if(ret < 0) {
+                if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                throw fs_error("io_uring_enter failed: ",std::strerror(errno));
+            }
+            nr_queued -= ret;
+        }
+    }
+
+    /**
+     * @brief the reaper thread, wait for completions and fulfill the futures
+    */
+    void UringStorage::reap() {
+        while(true) {
+            int ret = io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                LOG(ERROR) << "@reap: io_uring_enter failed " << std::strerror(errno);
+            }
+
+            bool quit = false;
+            uint32_t nr_done = 0;
+            unsigned head = *cq_head;
+            unsigned tail = load_acquire(cq_tail);
+            for(; head != tail; head++, nr_done++) {
+                io_uring_cqe* cqe = &cqes[head & *cq_mask];
+                Request* r = (Request*)cqe->user_data;
+                if(r == nullptr) {
+                    quit = stop;
+                    continue;
+                }
+                if(cqe->res == (int)(r->iov.size() * config::block_size)) {
+                    r->promise.set_value();
+                } else {
+                    const char* op = r->is_read ? "read_block " : "write_block ";
+                    const char* err = cqe->res < 0 ? std::strerror(-cqe->res) : "short I/O";
+                    try {
+                        throw fs_error(op, r->id, " failed: ", err);
+                    } catch (...) {
+                        r->promise.set_exception(std::current_exception());
+                    }
+                }
+                delete r;
+            }
+            store_release(cq_head, head);
+
+            if(nr_done > 0) {
+                std::lock_guard<std::mutex> lk(sq_mutex);
+                nr_inflight -= nr_done;
+                cv_slot.notify_all();
+            }
+            if(quit) {
+                return;
+            }
+        }
+    }
+
+    std::future<void> UringStorage::read_block_async(BlockID id, uint8_t* dst) {
+        return queue(id, &dst, 1, true);
+    }
+
+    std::future<void> UringStorage::write_block_async(BlockID id, const uint8_t* src) {
+        uint8_t* buf = (uint8_t*)src;
+        return queue(id, &buf, 1, false);
+    }
+
+    void UringStorage::submit() {
+        std::lock_guard<std::mutex> lk(sq_mutex);
+        submit_locked();
+    }
+
+    /**
+     * @brief submit the queued requests and wait until none is in flight
+     */
+    void UringStorage::flush() {
+        std::unique_lock<std::mutex> lk(sq_mutex);
+        submit_locked();
+        cv_slot.wait(lk, [this](){ return nr_inflight == 0; });
+    }
+
+    /**
+     * @brief flush, then fdatasync the file
+     */
+    void UringStorage::sync() {
+        flush();
+        if(fdatasync(fd) != 0) {
+            throw fs_error("@sync: fdatasync failed ",std::strerror(errno));
+        }
+    }
+
+    /**
+     * @brief punch a hole (or BLKDISCARD a device) over [id, id+n), once it turns out to be
+     * unsupported the rest are ignored
+     * @return if it's out of range, throw exception
+     */
+    void UringStorage::discard(BlockID id, uint64_t n) {
+        if(id + n > capacity){
+            throw fs_error("@discard ",id," ",n," out of range ",capacity);
+        }
+        if(can_discard && !discard_range(fd, id, n)) {
+            LOG(WARNING) << "@discard: the storage doesn't support discard, ignore it";
+            can_discard = false;
+        }
+    }
+
+    /**
+     * @brief read Block id to dst
+     * @return if it's out of range, throw exception
+     */
+    void UringStorage::read_block(BlockID id, uint8_t* dst) {
+        std::future<void> f = read_block_async(id, dst);
+        submit();
+        f.get();
+    }
+
+    /**
+     * @brief write src to Block id
+     * @return if it's out of range, throw exception
+     */
+    void UringStorage::write_block(BlockID id, const uint8_t* src) {
+        std::future<void> f = write_block_async(id, src);
+        submit();
+        f.get();
+    }
+
+    /**
+     * @brief one READV per run of adjacent blocks, all the runs are in flight together
+     * @return if it's out of range, throw exception
+     */
+    void UringStorage::read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@read_blocks ",id," out of range ",capacity);
+            }
+        }
+        std::vector<std::future<void>> futures;
+        Storage::for_each_run(ids, [&](uint64_t begin, uint64_t len){
+            for(uint64_t i=begin;i<begin+len;i+=IOV_MAX) {
+                futures.push_back(queue(ids[i], dsts.data() + i, std::min<uint64_t>(IOV_MAX, begin + len - i), true));
+            }
+        });
+        submit();
+        Storage::wait_all(futures);
+    }
+
+    void UringStorage::write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        for(auto id : ids) {
+            if(id >= capacity){
+                throw fs_error("@write_blocks ",id," out of range ",capacity);
+            }
+        }
+        std::vector<std::future<void>> futures;
+        Storage::for_each_run(ids, [&](uint64_t begin, uint64_t len){
+            for(uint64_t i=begin;i<begin+len;i+=IOV_MAX) {
+                futures.push_back(queue(ids[i], (uint8_t* const*)srcs.data() + i,
+                                        std::min<uint64_t>(IOV_MAX, begin + len - i), false));
+            }
+        });
+        submit();
+        Storage::wait_all(futures);
+    }
+};
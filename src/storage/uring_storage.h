@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "storage/storage.h"
+#include "common.h"
+
+namespace solid {
+    /**
+     * @brief asynchronous storage on io_uring
+     * requests are queued into the submission ring and handed to the kernel in batches,
+     * a completion thread reaps the completion ring and fulfills the futures
+     * @param depth: # of entries of the submission ring, i.e. the maximum # of in-flight I/Os
+     * @param batch: # of queued requests which triggers a submission without calling submit()
+    */
+    class UringStorage: public Storage {
+    private:
+        // one request covers a run of adjacent blocks
+        struct Request {
+            std::promise<void> promise;
+            BlockID id;
+            std::vector<iovec> iov;
+            bool is_read;
+        };
+
+        int fd;
+        int ring_fd;
+        const BlockID capacity;
+        const uint32_t batch;
+        // cleared when the file system or the device rejects a discard
+        bool can_discard;
+
+        // the submission ring
+        void* sq_ptr;
+        size_t sq_size;
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned* sq_mask;
+        unsigned* sq_array;
+        unsigned sq_entries;
+        io_uring_sqe* sqes;
+        size_t sqes_size;
+
+        // the completion ring
+        void* cq_ptr;
+        size_t cq_size;
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned* cq_mask;
+        io_uring_cqe* cqes;
+
+        // protect the submission ring and the counters below
+        std::mutex sq_mutex;
+        std::condition_variable cv_slot;
+        // queued but not submitted
+        uint32_t nr_queued;
+        // queued or submitted, but not completed
+        uint32_t nr_inflight;
+
+        std::atomic<bool> stop;
+        std::thread reaper;
+
+        std::future<void> queue(BlockID id, uint8_t* const* bufs, uint64_t n, bool is_read);
+        void submit_locked();
+        void reap();
+
+    public:
+        UringStorage(BlockID nr_blocks, const std::string& path, uint32_t depth=256, uint32_t batch=32);
+        ~UringStorage();
+        void read_block(BlockID id, uint8_t* dst);
+        void write_block(BlockID id, const uint8_t* src);
+
+        std::future<void> read_block_async(BlockID id, uint8_t* dst);
+        std::future<void> write_block_async(BlockID id, const uint8_t* src);
+        void submit();
+        void flush();
+        void sync();
+        void discard(BlockID id, uint64_t n);
+
+        void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+    };
+};
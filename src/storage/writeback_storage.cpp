@@ -0,0 +1,207 @@
+#include "storage/writeback_storage.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <algorithm>
+#include <cstring>
+
+namespace solid {
+    WriteBackStorage::WriteBackStorage(Storage* inner, uint64_t interval_ms, uint64_t threshold)
+        : inner(inner), interval(interval_ms), threshold(std::max<uint64_t>(threshold, 1)), stop(false) {
+        committer = std::thread([this](){ run(); });
+    }
+
+    WriteBackStorage::~WriteBackStorage() {
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            stop = true;
+            cv_commit.notify_all();
+        }
+        committer.join();
+        try {
+            sync();
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "@~WriteBackStorage: fail to write back " << e.what();
+        }
+        delete inner;
+    }
+
+    /**
+     * @brief the commit thread, wake up on the timer or when there are enough dirty blocks
+    */
+    void WriteBackStorage::run() {
+        std::unique_lock<std::mutex> lk(mutex);
+        while(!stop) {
+            cv_commit.wait_for(lk, interval, [this](){ return stop || dirty.size() >= threshold; });
+            if(stop || dirty.empty()) {
+                continue;
+            }
+            lk.unlock();
+            try {
+                commit();
+            } catch (const std::exception& e) {
+                LOG(ERROR) << "@WriteBackStorage: commit failed " << e.what();
+            }
+            lk.lock();
+        }
+    }
+
+    /**
+     * @brief write the current dirty blocks to the inner storage as one group
+     * the blocks are sorted, so adjacent ones become one I/O
+    */
+    void WriteBackStorage::commit() {
+        std::lock_guard<std::mutex> commit_lk(commit_mutex);
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            committing.swap(dirty);
+        }
+        if(committing.empty()) {
+            return;
+        }
+        std::vector<BlockID> ids;
+        std::vector<const uint8_t*> srcs;
+        ids.reserve(committing.size());
+        srcs.reserve(committing.size());
+        for(auto& p : committing) {
+            ids.push_back(p.first);
+            srcs.push_back(p.second.data);
+        }
+        try {
+            inner->write_blocks(ids, srcs);
+        } catch (...) {
+            // put the group back unless it has been overwritten or discarded meanwhile
+            std::lock_guard<std::mutex> lk(mutex);
+            for(auto& r : discarded) {
+                committing.erase(committing.lower_bound(r.first), committing.lower_bound(r.first + r.second));
+            }
+            discarded.clear();
+            dirty.insert(committing.begin(), committing.end());
+            committing.clear();
+            cv_space.notify_all();
+            throw;
+        }
+        // the stale copies of the blocks discarded during the write have reached the inner
+        // storage after their discard and cancelled it, discard them again
+        std::vector<std::pair<BlockID, uint64_t>> runs;
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            for(auto& r : discarded) {
+                auto end = committing.lower_bound(r.first + r.second);
+                for(auto p = committing.lower_bound(r.first); p != end; p++) {
+                    if(!runs.empty() && runs.back().first + runs.back().second == p->first) {
+                        runs.back().second++;
+                    } else {
+                        runs.push_back({p->first, 1});
+                    }
+                }
+            }
+            discarded.clear();
+            committing.clear();
+            cv_space.notify_all();
+        }
+        for(auto& r : runs) {
+            inner->discard(r.first, r.second);
+        }
+    }
+
+    // the caller should hold mutex
+    bool WriteBackStorage::lookup(BlockID id, uint8_t* dst) {
+        auto p = dirty.find(id);
+        if(p == dirty.end()) {
+            p = committing.find(id);
+            if(p == committing.end()) {
+                return false;
+            }
+        }
+        std::memcpy(dst, p->second.data, config::block_size);
+        return true;
+    }
+
+    /** 
+     * @brief read Block id to dst, the dirty copy wins
+     * @return if it's out of range, throw exception
+     */
+    void WriteBackStorage::read_block(BlockID id, uint8_t* dst) {
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            if(lookup(id, dst)) {
+                return;
+            }
+        }
+        inner->read_block(id, dst);
+    }
+
+    void WriteBackStorage::read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts) {
+        std::vector<BlockID> miss_ids;
+        std::vector<uint8_t*> miss_dsts;
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            for(auto i=0;i<ids.size();i++) {
+                if(!lookup(ids[i], dsts[i])) {
+                    miss_ids.push_back(ids[i]);
+                    miss_dsts.push_back(dsts[i]);
+                }
+            }
+        }
+        inner->read_blocks(miss_ids, miss_dsts);
+    }
+
+    /** 
+     * @brief keep src in memory until the next commit
+     */
+    void WriteBackStorage::write_block(BlockID id, const uint8_t* src) {
+        write_blocks({id}, {src});
+    }
+
+    void WriteBackStorage::write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+        std::unique_lock<std::mutex> lk(mutex);
+        // too much dirty data, wait for the commit thread to catch up
+        while(dirty.size() >= threshold * 2 && !stop) {
+            cv_commit.notify_all();
+            cv_space.wait(lk);
+        }
+        for(auto i=0;i<ids.size();i++) {
+            std::memcpy(dirty[ids[i]].data, srcs[i], config::block_size);
+        }
+        if(dirty.size() >= threshold) {
+            cv_commit.notify_all();
+        }
+    }
+
+    /**
+     * @brief the dirty copies of [id, id+n) are not worth committing any more, the ones in the
+     * group being committed are discarded again once it's written
+     */
+    void WriteBackStorage::discard(BlockID id, uint64_t n) {
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            dirty.erase(dirty.lower_bound(id), dirty.lower_bound(id + n));
+            if(!committing.empty()) {
+                discarded.push_back({id, n});
+            }
+            cv_space.notify_all();
+        }
+        inner->discard(id, n);
+    }
+
+    /**
+     * @brief commit all the dirty blocks to the inner storage, without a durability barrier
+     */
+    void WriteBackStorage::flush() {
+        commit();
+        inner->flush();
+    }
+
+    /**
+     * @brief commit all the dirty blocks and make them durable
+     */
+    void WriteBackStorage::sync() {
+        commit();
+        inner->sync();
+    }
+
+    uint64_t WriteBackStorage::nr_dirty() {
+        std::lock_guard<std::mutex> lk(mutex);
+        return dirty.size();
+    }
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "storage/storage.h"
+#include "block/block.h"
+#include "common.h"
+
+namespace solid {
+    /**
+     * @brief buffer the writes in memory and commit them to the inner storage in groups
+     * a group is committed when the commit interval elapses, the dirty threshold is reached,
+     * or flush()/sync() is called. The inner storage is owned and deleted with this one.
+     * @param interval_ms: the longest time a dirty block stays in memory
+     * @param threshold: # of dirty blocks which triggers a commit, writers block at twice of it
+    */
+    class WriteBackStorage: public Storage {
+    private:
+        Storage* inner;
+        const std::chrono::milliseconds interval;
+        const uint64_t threshold;
+
+        // protect dirty, committing, discarded and stop
+        std::mutex mutex;
+        std::condition_variable cv_commit;
+        std::condition_variable cv_space;
+        std::map<BlockID, Block> dirty;
+        // the group being written to the inner storage, still visible to the readers
+        std::map<BlockID, Block> committing;
+        // the ranges discarded while the group is being written, which must not bring them back
+        std::vector<std::pair<BlockID, uint64_t>> discarded;
+        bool stop;
+        // only one commit at a time
+        std::mutex commit_mutex;
+        std::thread committer;
+
+        void commit();
+        void run();
+        bool lookup(BlockID id, uint8_t* dst);
+
+    public:
+        WriteBackStorage(Storage* inner, uint64_t interval_ms=5000, uint64_t threshold=1024);
+        ~WriteBackStorage();
+        void read_block(BlockID id, uint8_t* dst);
+        void write_block(BlockID id, const uint8_t* src);
+        void read_blocks(const std::vector<BlockID>& ids, const std::vector<uint8_t*>& dsts);
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs);
+
+        void discard(BlockID id, uint64_t n);
+        void flush();
+        void sync();
+
+        uint64_t nr_dirty();
+    };
+};
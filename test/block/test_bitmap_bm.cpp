@@ -0,0 +1,205 @@
+#include <iostream>
+#include <cstring>
+#include <gtest/gtest.h>
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include "storage/memory_storage.h"
+#include "block/bitmap_blockmanager.h"
+#include "block/super_block.h"
+#include "block/block.h"
+
+namespace solid {
+    class BitmapBlockTest : public testing::Test {
+    protected:
+        MemoryStorage* storage;
+        super_block sblock;
+
+        void init(BlockID nr_block) {
+            storage = new MemoryStorage(nr_block);
+            std::memset(sblock.data,0,config::block_size);
+            sblock.nr_block = nr_block;
+            sblock.s_iblock = 1;
+            sblock.nr_iblock = 9;
+            sblock.s_dblock = 10;
+            sblock.nr_dblock = nr_block - 10;
+            sblock.allocator = BlockAllocator::BITMAP;
+            storage->write_block(0,sblock.data);
+        }
+
+        void TearDown() {
+            delete storage;
+        }
+    };
+
+    TEST_F(BitmapBlockTest,AllocateFree) {
+        init(1300);
+        BitmapBlockManager bm(storage,&sblock);
+        bm.mkfs();
+        // block 10 holds the bitmap
+        EXPECT_EQ(bm.get_nr_free_blocks(),1289);
+        for(BlockID i=11;i<1300;i++) {
+            EXPECT_EQ(bm.allocate_dblock(),i);
+        }
+        EXPECT_THROW(bm.allocate_dblock(),fs_exception);
+        bm.free_dblock(500);
+        bm.free_dblock(20);
+        EXPECT_EQ(bm.allocate_dblock(),20);
+        EXPECT_EQ(bm.allocate_dblock(),500);
+        EXPECT_THROW(bm.free_dblock(10),fs_error);
+    }
+
+    TEST_F(BitmapBlockTest,AllocateRun) {
+        init(1300);
+        BitmapBlockManager bm(storage,&sblock);
+        bm.mkfs();
+        for(BlockID i=11;i<300;i++) {
+            bm.allocate_dblock();
+        }
+        // holes of 3 and 100 blocks
+        for(BlockID i=100;i<103;i++) {
+            bm.free_dblock(i);
+        }
+        for(BlockID i=150;i<250;i++) {
+            bm.free_dblock(i);
+        }
+        EXPECT_EQ(bm.allocate_run(3),100);
+        EXPECT_EQ(bm.allocate_run(70),150);
+        EXPECT_EQ(bm.allocate_run(40),300);
+        EXPECT_EQ(bm.allocate_run(30),220);
+        EXPECT_THROW(bm.allocate_run(2000),fs_exception);
+    }
+
+    TEST_F(BitmapBlockTest,Persistent) {
+        init(1300);
+        {
+            BitmapBlockManager bm(storage,&sblock);
+            bm.mkfs();
+            for(BlockID i=11;i<100;i++) {
+                bm.allocate_dblock();
+            }
+            bm.free_dblock(50);
+        }
+        BitmapBlockManager bm(storage,&sblock);
+        EXPECT_EQ(bm.get_nr_free_blocks(),1289 - 88);
+        EXPECT_EQ(bm.allocate_dblock(),50);
+        EXPECT_EQ(bm.allocate_dblock(),100);
+    }
+
+    TEST_F(BitmapBlockTest,Summary) {
+        // 10 bitmap blocks, three summary levels
+        init(10 + 10 * BitmapBlockManager::nr_blocks_per_bitmap_block);
+        BitmapBlockManager bm(storage,&sblock,true);
+        bm.mkfs();
+        BlockID first = 20;
+        EXPECT_EQ(bm.allocate_run(200000),first);
+        EXPECT_EQ(bm.allocate_dblock(),first + 200000);
+        bm.free_dblock(first + 123456);
+        EXPECT_EQ(bm.allocate_dblock(),first + 123456);
+        EXPECT_EQ(bm.allocate_run(64),first + 200001);
+        bm.free_dblock(first + 64 * 1000 + 5);
+        EXPECT_EQ(bm.allocate_run(1),first + 64 * 1000 + 5);
+    }
+
+    TEST_F(BitmapBlockTest,AllocateDBlocks) {
+        init(1300);
+        BitmapBlockManager bm(storage,&sblock);
+        bm.mkfs();
+        // free extents: [11,100) [200,230) [300,1300)
+        std::vector<extent> used = bm.allocate_dblocks(1289);
+        ASSERT_EQ(used.size(),1);
+        EXPECT_EQ(used[0].start,11);
+        EXPECT_EQ(used[0].len,1289);
+        bm.free_dblocks(extent{11,89});
+        bm.free_dblocks(extent{200,30});
+        bm.free_dblocks(extent{300,1000});
+
+        // best fit
+        std::vector<extent> v = bm.allocate_dblocks(20);
+        ASSERT_EQ(v.size(),1);
+        EXPECT_EQ(v[0].start,200);
+        // too large for any extent, take the largest ones
+        v = bm.allocate_dblocks(1050);
+        ASSERT_EQ(v.size(),2);
+        EXPECT_EQ(v[0].start,300);
+        EXPECT_EQ(v[0].len,1000);
+        EXPECT_EQ(v[1].start,11);
+        EXPECT_EQ(v[1].len,50);
+        EXPECT_EQ(bm.get_nr_free_blocks(),49);
+
+        // freed neighbours merge into one extent again
+        bm.free_dblocks(extent{11,50});
+        bm.free_dblocks(extent{220,10});
+        bm.free_dblocks(extent{200,20});
+        bm.free_dblocks(extent{300,1000});
+        v = bm.allocate_dblocks(1000);
+        ASSERT_EQ(v.size(),1);
+        EXPECT_EQ(v[0].start,300);
+        EXPECT_THROW(bm.allocate_dblocks(1000),fs_exception);
+    }
+
+    TEST_F(BitmapBlockTest,Goal) {
+        init(1300);
+        BitmapBlockManager bm(storage,&sblock);
+        bm.mkfs();
+        // a free goal is taken as is, a used one moves to the next free block
+        EXPECT_EQ(bm.allocate_dblock(600),600);
+        EXPECT_EQ(bm.allocate_dblock(600),601);
+        EXPECT_EQ(bm.allocate_dblock(1299),1299);
+        // nothing free after the goal, fall back to the lowest
+        EXPECT_EQ(bm.allocate_dblock(1299),11);
+        // out of range goals are ignored
+        EXPECT_EQ(bm.allocate_dblock(5),12);
+
+        // extend from the goal, then continue best fit: [602,1299) has 697 blocks
+        std::vector<extent> es = bm.allocate_dblocks(700,602);
+        ASSERT_EQ(es.size(),2);
+        EXPECT_EQ(es[0].start,602);
+        EXPECT_EQ(es[0].len,697);
+        EXPECT_EQ(es[1].len,3);
+
+        // a used goal takes the first large enough extent after it
+        for(BlockID i=1000;i<1003;i++) {
+            bm.free_dblock(i);
+        }
+        for(BlockID i=1100;i<1110;i++) {
+            bm.free_dblock(i);
+        }
+        es = bm.allocate_dblocks(5,900);
+        ASSERT_EQ(es.size(),1);
+        EXPECT_EQ(es[0].start,1100);
+    }
+
+    TEST_F(BitmapBlockTest,LazyMkfs) {
+        // 4 bitmap blocks, only the first one is written by mkfs
+        init(10 + 4 * BitmapBlockManager::nr_blocks_per_bitmap_block);
+        Block junk;
+        std::memset(junk.data,0xff,config::block_size);
+        for(BlockID i=10;i<14;i++) {
+            storage->write_block(i,junk.data);
+        }
+        const BlockID last = 10 + 3 * BitmapBlockManager::nr_blocks_per_bitmap_block;
+        {
+            BitmapBlockManager bm(storage,&sblock);
+            bm.mkfs(true);
+            EXPECT_EQ(sblock.s_lazy_dblock,11);
+            EXPECT_EQ(bm.get_nr_free_blocks(),sblock.nr_dblock - 4);
+            Block bl;
+            storage->read_block(12,bl.data);
+            EXPECT_EQ(bl.fl_entry[0],junk.fl_entry[0]);
+
+            // a bit in the third bitmap block initializes the second one as well
+            EXPECT_EQ(bm.allocate_dblock(last - 1),last - 1);
+            EXPECT_EQ(sblock.s_lazy_dblock,13);
+            storage->read_block(11,bl.data);
+            EXPECT_EQ(bl.fl_entry[0],0);
+        }
+        // the last bitmap block is still lazy, so it reads as all free
+        super_block sb;
+        storage->read_block(0,sb.data);
+        EXPECT_EQ(sb.s_lazy_dblock,13);
+        BitmapBlockManager bm(storage,&sb);
+        EXPECT_EQ(bm.get_nr_free_blocks(),sb.nr_dblock - 5);
+        EXPECT_EQ(bm.allocate_dblock(last - 1),last);
+        EXPECT_EQ(bm.allocate_dblock(),14);
+    }
+};
@@ -0,0 +1,62 @@
+#include <iostream>
+#include <cstring>
+#include <gtest/gtest.h>
+#include "utils/log_utils.h"
+#include "storage/memory_storage.h"
+#include "block/block_pool.h"
+#include "block/block.h"
+
+namespace solid {
+    GTEST_TEST(BlockPoolTest,PinAndWrite) {
+        BlockID nr_blocks = 16;
+        MemoryStorage* ms = new MemoryStorage(nr_blocks);
+        uint8_t buffer[config::block_size];
+        std::memset(buffer,7,config::block_size);
+        ms->write_block(3,buffer);
+        {
+            BlockPool pool(ms,2);
+            BlockRef r1 = pool.get(3);
+            BlockRef r2 = pool.get(3);
+            EXPECT_EQ(&*r1,&*r2);
+            EXPECT_EQ(r1->data[0],7);
+            EXPECT_EQ(pool.size(),1);
+
+            // seen through the other reference, and written through to the storage
+            r1->data[0] = 9;
+            r1.mark_dirty();
+            EXPECT_EQ(r2->data[0],9);
+            ms->read_block(3,buffer);
+            EXPECT_EQ(buffer[0],9);
+
+            // a fresh block isn't read
+            BlockRef r3 = pool.get(4,true);
+            EXPECT_EQ(r3->data[0],0);
+
+            // the pinned ones stay, only 2 released blocks are kept
+            BlockRef r4 = pool.get(5);
+            BlockRef r5 = pool.get(6);
+            r3.release();
+            r4.release();
+            r5.release();
+            EXPECT_EQ(pool.size(),3);
+            EXPECT_FALSE(r3);
+
+            // a freed block is read again once it's forgotten
+            r1.release();
+            r2.release();
+            pool.forget(3);
+            std::memset(buffer,5,config::block_size);
+            ms->write_block(3,buffer);
+            BlockRef r6 = pool.get(3);
+            EXPECT_EQ(r6->data[0],5);
+
+            // a block allocated again drops what the pool kept of it
+            r6->data[0] = 9;
+            r6.mark_dirty();
+            r6.release();
+            BlockRef r7 = pool.get(3,true);
+            EXPECT_EQ(r7->data[0],0);
+        }
+        delete ms;
+    }
+};
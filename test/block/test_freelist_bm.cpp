@@ -1,4 +1,8 @@
+#include <algorithm>
 #include <iostream>
+#include <cstring>
+#include <set>
+#include <thread>
 #include <gtest/gtest.h>
 #include "utils/log_utils.h"
 #include "utils/fs_exception.h"
@@ -193,3 +197,222 @@ namespace solid {
         }
     }
 };
+
+namespace solid {
+    class FreeListCheckpointTest : public testing::Test {
+    protected:
+        const static BlockID nr_block = 1300;
+        MemoryStorage storage{nr_block};
+
+        void SetUp() {
+            super_block sblock;
+            std::memset(sblock.data,0,config::block_size);
+            sblock.nr_block = nr_block;
+            sblock.s_iblock = 1;
+            sblock.nr_iblock = 9;
+            sblock.s_dblock = 10;
+            sblock.nr_dblock = nr_block - 10;
+            storage.write_block(0,sblock.data);
+        }
+
+        super_block on_disk() {
+            super_block sb;
+            storage.read_block(0,sb.data);
+            return sb;
+        }
+    };
+
+    TEST_F(FreeListCheckpointTest,Checkpoint) {
+        FreeListBlockManager fbm(&storage,nullptr,true);
+        fbm.mkfs();
+        EXPECT_EQ(1,on_disk().clean);
+        EXPECT_EQ(nr_block - 10,on_disk().nr_free_dblock);
+
+        // the whole first group, so that the head moves
+        BlockID delta = FreeListBlockManager::nr_blocks_per_group;
+        for(BlockID i=0;i<delta+1;i++) {
+            fbm.allocate_dblock();
+        }
+        EXPECT_EQ(nr_block - 10 - delta - 1,fbm.get_nr_free_blocks());
+        super_block sb = on_disk();
+        EXPECT_EQ(0,sb.clean);
+        EXPECT_EQ(10,sb.h_dblock);
+
+        fbm.sync();
+        sb = on_disk();
+        EXPECT_EQ(1,sb.clean);
+        EXPECT_EQ(10 + delta,sb.h_dblock);
+        EXPECT_EQ(nr_block - 10 - delta - 1,sb.nr_free_dblock);
+        Block bl;
+        storage.read_block(10 + delta,bl.data);
+        EXPECT_EQ(0,bl.fl_entry[1]);
+        EXPECT_EQ(10 + delta + 2,bl.fl_entry[2]);
+
+        // the synced state is picked up by a new manager
+        FreeListBlockManager fbm2(&storage,nullptr,true);
+        EXPECT_EQ(fbm.get_nr_free_blocks(),fbm2.get_nr_free_blocks());
+        EXPECT_EQ(fbm.allocate_dblock(),fbm2.allocate_dblock());
+    }
+
+    // the block writes and the sync barriers which reach the storage, in order
+    class OrderedStorage: public Storage {
+    public:
+        Storage* inner;
+        // the ids of the written blocks, -1 for a barrier
+        std::vector<int64_t> log;
+
+        OrderedStorage(Storage* inner) : inner(inner) {};
+        void read_block(BlockID id, uint8_t* dst) { inner->read_block(id,dst); }
+        void write_block(BlockID id, const uint8_t* src) { log.push_back(id); inner->write_block(id,src); }
+        void sync() { log.push_back(-1); }
+    };
+
+    TEST_F(FreeListCheckpointTest,Barrier) {
+        OrderedStorage os(&storage);
+        FreeListBlockManager fbm(&os,nullptr,true);
+        fbm.mkfs();
+        for(BlockID i=0;i<FreeListBlockManager::nr_blocks_per_group + 1;i++) {
+            fbm.allocate_dblock();
+        }
+        os.log.clear();
+        fbm.sync();
+        // the head group is durable before the clean super block is written, which is durable too
+        auto sb = std::find(os.log.begin(),os.log.end(),0);
+        ASSERT_NE(sb,os.log.end());
+        ASSERT_NE(sb,os.log.begin());
+        EXPECT_EQ(-1,*(sb - 1));
+        EXPECT_EQ(10 + FreeListBlockManager::nr_blocks_per_group,*(sb - 2));
+        ASSERT_NE(sb + 1,os.log.end());
+        EXPECT_EQ(-1,*(sb + 1));
+    }
+
+    TEST_F(FreeListCheckpointTest,Rebuild) {
+        FreeListBlockManager fbm(&storage,nullptr,true);
+        fbm.mkfs();
+        std::vector<BlockID> in_use;
+        for(BlockID i=0;i<700;i++) {
+            in_use.push_back(fbm.allocate_dblock());
+        }
+        // the head group on the storage is stale, the blocks in use are rebuilt from the caller
+        FreeListBlockManager fbm2(&storage,nullptr,true);
+        EXPECT_EQ(0,on_disk().clean);
+        fbm2.rebuild(in_use);
+        EXPECT_EQ(1,on_disk().clean);
+        EXPECT_EQ(nr_block - 10 - 700,fbm2.get_nr_free_blocks());
+
+        std::set<BlockID> used(in_use.begin(),in_use.end());
+        for(BlockID i=0;i<nr_block - 10 - 700;i++) {
+            BlockID b = fbm2.allocate_dblock();
+            EXPECT_GE(b,10);
+            EXPECT_TRUE(used.insert(b).second) << b << " allocated twice";
+        }
+        EXPECT_THROW(fbm2.allocate_dblock(),fs_exception);
+        for(auto b : in_use) {
+            fbm2.free_dblock(b);
+        }
+        EXPECT_EQ(700,fbm2.get_nr_free_blocks());
+    }
+};
+
+namespace solid {
+    TEST_F(FreeListCheckpointTest,ThreadCache) {
+        FreeListBlockManager fbm(&storage,nullptr,true,16,4);
+        fbm.mkfs();
+        const BlockID nr_free = nr_block - 10;
+        std::vector<std::vector<BlockID>> allocated(8);
+        std::vector<std::thread> threads;
+        for(int t=0;t<8;t++) {
+            threads.emplace_back([&fbm,&allocated,t](){
+                // allocate and free some, so that blocks move between the shards and the list
+                for(int i=0;i<200;i++) {
+                    BlockID b = fbm.allocate_dblock();
+                    if(i % 4 == 3) {
+                        fbm.free_dblock(b);
+                    } else {
+                        allocated[t].push_back(b);
+                    }
+                }
+            });
+        }
+        for(auto& t : threads) {
+            t.join();
+        }
+        std::set<BlockID> used;
+        for(auto& v : allocated) {
+            for(auto b : v) {
+                EXPECT_TRUE(used.insert(b).second) << b << " allocated twice";
+            }
+        }
+        EXPECT_EQ(nr_free - used.size(),fbm.get_nr_free_blocks());
+
+        // the cached blocks go back to the list at the checkpoint
+        fbm.sync();
+        EXPECT_EQ(nr_free - used.size(),on_disk().nr_free_dblock);
+
+        // the rest can still be allocated, even if some of them sit in another shard
+        const uint64_t nr_left = nr_free - used.size();
+        for(BlockID i=0;i<nr_left;i++) {
+            EXPECT_TRUE(used.insert(fbm.allocate_dblock()).second);
+        }
+        EXPECT_THROW(fbm.allocate_dblock(),fs_exception);
+    }
+};
+
+namespace solid {
+    TEST_F(FreeListCheckpointTest,Goal) {
+        FreeListBlockManager fbm(&storage,nullptr);
+        fbm.mkfs();
+        // the head group holds [11, 521], take the closest to the goal
+        EXPECT_EQ(fbm.allocate_dblock(100),100);
+        EXPECT_EQ(fbm.allocate_dblock(100),99);
+        EXPECT_EQ(fbm.allocate_dblock(1000),521);
+        EXPECT_EQ(fbm.allocate_dblock(),11);
+        std::vector<extent> es = fbm.allocate_dblocks(10,200);
+        ASSERT_EQ(es.size(),1);
+        EXPECT_EQ(es[0].start,200);
+        EXPECT_EQ(es[0].len,10);
+    }
+
+    TEST_F(FreeListCheckpointTest,LazyMkfs) {
+        // junk where the groups go, a lazy mkfs leaves it there
+        Block junk;
+        std::memset(junk.data,0xff,config::block_size);
+        for(BlockID i=10;i<nr_block;i+=FreeListBlockManager::nr_blocks_per_group) {
+            storage.write_block(i,junk.data);
+        }
+        FreeListBlockManager fbm(&storage,nullptr,true);
+        fbm.mkfs(true);
+        EXPECT_EQ(10,on_disk().s_lazy_dblock);
+        EXPECT_EQ(nr_block - 10,fbm.get_nr_free_blocks());
+        Block bl;
+        storage.read_block(10,bl.data);
+        EXPECT_EQ(junk.fl_entry[0],bl.fl_entry[0]);
+
+        // the same order as an eager mkfs: [11, 521], 10, then the next group
+        for(BlockID i=11;i<522;i++) {
+            EXPECT_EQ(i,fbm.allocate_dblock());
+        }
+        EXPECT_EQ(10,fbm.allocate_dblock());
+        EXPECT_EQ(523,fbm.allocate_dblock());
+        fbm.sync();
+        EXPECT_EQ(1034,on_disk().s_lazy_dblock);
+        storage.read_block(522,bl.data);
+        EXPECT_EQ(1034,bl.fl_entry[0]);
+        EXPECT_EQ(0,bl.fl_entry[1]);
+        EXPECT_EQ(524,bl.fl_entry[2]);
+
+        // a new manager initializes the last group, which is cut at the end of the storage
+        FreeListBlockManager fbm2(&storage,nullptr,true);
+        std::set<BlockID> used;
+        const uint64_t nr_left = fbm2.get_nr_free_blocks();
+        EXPECT_EQ(nr_block - 10 - 513,nr_left);
+        for(uint64_t i=0;i<nr_left;i++) {
+            BlockID id = fbm2.allocate_dblock();
+            EXPECT_TRUE(id >= 522 && id < nr_block && id != 523) << id;
+            EXPECT_TRUE(used.insert(id).second);
+        }
+        EXPECT_THROW(fbm2.allocate_dblock(),fs_exception);
+        fbm2.sync();
+        EXPECT_EQ(0,on_disk().s_lazy_dblock);
+    }
+};
@@ -0,0 +1,75 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include "cache/block_cache.h"
+#include "storage/memory_storage.h"
+#include "block/block.h"
+#include "utils/log_utils.h"
+#include <gtest/gtest.h>
+
+namespace solid {
+    GTEST_TEST(BlockCacheTest,HitMiss) {
+        MemoryStorage* ms = new MemoryStorage(64);
+        BlockCache cache(ms,16,false,1);
+        uint8_t buffer[config::block_size];
+        uint8_t buffer2[config::block_size];
+        std::memset(buffer,7,config::block_size);
+
+        // write through, and the written block is cached
+        cache.write_block(5,buffer);
+        ms->read_block(5,buffer2);
+        EXPECT_EQ(buffer2[0],7);
+        cache.read_block(5,buffer2);
+        EXPECT_EQ(0,std::memcmp(buffer,buffer2,config::block_size));
+        cache.read_block(6,buffer2);
+        cache.read_block(6,buffer2);
+        cache_stats st = cache.stats();
+        EXPECT_EQ(st.hits,2);
+        EXPECT_EQ(st.misses,1);
+    }
+
+    GTEST_TEST(BlockCacheTest,ScanResistance) {
+        MemoryStorage* ms = new MemoryStorage(1024);
+        BlockCache cache(ms,16,false,1);
+        uint8_t buffer[config::block_size];
+
+        // referenced again after leaving A1in, so block 0 is promoted to Am
+        cache.read_block(0,buffer);
+        for(BlockID i=1;i<=16;i++) {
+            cache.read_block(i,buffer);
+        }
+        cache.read_block(0,buffer);
+        // a long cold scan
+        for(BlockID i=100;i<1000;i++) {
+            cache.read_block(i,buffer);
+        }
+        uint64_t hits = cache.stats().hits;
+        cache.read_block(0,buffer);
+        EXPECT_EQ(cache.stats().hits,hits+1);
+    }
+
+    GTEST_TEST(BlockCacheTest,WriteBack) {
+        MemoryStorage* ms = new MemoryStorage(64);
+        BlockCache cache(ms,4,true,1);
+        std::vector<Block> src(8);
+        uint8_t buffer[config::block_size];
+        for(BlockID i=0;i<8;i++) {
+            std::memset(src[i].data,(int)i+1,config::block_size);
+            cache.write_block(i,src[i].data);
+        }
+        // the first blocks are evicted and written back, the last ones are still dirty
+        ms->read_block(0,buffer);
+        EXPECT_EQ(buffer[0],1);
+        ms->read_block(7,buffer);
+        EXPECT_EQ(buffer[0],0);
+        cache.read_block(7,buffer);
+        EXPECT_EQ(buffer[0],8);
+
+        cache.flush();
+        for(BlockID i=0;i<8;i++) {
+            ms->read_block(i,buffer);
+            EXPECT_EQ(buffer[0],i+1) << "Data Differs at " << i;
+        }
+        EXPECT_EQ(cache.stats().writebacks,8);
+    }
+};
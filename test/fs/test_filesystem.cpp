@@ -1,9 +1,12 @@
 #include <iostream>
 #include <algorithm>
+#include <memory>
+#include <unistd.h>
 #include <gtest/gtest.h>
 #include "utils/log_utils.h"
 #include "storage/memory_storage.h"
 #include "block/freelist_blockmanager.h"
+#include "block/bitmap_blockmanager.h"
 #include "fs/file_system.h"
 #include "inode/inode.h"
 #include "block/block.h"
@@ -29,6 +32,26 @@ namespace solid {
     // this config for write test passed!:w
     //FileSystem* FileSystemTest::fs = new FileSystem(10 + 512 + 512 * 512 + 512 * 512 ,9);
     FileSystem* FileSystemTest::fs = new FileSystem(10 + 512 + 512 * 512,9);
+
+    // a fresh file system (in memory unless path is given) with the regular file inode 1 created
+    std::unique_ptr<FileSystem> mount_fs(const mount_options& opts=mount_options(),BlockID nr_blocks=4096,
+                                         const std::string& path="") {
+        std::unique_ptr<FileSystem> p(new FileSystem(nr_blocks,9,path,opts));
+        p->mkfs();
+        INode file = INode::get_inode(1,INodeType::REGULAR,0644);
+        p->im->write_inode(1,file);
+        return p;
+    }
+
+    // n bytes which don't repeat at the block size
+    std::vector<uint8_t> pattern_bytes(uint64_t n) {
+        std::vector<uint8_t> v(n);
+        for(uint64_t i=0;i<n;i++) {
+            v[i] = i % 251;
+        }
+        return v;
+    }
+
     TEST_F(FileSystemTest,InitTest) {
         super_block sb;
         fs->storage->read_block(0,sb.data);
@@ -411,4 +434,373 @@ namespace solid {
         // re-allocate datablocks again
     }
 
+
+    TEST(FileSystemPreallocTest,StreamingAppend) {
+        mount_options opts;
+        opts.prealloc_blocks = 64;
+        opts.allocator = "bitmap";
+        auto pfs = mount_fs(opts);
+        BitmapBlockManager* bm = (BitmapBlockManager*)pfs->bm;
+        const uint64_t nr_free = bm->get_nr_free_blocks();
+
+        std::vector<uint8_t> src(config::block_size * 2, 'a');
+        std::vector<uint8_t> dst(src.size());
+        // the first append only takes what it needs, the next ones reserve a growing window
+        pfs->write(1,src.data(),src.size(),0);
+        EXPECT_EQ(nr_free - 2,bm->get_nr_free_blocks());
+        pfs->write(1,src.data(),src.size(),src.size());
+        EXPECT_EQ(nr_free - 2 - 16,bm->get_nr_free_blocks());
+        for(uint64_t i=2;i<40;i++) {
+            pfs->write(1,src.data(),src.size(),i * src.size());
+        }
+        INode inode = pfs->im->read_inode(1);
+        EXPECT_EQ(80,inode.block);
+        // the data blocks, and the mapping block placed right after the window
+        std::vector<BlockID> v = pfs->read_dblock_index(inode,0,inode.block);
+        uint64_t runs = 1;
+        for(uint64_t i=1;i<v.size();i++) {
+            runs += v[i] != v[i-1] + 1;
+        }
+        EXPECT_LE(runs,3);
+        EXPECT_LT(bm->get_nr_free_blocks(),nr_free - 81);
+        for(uint64_t i=0;i<40;i++) {
+            EXPECT_EQ(pfs->read(1,dst.data(),dst.size(),i * src.size()),dst.size());
+            EXPECT_EQ(src,dst);
+        }
+
+        // the rest of the window is given back
+        pfs->release_prealloc(1);
+        EXPECT_EQ(nr_free - 81,bm->get_nr_free_blocks());
+        // and so is it by a truncate
+        pfs->write(1,src.data(),src.size(),inode.size);
+        pfs->write(1,src.data(),src.size(),inode.size + src.size());
+        pfs->truncate(1,0);
+        EXPECT_EQ(nr_free,bm->get_nr_free_blocks());
+    }
+
+    TEST(FileSystemDelallocTest,DelayedBlocks) {
+        mount_options opts;
+        opts.delalloc_blocks = 64;
+        opts.allocator = "bitmap";
+        auto dfs = mount_fs(opts);
+        INode file = INode::get_inode(2,INodeType::REGULAR,0644);
+        dfs->im->write_inode(2,file);
+        BitmapBlockManager* bm = (BitmapBlockManager*)dfs->bm;
+        const uint64_t nr_free = bm->get_nr_free_blocks();
+
+        // a short-lived file never gets a data block
+        std::vector<uint8_t> src = pattern_bytes(config::block_size * 3 + 100);
+        dfs->write(1,src.data(),src.size(),0);
+        EXPECT_EQ(nr_free,bm->get_nr_free_blocks());
+        EXPECT_EQ(0,dfs->im->read_inode(1).block);
+        EXPECT_EQ(src.size(),dfs->im->read_inode(1).size);
+        std::vector<uint8_t> dst(src.size());
+        EXPECT_EQ(dfs->read(1,dst.data(),dst.size(),0),dst.size());
+        EXPECT_EQ(src,dst);
+        dfs->truncate(1,0);
+        dfs->flush();
+        EXPECT_EQ(nr_free,bm->get_nr_free_blocks());
+
+        // a hole, then a flush maps all the blocks at once, contiguous
+        dfs->write(2,src.data(),src.size(),config::block_size * 5);
+        dfs->flush();
+        INode inode = dfs->im->read_inode(2);
+        EXPECT_EQ(9,inode.block);
+        std::vector<BlockID> v = dfs->read_dblock_index(inode,0,inode.block);
+        for(auto i=1;i<v.size();i++) {
+            EXPECT_EQ(v[i-1] + 1,v[i]);
+        }
+        EXPECT_EQ(nr_free - 9,bm->get_nr_free_blocks());
+        std::vector<uint8_t> zeros(config::block_size * 5,0);
+        std::vector<uint8_t> hole(zeros.size(),1);
+        EXPECT_EQ(dfs->read(2,hole.data(),hole.size(),0),hole.size());
+        EXPECT_EQ(zeros,hole);
+        EXPECT_EQ(dfs->read(2,dst.data(),dst.size(),config::block_size * 5),dst.size());
+        EXPECT_EQ(src,dst);
+
+        // overwrite the mapped blocks and append past them, more than the limit forces a flush
+        std::vector<uint8_t> big(config::block_size * 100,7);
+        dfs->write(2,big.data(),big.size(),config::block_size * 4);
+        inode = dfs->im->read_inode(2);
+        EXPECT_EQ(104,inode.block);
+        std::vector<uint8_t> out(big.size());
+        EXPECT_EQ(dfs->read(2,out.data(),out.size(),config::block_size * 4),out.size());
+        EXPECT_EQ(big,out);
+    }
+
+    TEST(FileSystemDelallocTest,Reservation) {
+        mount_options opts;
+        opts.delalloc_blocks = 1024;
+        auto dfs = mount_fs(opts,200);
+        INode file = INode::get_inode(2,INodeType::REGULAR,0644);
+        dfs->im->write_inode(2,file);
+        // more than the free blocks fails at write time, not at the flush
+        std::vector<uint8_t> src(config::block_size * 300,3);
+        EXPECT_THROW(dfs->write(1,src.data(),src.size(),0),fs_exception);
+        EXPECT_EQ(0,dfs->im->read_inode(1).size);
+
+        // what is set aside for one file (and its mapping block) is not left for another
+        EXPECT_EQ(dfs->write(1,src.data(),config::block_size * 150,0),config::block_size * 150);
+        EXPECT_THROW(dfs->write(2,src.data(),config::block_size * 50,0),fs_exception);
+        dfs->sync();
+        EXPECT_EQ(150,dfs->im->read_inode(1).block);
+        std::vector<uint8_t> dst(config::block_size * 150);
+        EXPECT_EQ(dfs->read(1,dst.data(),dst.size(),0),dst.size());
+        EXPECT_TRUE(std::equal(dst.begin(),dst.end(),src.begin()));
+    }
+
+    TEST(FileSystemStatfsTest,Counters) {
+        mount_options opts;
+        opts.prealloc_blocks = 64;
+        auto sfs = mount_fs(opts);
+        struct statvfs st;
+        sfs->statfs(&st);
+        EXPECT_EQ((uint64_t)config::block_size,st.f_bsize);
+        EXPECT_EQ(sfs->sb.nr_dblock,st.f_blocks);
+        // the root directory takes a block, the root and file 1 take an inode each
+        EXPECT_EQ(sfs->sb.nr_dblock - 1,st.f_bfree);
+        EXPECT_EQ(st.f_bfree,st.f_bavail);
+        EXPECT_EQ(sfs->im->get_nr_inodes(),st.f_files);
+        EXPECT_EQ(st.f_files - 2,st.f_ffree);
+
+        std::vector<uint8_t> src(config::block_size * 2, 'a');
+        sfs->write(1,src.data(),src.size(),0);
+        sfs->write(1,src.data(),src.size(),src.size());
+        // the window reserved by the second append is still free
+        sfs->statfs(&st);
+        EXPECT_EQ(sfs->sb.nr_dblock - 5,st.f_bfree);
+        EXPECT_EQ(st.f_files - 2,st.f_ffree);
+        sfs->release_prealloc(1);
+        sfs->statfs(&st);
+        EXPECT_EQ(sfs->sb.nr_dblock - 5,st.f_bfree);
+    }
+
+    TEST(FileSystemExtentTest,Mapping) {
+        mount_options opts;
+        opts.extents = true;
+        opts.allocator = "bitmap";
+        auto efs = mount_fs(opts);
+        BitmapBlockManager* bm = (BitmapBlockManager*)efs->bm;
+        const uint64_t nr_free = bm->get_nr_free_blocks();
+
+        // a contiguous file is one extent in the inode
+        std::vector<uint8_t> src = pattern_bytes(config::block_size * 100);
+        efs->write(1,src.data(),src.size(),0);
+        INode inode = efs->im->read_inode(1);
+        EXPECT_TRUE(FileSystem::is_extent_mapped(inode));
+        EXPECT_EQ(0,inode.e_header.depth);
+        EXPECT_EQ(1,inode.e_header.nr);
+        EXPECT_EQ(100,inode.e_extent[0].len);
+        std::vector<uint8_t> dst(config::block_size * 10);
+        EXPECT_EQ(efs->read(1,dst.data(),dst.size(),config::block_size * 37),dst.size());
+        EXPECT_TRUE(std::equal(dst.begin(),dst.end(),src.begin() + config::block_size * 37));
+        efs->truncate(1,0);
+        EXPECT_EQ(nr_free,bm->get_nr_free_blocks());
+
+        // with every other block taken, each block of a file is an extent of its own
+        std::vector<BlockID> taken;
+        while(!FileSystemTest::existException([&](){ taken.push_back(bm->allocate_dblock()); })) {
+        }
+        for(auto i=0;i<taken.size();i+=2) {
+            bm->free_dblock(taken[i]);
+        }
+        std::vector<uint8_t> bl(config::block_size);
+        auto append = [&](uint64_t from,uint64_t to) {
+            for(uint64_t i=from;i<to;i++) {
+                std::memset(bl.data(),i % 256,bl.size());
+                efs->write(1,bl.data(),bl.size(),i * bl.size());
+            }
+        };
+        // they move to a leaf block, and back into the inode when the file shrinks
+        append(0,10);
+        inode = efs->im->read_inode(1);
+        EXPECT_TRUE(FileSystem::is_extent_mapped(inode));
+        EXPECT_EQ(1,inode.e_header.depth);
+        // the leaf stays until the extents fit in the inode with room to spare
+        efs->truncate(1,config::block_size * 6);
+        append(6,7);
+        efs->truncate(1,config::block_size * 5);
+        inode = efs->im->read_inode(1);
+        EXPECT_EQ(1,inode.e_header.depth);
+        efs->truncate(1,config::block_size * 3);
+        inode = efs->im->read_inode(1);
+        EXPECT_EQ(0,inode.e_header.depth);
+        EXPECT_EQ(3,inode.e_header.nr);
+        // too many of them for the leaf block, the file is remapped by the tree
+        append(3,400);
+        inode = efs->im->read_inode(1);
+        EXPECT_FALSE(FileSystem::is_extent_mapped(inode));
+        EXPECT_EQ(400,inode.block);
+        for(uint64_t i=0;i<400;i++) {
+            EXPECT_EQ(efs->read(1,bl.data(),bl.size(),i * bl.size()),bl.size());
+            EXPECT_EQ(i % 256,bl[0]);
+        }
+        efs->truncate(1,0);
+        for(auto i=1;i<taken.size();i+=2) {
+            bm->free_dblock(taken[i]);
+        }
+        EXPECT_EQ(nr_free,bm->get_nr_free_blocks());
+    }
+
+    TEST(FileSystemCursorTest,IndexBlocks) {
+        char name[] = "/tmp/solidfs_fs_XXXXXX";
+        int fd = mkstemp(name);
+        ASSERT_GE(fd,0);
+        ASSERT_EQ(ftruncate(fd,8192 * config::block_size),0);
+        close(fd);
+        {
+            mount_options opts;
+            opts.allocator = "bitmap";
+            auto cfs = mount_fs(opts,8192,name);
+
+            // past the single indirect block, into the double indirect ones
+            const uint64_t n = 1200;
+            std::vector<uint8_t> bl(config::block_size);
+            auto check = [&](uint64_t from,uint64_t to,int seed) {
+                std::vector<uint8_t> dst(config::block_size * 64);
+                for(uint64_t i=from;i<to;i+=64) {
+                    uint64_t cnt = std::min<uint64_t>(64,to - i);
+                    EXPECT_EQ(cfs->read(1,dst.data(),cnt * config::block_size,i * config::block_size),cnt * config::block_size);
+                    for(uint64_t j=0;j<cnt;j++) {
+                        EXPECT_EQ((i + j + seed) % 251,dst[j * config::block_size]);
+                    }
+                }
+            };
+            for(uint64_t i=0;i<n;i++) {
+                std::memset(bl.data(),i % 251,bl.size());
+                cfs->write(1,bl.data(),bl.size(),i * bl.size());
+            }
+            check(0,n,0);
+
+            // the top double indirect block comes from the cursor, not the storage
+            INode inode = cfs->im->read_inode(1);
+            Block saved, zero;
+            std::memset(zero.data,0,config::block_size);
+            cfs->storage->read_block(inode.p_block[11],saved.data);
+            cfs->storage->write_block(inode.p_block[11],zero.data);
+            check(1000,1001,0);
+            cfs->storage->write_block(inode.p_block[11],saved.data);
+
+            // the mapping blocks freed by a truncate are reused by the appends after it
+            cfs->truncate(1,config::block_size * 500);
+            for(uint64_t i=500;i<n;i++) {
+                std::memset(bl.data(),(i + 7) % 251,bl.size());
+                cfs->write(1,bl.data(),bl.size(),i * bl.size());
+            }
+            check(0,500,0);
+            check(500,n,7);
+            cfs->release(1);
+            check(0,500,0);
+            check(500,n,7);
+        }
+        unlink(name);
+    }
+
+    TEST(FileSystemWriteTest,PartialBlocks) {
+        auto wfs = mount_fs();
+
+        // what the file should hold, a new block is zero outside of what's written
+        std::vector<uint8_t> ref(config::block_size * 6,0);
+        auto write = [&](uint64_t offset,uint64_t size,uint8_t c) {
+            std::vector<uint8_t> src(size,c);
+            EXPECT_EQ(wfs->write(1,src.data(),size,offset),size);
+            std::memset(ref.data() + offset,c,size);
+        };
+        write(50,config::block_size * 3 + 100,1);
+        // whole blocks, then partial heads and tails of the mapped blocks
+        write(config::block_size,config::block_size * 2,2);
+        write(config::block_size - 10,20,3);
+        write(config::block_size * 2 + 7,config::block_size * 3,4);
+        write(config::block_size * 5 + 10,1,5);
+
+        std::vector<uint8_t> dst(ref.size());
+        EXPECT_EQ(wfs->read(1,dst.data(),dst.size(),0),config::block_size * 5 + 11);
+        dst.resize(config::block_size * 5 + 11);
+        ref.resize(dst.size());
+        EXPECT_EQ(ref,dst);
+    }
+
+    TEST(FileSystemWriteTest,GapBlocks) {
+        for(auto allocator : {"freelist","bitmap"}) {
+            mount_options opts;
+            opts.allocator = allocator;
+            auto wfs = mount_fs(opts);
+            std::vector<uint8_t> src(config::block_size * 8,'S');
+            wfs->write(1,src.data(),src.size(),0);
+            wfs->unlink(1);
+
+            // the blocks skipped by a write past the end are zeros, not what a deleted file left
+            INode file = INode::get_inode(1,INodeType::REGULAR,0644);
+            wfs->im->write_inode(1,file);
+            uint8_t c = 'T';
+            wfs->write(1,&c,1,config::block_size * 6);
+            std::vector<uint8_t> dst(config::block_size * 6 + 1);
+            EXPECT_EQ(wfs->read(1,dst.data(),dst.size(),0),dst.size());
+            std::vector<uint8_t> ref(dst.size(),0);
+            ref.back() = 'T';
+            EXPECT_EQ(ref,dst);
+        }
+    }
+
+    TEST(FileSystemReadTest,Spans) {
+        auto rfs = mount_fs();
+        std::vector<uint8_t> src = pattern_bytes(config::block_size * 5 + 123);
+        rfs->write(1,src.data(),src.size(),0);
+
+        // aligned, unaligned on either side, within a block, and past the end of the file
+        const uint64_t bs = config::block_size;
+        std::vector<std::pair<uint64_t,uint64_t>> spans = {
+            {0,bs * 2},{bs,bs * 3},{1,bs * 2},{bs - 1,2},{bs + 10,bs * 3 - 20},{100,50},{bs * 4,bs * 2}
+        };
+        for(auto& sp : spans) {
+            std::vector<uint8_t> dst(sp.second,0xff);
+            uint64_t n = std::min<uint64_t>(sp.second,src.size() - sp.first);
+            EXPECT_EQ(rfs->read(1,dst.data(),sp.second,sp.first),n);
+            EXPECT_TRUE(std::equal(dst.begin(),dst.begin() + n,src.begin() + sp.first));
+        }
+    }
+
+    TEST(FileSystemTruncateTest,Ranges) {
+        const uint64_t bs = config::block_size;
+        const uint64_t factor = bs / sizeof(BlockID);
+        // the mapping blocks of a tree-mapped file of n blocks
+        auto nr_mblocks = [&](uint64_t n) -> uint64_t {
+            uint64_t m = n > 10 ? 1 : 0;
+            if(n > 10 + factor) {
+                m += 1 + (n - 10 - factor + factor - 1) / factor;
+            }
+            return m;
+        };
+        for(auto allocator : {"freelist","bitmap"}) {
+            for(bool extents : {false,true}) {
+                mount_options opts;
+                opts.allocator = allocator;
+                opts.extents = extents;
+                auto tfs = mount_fs(opts);
+                const uint64_t nr_free = tfs->bm->get_nr_free_blocks();
+
+                std::vector<uint8_t> src = pattern_bytes(bs * 700);
+                tfs->write(1,src.data(),src.size(),0);
+                // within the double indirect range, into the single one, into the direct blocks
+                for(uint64_t n : {600,300,5}) {
+                    tfs->truncate(1,bs * n - 1);
+                    INode inode = tfs->im->read_inode(1);
+                    EXPECT_EQ(inode.block,n);
+                    // a fragmented file may keep its extents in a leaf block
+                    uint64_t used = extents ? n + inode.e_header.depth : n + nr_mblocks(n);
+                    EXPECT_EQ(tfs->bm->get_nr_free_blocks(),nr_free - used);
+                    std::vector<uint8_t> dst(bs * n);
+                    EXPECT_EQ(tfs->read(1,dst.data(),dst.size(),0),bs * n - 1);
+                    EXPECT_TRUE(std::equal(dst.begin(),dst.end() - 1,src.begin()));
+                }
+                // the file grows again over what was cut
+                tfs->write(1,src.data(),src.size(),0);
+                std::vector<uint8_t> dst(src.size());
+                EXPECT_EQ(tfs->read(1,dst.data(),dst.size(),0),src.size());
+                EXPECT_EQ(src,dst);
+                tfs->unlink(1);
+                EXPECT_EQ(tfs->bm->get_nr_free_blocks(),nr_free);
+            }
+        }
+    }
 };
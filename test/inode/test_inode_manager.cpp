@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cstring>
 #include <gtest/gtest.h>
 #include "utils/log_utils.h"
 #include "utils/fs_exception.h"
@@ -119,4 +120,154 @@ namespace solid {
         im->free_inode(10);
         EXPECT_EQ(im->allocate_inode(),10);
     }
-};
\ No newline at end of file
+
+    class INodeCacheTest : public testing::Test {
+    protected:
+        MemoryStorage* storage;
+        super_block sblock;
+
+        void SetUp() {
+            storage = new MemoryStorage(64);
+            std::memset(sblock.data,0,config::block_size);
+            sblock.nr_block = 64;
+            sblock.s_iblock = 1;
+            sblock.nr_iblock = 4;
+            sblock.s_dblock = 5;
+            sblock.nr_dblock = 59;
+            storage->write_block(0,sblock.data);
+        }
+
+        void TearDown() {
+            delete storage;
+        }
+
+        INode table_inode(INodeID id) {
+            Block bl;
+            storage->read_block(sblock.s_iblock + id / INodeManager::nr_inode_per_block,bl.data);
+            return bl.inode[id % INodeManager::nr_inode_per_block];
+        }
+    };
+
+    TEST_F(INodeCacheTest,WriteThrough) {
+        INodeManager im(storage,&sblock);
+        im.mkfs();
+        INode inode = im.read_inode(3);
+        inode.itype = INodeType::REGULAR;
+        inode.size = 100;
+        im.write_inode(3,inode);
+        EXPECT_EQ(table_inode(3).size,100);
+        EXPECT_EQ(im.allocate_inode(),0);
+    }
+
+    TEST_F(INodeCacheTest,WriteBack) {
+        INodeManager im(storage,&sblock,true);
+        im.mkfs();
+        INode inode = im.read_inode(20);
+        inode.itype = INodeType::REGULAR;
+        inode.size = 100;
+        im.write_inode(20,inode);
+        EXPECT_EQ(im.read_inode(20).size,100);
+        EXPECT_EQ(table_inode(20).itype,INodeType::FREE);
+
+        // the allocation sees the dirty inodes
+        for(INodeID i=0;i<20;i++) {
+            INode n = im.read_inode(i);
+            n.itype = INodeType::DIRECTORY;
+            im.write_inode(i,n);
+        }
+        EXPECT_EQ(im.allocate_inode(),21);
+
+        im.flush();
+        EXPECT_EQ(table_inode(20).size,100);
+        EXPECT_EQ(table_inode(5).itype,INodeType::DIRECTORY);
+    }
+
+    TEST_F(INodeCacheTest,Handle) {
+        // room for one table block only
+        INodeManager im(storage,&sblock,true,INodeManager::nr_inode_per_block);
+        im.mkfs();
+        {
+            INodeHandle h = im.get_inode(1);
+            h->size = 42;
+            h.mark_dirty();
+            // loading other table blocks can't evict the pinned inode
+            for(INodeID i=INodeManager::nr_inode_per_block;i<4*INodeManager::nr_inode_per_block;i++) {
+                im.read_inode(i);
+            }
+            EXPECT_EQ(h->size,42);
+            EXPECT_EQ(table_inode(1).size,0);
+        }
+        // once released, it's written back when evicted
+        im.read_inode(2*INodeManager::nr_inode_per_block);
+        im.read_inode(3*INodeManager::nr_inode_per_block);
+        EXPECT_EQ(table_inode(1).size,42);
+        EXPECT_EQ(im.read_inode(1).size,42);
+    }
+
+    TEST_F(INodeCacheTest,Bitmap) {
+        // the last table block holds the bitmap
+        sblock.nr_ibitmap = INodeManager::bitmap_blocks(sblock.nr_iblock);
+        sblock.s_ibitmap = sblock.s_iblock + sblock.nr_iblock - sblock.nr_ibitmap;
+        EXPECT_EQ(sblock.nr_ibitmap,1);
+        {
+            INodeManager im(storage,&sblock);
+            im.mkfs();
+            const uint64_t nr_inodes = 3 * INodeManager::nr_inode_per_block;
+            EXPECT_EQ(im.get_nr_inodes(),nr_inodes);
+            EXPECT_EQ(im.get_nr_free_inodes(),nr_inodes);
+            for(INodeID i=0;i<nr_inodes;i++) {
+                INodeID id = im.allocate_inode();
+                EXPECT_EQ(id,i);
+                INode inode = im.read_inode(id);
+                inode.itype = INodeType::REGULAR;
+                im.write_inode(id,inode);
+            }
+            EXPECT_EQ(im.get_nr_free_inodes(),0);
+            EXPECT_THROW(im.allocate_inode(),fs_exception);
+            im.free_inode(40);
+            im.free_inode(7);
+            EXPECT_EQ(im.allocate_inode(),7);
+        }
+        // the bitmap and the count survive a remount
+        super_block sb;
+        storage->read_block(0,sb.data);
+        INodeManager im(storage,&sb);
+        EXPECT_EQ(sb.nr_free_inode,2);
+        EXPECT_EQ(im.allocate_inode(),7);
+    }
+
+    TEST_F(INodeCacheTest,LazyMkfs) {
+        // junk in the table, a lazy mkfs leaves it there
+        Block junk;
+        std::memset(junk.data,0xff,config::block_size);
+        for(BlockID i=1;i<5;i++) {
+            storage->write_block(i,junk.data);
+        }
+        const INodeID id = 2 * INodeManager::nr_inode_per_block + 1;
+        {
+            INodeManager im(storage,&sblock);
+            im.mkfs(true);
+            EXPECT_EQ(sblock.s_lazy_iblock,1);
+            EXPECT_EQ(im.read_inode(id).itype,INodeType::FREE);
+            EXPECT_EQ(im.allocate_inode(),0);
+
+            // writing the third table block initializes the first two as well
+            INode inode = im.read_inode(id);
+            inode.itype = INodeType::REGULAR;
+            inode.size = 100;
+            im.write_inode(id,inode);
+            EXPECT_EQ(sblock.s_lazy_iblock,4);
+            EXPECT_EQ(table_inode(id).size,100);
+            EXPECT_EQ(table_inode(id - 1).itype,INodeType::FREE);
+            EXPECT_EQ(table_inode(0).itype,INodeType::FREE);
+        }
+        // the last table block is still lazy
+        super_block sb;
+        storage->read_block(0,sb.data);
+        EXPECT_EQ(sb.s_lazy_iblock,4);
+        INodeManager im(storage,&sb);
+        EXPECT_EQ(im.get_nr_free_inodes(),im.get_nr_inodes() - 1);
+        EXPECT_EQ(im.read_inode(id).size,100);
+        EXPECT_EQ(im.read_inode(3 * INodeManager::nr_inode_per_block).itype,INodeType::FREE);
+    }
+};
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "storage/memory_storage.h"
+#include "storage/discard_storage.h"
+#include "block/block.h"
+#include "utils/log_utils.h"
+#include <gtest/gtest.h>
+
+namespace solid {
+    GTEST_TEST(DiscardStorageTest,MergeCancel) {
+        BlockID nr_blocks = 16;
+        MemoryStorage* ms = new MemoryStorage(nr_blocks);
+        // never drained by the timer during the test
+        DiscardStorage ds(ms,0,3600 * 1000);
+        ds.discard(2,2);
+        ds.discard(5,2);
+        // fills the gap, [2,7) becomes one range
+        ds.discard(4,1);
+        ds.discard(3,2);
+        EXPECT_EQ(ds.nr_queued(),5);
+
+        // a write takes its block out of the queue
+        uint8_t buffer[config::block_size];
+        std::memset(buffer,7,config::block_size);
+        ds.write_block(4,buffer);
+        ds.write_blocks({2,9},{buffer,buffer});
+        EXPECT_EQ(ds.nr_queued(),3);
+    }
+
+    GTEST_TEST(DiscardStorageTest,Background) {
+        BlockID nr_blocks = 1024;
+        MemoryStorage* ms = new MemoryStorage(nr_blocks);
+        DiscardStorage ds(ms,0,10);
+        uint8_t buffer[config::block_size];
+        uint8_t buffer2[config::block_size];
+        std::memset(buffer,7,config::block_size);
+        for(BlockID i=0;i<8;i++) {
+            ds.write_block(i,buffer);
+        }
+        ds.discard(2,4);
+        // reused before or after the discard, it keeps the new content either way
+        std::memset(buffer,9,config::block_size);
+        ds.write_block(3,buffer);
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while(ds.nr_queued() > 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        EXPECT_EQ(ds.nr_queued(),0);
+        // the queue is empty once the last range is taken, wait for the discard itself
+        deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        do {
+            ds.read_block(5,buffer2);
+        } while(buffer2[0] != 0 && std::chrono::steady_clock::now() < deadline);
+        EXPECT_EQ(buffer2[0],0);
+        ds.read_block(2,buffer2);
+        EXPECT_EQ(buffer2[0],0);
+        ds.read_block(3,buffer2);
+        EXPECT_EQ(buffer2[0],9);
+        ds.read_block(6,buffer2);
+        EXPECT_EQ(buffer2[0],7);
+    }
+};
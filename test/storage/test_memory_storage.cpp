@@ -1,4 +1,6 @@
 #include <iostream>
+#include <cstring>
+#include <vector>
 #include "storage/memory_storage.h"
 #include "utils/log_utils.h"
 #include <gtest/gtest.h>
@@ -22,4 +24,54 @@ namespace solid {
         }
     }
 
+    GTEST_TEST(StorageTest,ReadWriteBlocks) {
+        BlockID nr_blocks = 10;
+        MemoryStorage* ms = new MemoryStorage(nr_blocks);
+        // 2 runs: [3,4,5] and [8], the buffers of 4 and 5 are adjacent
+        std::vector<BlockID> ids = {3,4,5,8};
+        uint8_t buffer[4][config::block_size];
+        uint8_t buffer2[4][config::block_size];
+        for(int i=0;i<4;i++) {
+            std::memset(buffer[i],i+1,config::block_size);
+        }
+
+        ms->write_blocks(ids,{buffer[0],buffer[1],buffer[2],buffer[3]});
+        ms->read_blocks(ids,{buffer2[3],buffer2[1],buffer2[2],buffer2[0]});
+        EXPECT_EQ(0,std::memcmp(buffer[0],buffer2[3],config::block_size));
+        EXPECT_EQ(0,std::memcmp(buffer[1],buffer2[1],config::block_size));
+        EXPECT_EQ(0,std::memcmp(buffer[2],buffer2[2],config::block_size));
+        EXPECT_EQ(0,std::memcmp(buffer[3],buffer2[0],config::block_size));
+
+        uint8_t single[config::block_size];
+        ms->read_block(5,single);
+        EXPECT_EQ(single[0],3);
+        delete ms;
+    }
+
+    GTEST_TEST(StorageTest,Sparse) {
+        // the default device size, it shouldn't reserve 8 GB
+        BlockID nr_blocks = 2097253;
+        MemoryStorage ms(nr_blocks,MemoryStorage::HugePage::TRANSPARENT);
+        uint8_t buffer[config::block_size];
+        std::memset(buffer,0xff,config::block_size);
+
+        EXPECT_EQ(ms.allocated_bytes(),0);
+        ms.read_block(nr_blocks-1,buffer);
+        EXPECT_EQ(buffer[0],0);
+        EXPECT_EQ(buffer[config::block_size-1],0);
+
+        // writing zeros to an untouched chunk doesn't allocate it
+        ms.write_block(nr_blocks-1,buffer);
+        EXPECT_EQ(ms.allocated_bytes(),0);
+
+        std::memset(buffer,7,config::block_size);
+        ms.write_block(nr_blocks-1,buffer);
+        ms.write_block(nr_blocks-2,buffer);
+        EXPECT_EQ(ms.allocated_bytes(),MemoryStorage::chunk_size);
+        std::memset(buffer,0,config::block_size);
+        ms.read_block(nr_blocks-2,buffer);
+        EXPECT_EQ(buffer[0],7);
+        ms.read_block(nr_blocks-3,buffer);
+        EXPECT_EQ(buffer[0],0);
+    }
 };
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "storage/mmap_storage.h"
+#include "storage/posix_storage.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <gtest/gtest.h>
+
+namespace solid {
+    class MmapStorageTest : public testing::Test {
+    protected:
+        const static BlockID nr_blocks = 64;
+        std::string path;
+
+        // leave the file empty, the storage should extend it
+        void SetUp() {
+            char name[] = "/tmp/solidfs_storage_XXXXXX";
+            int fd = mkstemp(name);
+            ASSERT_GE(fd,0);
+            close(fd);
+            path = name;
+        }
+
+        void TearDown() {
+            unlink(path.c_str());
+        }
+    };
+
+    TEST_F(MmapStorageTest,WriteRead) {
+        uint8_t buffer[config::block_size];
+        uint8_t buffer2[config::block_size];
+        for(int i=0;i<config::block_size;i++) {
+            buffer[i] = i;
+        }
+        {
+            MmapStorage ms(nr_blocks,path);
+            ms.write_block(nr_blocks-1,buffer);
+            ms.read_block(nr_blocks-1,buffer2);
+            EXPECT_EQ(0,std::memcmp(buffer,buffer2,config::block_size));
+            EXPECT_EQ(0,std::memcmp(buffer,ms.block_ptr(nr_blocks-1),config::block_size));
+            EXPECT_THROW(ms.block_ptr(nr_blocks),fs_error);
+            ms.sync();
+        }
+        // the data should reach the file
+        PosixStorage ps(nr_blocks,path);
+        std::memset(buffer2,0,config::block_size);
+        ps.read_block(nr_blocks-1,buffer2);
+        EXPECT_EQ(0,std::memcmp(buffer,buffer2,config::block_size));
+    }
+
+    TEST_F(MmapStorageTest,SyncError) {
+        MmapStorage ms(nr_blocks,path);
+        // msync fails once the mapping is gone, which must not pass for a durable sync
+        ASSERT_EQ(0,munmap((void*)ms.block_ptr(0),nr_blocks * config::block_size));
+        EXPECT_THROW(ms.sync(),fs_error);
+    }
+};
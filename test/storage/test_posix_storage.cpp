@@ -0,0 +1,127 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <stdlib.h>
+#include "storage/posix_storage.h"
+#include "block/block.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <gtest/gtest.h>
+
+namespace solid {
+    class PosixStorageTest : public testing::Test {
+    protected:
+        const static BlockID nr_blocks = 64;
+        std::string path;
+
+        void SetUp() {
+            char name[] = "/tmp/solidfs_storage_XXXXXX";
+            int fd = mkstemp(name);
+            ASSERT_GE(fd,0);
+            ASSERT_EQ(ftruncate(fd,nr_blocks * config::block_size),0);
+            close(fd);
+            path = name;
+        }
+
+        void TearDown() {
+            unlink(path.c_str());
+        }
+
+        static void write_read(PosixStorage& ps) {
+            uint8_t buffer[config::block_size];
+            uint8_t buffer2[config::block_size];
+
+            for(int i=0;i<config::block_size;i++) {
+                buffer[i] = i;
+            }
+            ps.write_block(3,buffer);
+            ps.read_block(3,buffer2);
+            for(int i=0;i<config::block_size;i++) {
+                EXPECT_EQ(buffer[i],buffer2[i]) << "Data Differs at Block 3";
+            }
+        }
+    };
+
+    TEST_F(PosixStorageTest,WriteRead) {
+        PosixStorage ps(nr_blocks,path);
+        write_read(ps);
+    }
+
+    TEST_F(PosixStorageTest,DirectWriteRead) {
+        // falls back to buffered I/O if the file system doesn't support O_DIRECT
+        PosixStorage ps(nr_blocks,path,true);
+        write_read(ps);
+    }
+
+    TEST_F(PosixStorageTest,OutOfRange) {
+        PosixStorage ps(nr_blocks,path);
+        uint8_t buffer[config::block_size];
+        EXPECT_THROW(ps.read_block(nr_blocks,buffer),fs_error);
+        EXPECT_THROW(ps.write_block(nr_blocks,buffer),fs_error);
+    }
+
+    TEST_F(PosixStorageTest,ConcurrentWriteRead) {
+        PosixStorage ps(nr_blocks,path,true);
+        std::vector<std::thread> threads;
+        for(int t=0;t<4;t++) {
+            threads.emplace_back([&ps,t](){
+                uint8_t buffer[config::block_size];
+                for(BlockID i=t;i<nr_blocks;i+=4) {
+                    std::memset(buffer,(int)i,config::block_size);
+                    ps.write_block(i,buffer);
+                }
+            });
+        }
+        for(auto& t : threads) {
+            t.join();
+        }
+        uint8_t buffer[config::block_size];
+        for(BlockID i=0;i<nr_blocks;i++) {
+            ps.read_block(i,buffer);
+            EXPECT_EQ(buffer[0],(uint8_t)i);
+            EXPECT_EQ(buffer[config::block_size-1],(uint8_t)i);
+        }
+    }
+
+    TEST_F(PosixStorageTest,ReadWriteBlocks) {
+        PosixStorage ps(nr_blocks,path);
+        std::vector<BlockID> ids;
+        std::vector<Block> src(20), dst(20);
+        std::vector<const uint8_t*> srcs;
+        std::vector<uint8_t*> dsts;
+        // runs [10,20) and [40,50)
+        for(BlockID i=0;i<20;i++) {
+            ids.push_back(i < 10 ? 10 + i : 30 + i);
+            std::memset(src[i].data,(int)i+1,config::block_size);
+            srcs.push_back(src[i].data);
+            dsts.push_back(dst[i].data);
+        }
+        ps.write_blocks(ids,srcs);
+        ps.read_blocks(ids,dsts);
+        for(BlockID i=0;i<20;i++) {
+            EXPECT_EQ(0,std::memcmp(src[i].data,dst[i].data,config::block_size)) << "Data Differs at " << ids[i];
+        }
+        uint8_t buffer[config::block_size];
+        ps.read_block(45,buffer);
+        EXPECT_EQ(buffer[0],16);
+    }
+
+    TEST_F(PosixStorageTest,Discard) {
+        PosixStorage ps(nr_blocks,path);
+        uint8_t buffer[config::block_size];
+        std::memset(buffer,7,config::block_size);
+        for(BlockID i=8;i<16;i++) {
+            ps.write_block(i,buffer);
+        }
+        // the file systems the tests run on can punch holes
+        ps.discard(10,4);
+        ps.read_block(10,buffer);
+        EXPECT_EQ(buffer[0],0);
+        ps.read_block(13,buffer);
+        EXPECT_EQ(buffer[config::block_size-1],0);
+        ps.read_block(14,buffer);
+        EXPECT_EQ(buffer[0],7);
+        EXPECT_THROW(ps.discard(nr_blocks-1,2),fs_error);
+    }
+};
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <stdlib.h>
+#include "storage/uring_storage.h"
+#include "block/block.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <gtest/gtest.h>
+
+namespace solid {
+    class UringStorageTest : public testing::Test {
+    protected:
+        const static BlockID nr_blocks = 512;
+        std::string path;
+
+        void SetUp() {
+            char name[] = "/tmp/solidfs_storage_XXXXXX";
+            int fd = mkstemp(name);
+            ASSERT_GE(fd,0);
+            ASSERT_EQ(ftruncate(fd,nr_blocks * config::block_size),0);
+            close(fd);
+            path = name;
+        }
+
+        void TearDown() {
+            unlink(path.c_str());
+        }
+    };
+
+    TEST_F(UringStorageTest,WriteRead) {
+        UringStorage us(nr_blocks,path);
+        uint8_t buffer[config::block_size];
+        uint8_t buffer2[config::block_size];
+
+        for(int i=0;i<config::block_size;i++) {
+            buffer[i] = i;
+        }
+        us.write_block(7,buffer);
+        us.read_block(7,buffer2);
+        for(int i=0;i<config::block_size;i++) {
+            EXPECT_EQ(buffer[i],buffer2[i]) << "Data Differs at Block 7";
+        }
+        EXPECT_THROW(us.read_block(nr_blocks,buffer),fs_error);
+    }
+
+    // more requests than the ring depth, so that the queue has to wait for completions
+    TEST_F(UringStorageTest,AsyncWriteRead) {
+        UringStorage us(nr_blocks,path,32,8);
+        std::vector<Block> src(nr_blocks);
+        std::vector<Block> dst(nr_blocks);
+        std::vector<std::future<void>> futures;
+
+        for(BlockID i=0;i<nr_blocks;i++) {
+            std::memset(src[i].data,(int)i,config::block_size);
+            futures.push_back(us.write_block_async(i,src[i].data));
+        }
+        us.submit();
+        Storage::wait_all(futures);
+
+        futures.clear();
+        for(BlockID i=0;i<nr_blocks;i++) {
+            futures.push_back(us.read_block_async(i,dst[i].data));
+        }
+        us.submit();
+        Storage::wait_all(futures);
+        for(BlockID i=0;i<nr_blocks;i++) {
+            EXPECT_EQ(0,std::memcmp(src[i].data,dst[i].data,config::block_size)) << "Data Differs at Block " << i;
+        }
+    }
+};
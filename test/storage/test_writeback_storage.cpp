@@ -0,0 +1,128 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <vector>
+#include "storage/memory_storage.h"
+#include "storage/writeback_storage.h"
+#include "block/block.h"
+#include "utils/log_utils.h"
+#include "utils/fs_exception.h"
+#include <gtest/gtest.h>
+
+namespace solid {
+    GTEST_TEST(WriteBackStorageTest,WriteReadFlush) {
+        BlockID nr_blocks = 10;
+        MemoryStorage* ms = new MemoryStorage(nr_blocks);
+        // never committed by the timer during the test
+        WriteBackStorage wb(ms,3600 * 1000,1024);
+        uint8_t buffer[config::block_size];
+        uint8_t buffer2[config::block_size];
+
+        for(int i=0;i<config::block_size;i++) {
+            buffer[i] = i;
+        }
+        wb.write_block(3,buffer);
+        EXPECT_EQ(wb.nr_dirty(),1);
+
+        // the dirty copy is visible, but the inner storage is untouched
+        wb.read_block(3,buffer2);
+        EXPECT_EQ(0,std::memcmp(buffer,buffer2,config::block_size));
+        ms->read_block(3,buffer2);
+        EXPECT_EQ(buffer2[1],0);
+
+        wb.flush();
+        EXPECT_EQ(wb.nr_dirty(),0);
+        ms->read_block(3,buffer2);
+        EXPECT_EQ(0,std::memcmp(buffer,buffer2,config::block_size));
+    }
+
+    GTEST_TEST(WriteBackStorageTest,ThresholdCommit) {
+        BlockID nr_blocks = 64;
+        MemoryStorage* ms = new MemoryStorage(nr_blocks);
+        WriteBackStorage wb(ms,3600 * 1000,8);
+        std::vector<Block> src(8);
+        std::vector<BlockID> ids;
+        std::vector<const uint8_t*> srcs;
+        for(BlockID i=0;i<8;i++) {
+            std::memset(src[i].data,(int)i+1,config::block_size);
+            ids.push_back(i + 20);
+            srcs.push_back(src[i].data);
+        }
+        wb.write_blocks(ids,srcs);
+
+        // the commit thread picks up the group without any flush
+        for(int i=0;i<1000 && wb.nr_dirty() > 0;i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_EQ(wb.nr_dirty(),0);
+        wb.sync();
+        uint8_t buffer[config::block_size];
+        for(BlockID i=0;i<8;i++) {
+            ms->read_block(i + 20,buffer);
+            EXPECT_EQ(buffer[0],i+1) << "Data Differs at " << i + 20;
+        }
+    }
+
+    // the writes hold until go is set, the writes and the discards which reach it are logged
+    class GatedStorage: public MemoryStorage {
+    public:
+        std::promise<void> entered;
+        std::shared_future<void> go;
+        bool fail = false;
+        // +id for a write, -id for a discard
+        std::vector<int64_t> log;
+
+        GatedStorage(BlockID nr_blocks, std::shared_future<void> go) : MemoryStorage(nr_blocks), go(go) {};
+        void write_blocks(const std::vector<BlockID>& ids, const std::vector<const uint8_t*>& srcs) {
+            entered.set_value();
+            go.wait();
+            if(fail) {
+                throw fs_error("@write_blocks: injected failure");
+            }
+            for(auto id : ids) {
+                log.push_back(id);
+            }
+            MemoryStorage::write_blocks(ids, srcs);
+        }
+        void discard(BlockID id, uint64_t n) {
+            for(uint64_t i=0;i<n;i++) {
+                log.push_back(-(int64_t)(id + i));
+            }
+        }
+    };
+
+    GTEST_TEST(WriteBackStorageTest,DiscardDuringCommit) {
+        for(bool fail : {false,true}) {
+            std::promise<void> go;
+            GatedStorage* gs = new GatedStorage(16,go.get_future().share());
+            gs->fail = fail;
+            WriteBackStorage wb(gs,3600 * 1000,1024);
+            uint8_t buffer[config::block_size];
+            std::memset(buffer,7,config::block_size);
+            wb.write_blocks({4,5,6},{buffer,buffer,buffer});
+            std::thread t([&](){
+                try {
+                    wb.flush();
+                } catch (const fs_error& e) {
+                }
+            });
+            gs->entered.get_future().wait();
+            wb.discard(5,1);
+            go.set_value();
+            t.join();
+            if(fail) {
+                // the discarded block doesn't come back with the failed group
+                EXPECT_EQ(wb.nr_dirty(),2);
+                gs->fail = false;
+                gs->entered = std::promise<void>();
+                wb.flush();
+                EXPECT_EQ(gs->log,std::vector<int64_t>({-5,4,6}));
+            } else {
+                // the stale copy written after the discard is discarded again
+                EXPECT_EQ(gs->log,std::vector<int64_t>({-5,4,5,6,-5}));
+            }
+        }
+    }
+};